@@ -10,28 +10,42 @@
 #include "fileio/parse.h"
 #include "ui/TraceUI.h"
 #include "fileio/bitmap.h"
+#include "scene/texture.h"
+#include "scene/envmap.h"
 #include "math.h"
 extern TraceUI* traceUI;
 
 // Trace a top-level ray through normalized window coordinates (x,y)
 // through the projection plane, and out into the scene.  All we do is
 // enter the main ray-tracing method, getting things started by plugging
-// in an initial ray weight of (0.0,0.0,0.0) and an initial recursion depth of 0.
+// in an initial ray weight of (1.0,1.0,1.0) and the maximum recursion depth.
 vec3f RayTracer::trace( Scene *scene, double x, double y )
 {
     ray r( vec3f(0,0,0), vec3f(0,0,0) );
     scene->getCamera()->rayThrough( x,y,r );
-	return traceRay( scene, r, vec3f(traceUI->getThreshold(),traceUI->getThreshold(),traceUI->getThreshold()), traceUI->getDepth() ).clamp();
+	return traceRay( scene, r, vec3f(1.0,1.0,1.0), traceUI->getDepth() ).clamp();
+}
+
+// The key of the medium inside the object i hit, in mediaHistory.  An
+// instance's objects are the prototype's, so their order is the same in
+// every instance; the instance that was hit tells them apart.
+static std::pair<int, const Geometry*> mediumKey( const isect& i )
+{
+	return std::make_pair( i.obj->getOrder(), i.geometry );
 }
 
 // Do recursive ray tracing!  You'll want to insert a lot of code here
 // (or places called from here) to handle reflection, refraction, etc etc.
+//
+// weight is how much this ray contributes to the pixel: the product of the
+// kr/kt factors along its path.  Child rays whose weight falls below the
+// UI threshold are culled (see rayWeightScale).
 vec3f RayTracer::traceRay( Scene *scene, const ray& r, 
-	const vec3f& thresh, int depth )
+	const vec3f& weight, int depth )
 {
 	isect i;
 
-	if( scene->intersect( r, i ) && depth >=0) {
+	if( depth >= 0 && scene->intersect( r, i ) ) {
 		// YOUR CODE HERE
 
 		// An intersection occured!  We've got work to do.  For now,
@@ -43,55 +57,33 @@ vec3f RayTracer::traceRay( Scene *scene, const ray& r,
 		// more steps: add in the contributions from reflected and refracted
 		// rays.
 
+		i.footprint = pixelSpread * i.t;
 		if (traceUI->isEnableTextureMapping())
 		{
 			return SphereInverse(r, i);
 		}
 		const Material& m = i.getMaterial();
-		vec3f Intensity = m.shade(scene, r, i);
+		vec3f Intensity = m.shade(scene, r, i, weight);
+		vec3f P = r.at(i.t);
 		vec3f reflection = 2 * ((-r.getDirection().dot(i.N)) * i.N) + r.getDirection();
 		if (traceUI->isEnableGlossy() && depth > 0)
 		{
-			vec3f glossyReflections[4];
-			if (reflection[2] > RAY_EPSILON || reflection[2] < -RAY_EPSILON)
-			{
-				glossyReflections[0][0] = 1;
-				glossyReflections[0][1] = 1;
-				glossyReflections[0][2] = - (reflection[0] + reflection[1])/reflection[2];
-				glossyReflections[0] -= reflection;
-				float ratio = 32;
-				glossyReflections[0] = glossyReflections[0].normalize()/ratio;
-				glossyReflections[1] = glossyReflections[0].cross(reflection).normalize()/ratio;
-				glossyReflections[2] = reflection.cross(glossyReflections[0]).normalize()/ratio;
-				glossyReflections[3] = reflection.cross(glossyReflections[2]).normalize()/ratio;
-				for (int k = 0; k < 4; ++k)
-				{
-					glossyReflections[k] += reflection;
-				}
-				ray glossyReflection_rays[4] =
-				{
-					ray(r.at(i.t), glossyReflections[0].normalize()),
-					ray(r.at(i.t), glossyReflections[1].normalize()),
-					ray(r.at(i.t), glossyReflections[2].normalize()),
-					ray(r.at(i.t), glossyReflections[3].normalize())
-				};
-				for (int k = 0; k < 4; ++k)
-				{
-					Intensity += 0.2 * prod(m.kr, traceRay(scene, glossyReflection_rays[k], vec3f(1.0, 1.0, 1.0), 0));
-				}
-			}
-
+			Intensity += traceGlossy(scene, P, i.N, reflection.normalize(), m, weight, depth, r.getTime());
 		}
-		ray reflection_ray = ray(r.at(i.t), reflection.normalize());
-		if (traceUI->isEnableGlossy() && depth > 0)
+		else
 		{
-			Intensity += 0.2 * prod(m.kr,traceRay(scene, reflection_ray, vec3f(1.0,1.0,1.0), depth - 1));
+			vec3f reflection_weight = prod(weight, m.kr);
+			double scale = rayWeightScale(reflection_weight);
+			if (scale > 0.0 && depth > 0)
+			{
+				ray reflection_ray = ray(offsetRayOrigin(P, i.N, reflection), reflection.normalize(), r.getTime());
+				Intensity += scale * prod(m.kr,traceRay(scene, reflection_ray, scale * reflection_weight, depth - 1));
+			}
 		}
-		else Intensity += prod(m.kr,traceRay(scene, reflection_ray, vec3f(1.0,1.0,1.0), depth - 1));
 
 		if (!traceUI->isEnableGlossy())
 		{
-			vec3f conPoint = r.at(i.t); 
+			vec3f conPoint = P;
 			vec3f normal;
 			vec3f Rdir = 2 * (i.N*-r.getDirection()) * i.N - (-r.getDirection());
 			// Refraction part
@@ -102,7 +94,7 @@ vec3f RayTracer::traceRay( Scene *scene, const ray& r,
 				// take account total refraction effect
 				bool TotalRefraction = false; 
 				// opposite ray
-				ray oppR(conPoint, r.getDirection()); //without refraction
+				ray oppR(conPoint, r.getDirection(), r.getTime()); //without refraction
 			
 				// marker to simulate a stack
 				bool toAdd = false, toErase = false;
@@ -127,7 +119,7 @@ vec3f RayTracer::traceRay( Scene *scene, const ray& r,
 							indexA = mediaHistory.rbegin()->second.index;
 						}
 
-						mediaHistory.erase(i.obj->getOrder());
+						mediaHistory.erase(mediumKey(i));
 						toAdd = true;
 						if (mediaHistory.empty())
 						{
@@ -150,7 +142,7 @@ vec3f RayTracer::traceRay( Scene *scene, const ray& r,
 						{
 							indexA = mediaHistory.rbegin()->second.index;
 						}
-						mediaHistory.insert(make_pair(i.obj->getOrder(), i.getMaterial()));
+						mediaHistory.insert(make_pair(mediumKey(i), i.getMaterial()));
 						toErase = true;
 						indexB = mediaHistory.rbegin()->second.index;
 						normal = i.N;
@@ -170,45 +162,146 @@ vec3f RayTracer::traceRay( Scene *scene, const ray& r,
 						TotalRefraction = false;
 						double cos_t = sqrt(1 - sin_t*sin_t);
 						vec3f Tdir = (indexRatio*cos_i - cos_t)*normal - indexRatio*-r.getDirection();
-						oppR = ray(conPoint, Tdir);
-						if (!traceUI->isEnableFresnel()) {
-							Intensity += prod(i.getMaterial().kt, traceRay(scene, oppR, thresh, depth + 1));
+						oppR = ray(offsetRayOrigin(conPoint, i.N, Tdir), Tdir, r.getTime());
+						vec3f kt = i.getMaterial().kt;
+						if (traceUI->isEnableFresnel()) {
+							kt *= (1 - fresnel_coeff);
 						}
-						else
+						vec3f refraction_weight = prod(weight, kt);
+						double scale = rayWeightScale(refraction_weight);
+						if (scale > 0.0 && depth > 0)
 						{
-							Intensity += ((1 - fresnel_coeff)*prod(i.getMaterial().kt, traceRay(scene, oppR, thresh, depth + 1)));
+							Intensity += scale * prod(kt, traceRay(scene, oppR, scale * refraction_weight, depth - 1));
 						}
 					}
 				}
 
 				if (toAdd)
 				{
-					mediaHistory.insert(make_pair(i.obj->getOrder(), i.getMaterial()));
+					mediaHistory.insert(make_pair(mediumKey(i), i.getMaterial()));
 				}
 				if (toErase)
 				{
-					mediaHistory.erase(i.obj->getOrder());
+					mediaHistory.erase(mediumKey(i));
 				}
 			}
 		}
-		if (Intensity.length() < thresh.length() && depth == 0)
-		{
-			return vec3f(0, 0, 0);
-		}
 		return Intensity;
 	
 	} else {
 		// No intersection.  This ray travels to infinity, so we color
-		// it according to the background color, which in this (simple) case
-		// is just black.
-		if (backgroundImage && depth==traceUI->getDepth())
+		// it according to the environment map in its direction, or black
+		// if there is none.  pixelSpread is the angle one pixel covers.
+		if (depth >= 0)
 		{
-			return getbackgroundColor(scene->getCamera()->getnx(),scene->getCamera()->getny());
+			return getbackgroundColor(r.getDirection(), pixelSpread);
 		}
 		return vec3f( 0.0, 0.0, 0.0 );
 	}
 }
 
+// Glossy reflection off a surface with normal N, around the mirror
+// direction R, for a ray of the given weight.  The Phong lobe is the one
+// Material::shade uses for the highlight (exponent shininess * 128) and is
+// importance sampled, so every sample carries the same weight
+// weight * kr / samples.  The samples are stratified N-rooks style: sample k
+// falls in row k and column perm[k] of a samples x samples grid.  A sample
+// whose weight is below the threshold is not worth a ray, so weakly
+// reflective paths take fewer samples, down to the single mirror ray.
+// time is the incoming ray's (see ray::getTime).
+vec3f RayTracer::traceGlossy( Scene *scene, const vec3f& P, const vec3f& N,
+	const vec3f& R, const Material& m, const vec3f& weight, int depth, double time )
+{
+	vec3f reflection_weight = prod(weight, m.kr);
+	int samples = traceUI->getGlossySamples();
+	double threshold = traceUI->getThreshold();
+	if (threshold > 0.0)
+	{
+		samples = min(samples, int(maxComponent(reflection_weight) / threshold));
+	}
+	if (samples <= 1)
+	{
+		double scale = rayWeightScale(reflection_weight);
+		if (scale <= 0.0)
+		{
+			return vec3f(0.0, 0.0, 0.0);
+		}
+		ray reflection_ray = ray(offsetRayOrigin(P, N, R), R, time);
+		return scale * prod(m.kr, traceRay(scene, reflection_ray, scale * reflection_weight, depth - 1));
+	}
+	if (reflection_weight.iszero())
+	{
+		return vec3f(0.0, 0.0, 0.0);
+	}
+
+	const double pi = 3.1415926535;
+	double exponent = m.shininess * 128;
+
+	// orthonormal frame around the mirror direction
+	vec3f u = (fabs(R[0]) > 0.9 ? vec3f(0, 1, 0) : vec3f(1, 0, 0)).cross(R).normalize();
+	vec3f v = R.cross(u);
+
+	vector<int> perm(samples);
+	for (int k = 0; k < samples; ++k)
+	{
+		perm[k] = k;
+	}
+	for (int k = samples - 1; k > 0; --k)
+	{
+		swap(perm[k], perm[rand() % (k + 1)]);
+	}
+
+	vec3f sum;
+	for (int k = 0; k < samples; ++k)
+	{
+		double xi1 = (k + rand() / (RAND_MAX + 1.0)) / samples;
+		double xi2 = (perm[k] + rand() / (RAND_MAX + 1.0)) / samples;
+		double cos_theta = pow(xi1, 1.0 / (exponent + 1));
+		double sin_theta = sqrt(max(0.0, 1 - cos_theta*cos_theta));
+		double phi = 2 * pi * xi2;
+		vec3f dir = (cos(phi) * sin_theta) * u + (sin(phi) * sin_theta) * v + cos_theta * R;
+
+		// the part of the lobe that dips under the surface is absorbed
+		if ((dir * N) * (R * N) <= 0.0)
+		{
+			continue;
+		}
+		sum += traceRay(scene, ray(offsetRayOrigin(P, N, dir), dir, time), reflection_weight / samples, depth - 1);
+	}
+	return prod(m.kr, sum / samples);
+}
+
+// How a child ray of accumulated weight w should be traced.  Returns 0 if
+// it isn't worth tracing, otherwise the factor to scale both its weight and
+// its contribution by.  Rays at or above the UI threshold are always traced
+// (factor 1) and rays that can't contribute at all never are.  Below the
+// threshold the ray is dropped, or, with Russian roulette on, kept with
+// probability max(w) / threshold and scaled up by the inverse so that the
+// image stays unbiased on average.
+double RayTracer::rayWeightScale( const vec3f& w )
+{
+	double wmax = maxComponent(w);
+	if (wmax <= 0.0)
+	{
+		return 0.0;
+	}
+	double threshold = traceUI->getThreshold();
+	if (wmax >= threshold)
+	{
+		return 1.0;
+	}
+	if (!traceUI->isEnableRoulette())
+	{
+		return 0.0;
+	}
+	double survive = wmax / threshold;
+	if (rand() / (RAND_MAX + 1.0) >= survive)
+	{
+		return 0.0;
+	}
+	return 1.0 / survive;
+}
+
 RayTracer::RayTracer()
 {
 	buffer = NULL;
@@ -216,8 +309,9 @@ RayTracer::RayTracer()
 	scene = NULL;
 
 	m_bSceneLoaded = false;
-	backgroundImage = NULL;
-	textureMappingImage = NULL;
+	environment = NULL;
+	textureMap = NULL;
+	pixelSpread = 0.0;
 
 }
 
@@ -226,6 +320,8 @@ RayTracer::~RayTracer()
 {
 	delete [] buffer;
 	delete scene;
+	delete environment;
+	delete textureMap;
 }
 
 void RayTracer::getBuffer( unsigned char *&buf, int &w, int &h )
@@ -276,64 +372,48 @@ bool RayTracer::loadScene( char* fn )
 	return true;
 }
 
+// Images are turned into mip-mapped Textures once here, so lookups
+// during rendering are filtered and don't touch the raw BMP data.  The
+// background is a latitude/longitude environment map (see envmap.h).
 void RayTracer::loadbackgroundImage(char* fn){
-	unsigned char* data = NULL;
-	data = readBMP(fn, background_width, background_height);
+	int width, height;
+	unsigned char* data = readBMP(fn, width, height);
 	if (data)
 	{
-		if (backgroundImage)
-		{
-			delete []backgroundImage;
-		}
-		backgroundImage=data;
+		delete environment;
+		environment = new EnvironmentMap(data, width, height);
+		delete []data;
 	}
 }
 
 void RayTracer::loadtextureMappingImage(char* fn){
-	unsigned char* data = NULL;
-	data = readBMP(fn, texture_width, texture_height);
+	int width, height;
+	unsigned char* data = readBMP(fn, width, height);
 	if (data)
 	{
-		if (textureMappingImage)
-		{
-			delete []textureMappingImage;
-		}
-		textureMappingImage=data;
+		delete textureMap;
+		textureMap = new Texture(data, width, height);
+		delete []data;
 	}
 }
 
-vec3f RayTracer::getbackgroundColor(double x, double y){
-	if (!backgroundImage)
+// Color of the environment in direction dir, averaged over a cone spread
+// radians wide.  The environment map is only read, so this is safe to call
+// from several threads.
+vec3f RayTracer::getbackgroundColor(const vec3f& dir, double spread){
+	if (!environment)
 	{		
 		return vec3f(0.0,0.0,0.0);
 	}
-	if (x<0||x>=1||y<0||y>=1)
-	{
-		return vec3f(0.0,0.0,0.0);
-	}
-	int x1= x*background_width;
-	int y1= y*background_height;
-	double v1 = backgroundImage[(y1*background_width+x1)*3]/255.0;
-	double v2 = backgroundImage[(y1*background_width+x1)*3+1]/255.0;
-	double v3 = backgroundImage[(y1*background_width+x1)*3+2]/255.0;
-	return vec3f(v1,v2,v3);
+	return environment->sample(dir, spread);
 }
 
-vec3f RayTracer::gettextureColor(double x, double y){
-	if (!textureMappingImage)
+vec3f RayTracer::gettextureColor(double x, double y, double footprint){
+	if (!textureMap)
 	{		
 		return vec3f(0.0,0.0,0.0);
 	}
-	if (x<0||x>=1||y<0||y>=1)
-	{
-		return vec3f(0.0,0.0,0.0);
-	}
-	int x1= x*texture_width;
-	int y1= y*texture_height;
-	double v1 = textureMappingImage[(y1*texture_width+x1)*3]/255.0;
-	double v2 = textureMappingImage[(y1*texture_width+x1)*3+1]/255.0;
-	double v3 = textureMappingImage[(y1*texture_width+x1)*3+2]/255.0;
-	return vec3f(v1,v2,v3);
+	return textureMap->sample(x, y, footprint);
 }
 
 void RayTracer::traceSetup( int w, int h )
@@ -348,6 +428,14 @@ void RayTracer::traceSetup( int w, int h )
 		buffer = new unsigned char[ bufferSize ];
 	}
 	memset( buffer, 0, w*h*3 );
+
+	TextureCache::instance().beginFrame();
+
+	if( scene )
+		scene->setWatertight( traceUI->isEnableWatertight() );
+
+	// angle between neighbouring primary rays, used to size texture lookups
+	pixelSpread = scene ? scene->getCamera()->getNormalizedHeight() / h : 0.0;
 }
 
 void RayTracer::traceLines( int start, int stop )
@@ -359,62 +447,143 @@ void RayTracer::traceLines( int start, int stop )
 	if( stop > buffer_height )
 		stop = buffer_height;
 
+	// a scanline at a time keeps the ray array small
 	for( int j = start; j < stop; ++j )
-		for( int i = 0; i < buffer_width; ++i )
-			tracePixel(i,j);
+		traceTile(0, j, buffer_width, j + 1);
 }
 
-void RayTracer::tracePixel( int i, int j )
+// Trace pixels [x0,x1) x [y0,y1).  The camera generates all the primary
+// rays of the tile into one array first, then they are traced in order.
+void RayTracer::traceTile( int x0, int y0, int x1, int y1 )
 {
-	vec3f col;
-
 	if( !scene )
 		return;
 
-	// double x = double(i)/double(buffer_width);
-	// double y = double(j)/double(buffer_height);
-	// col = trace( scene,x,y );
-	
+	// jittered and blur samples move from pixel to pixel, so go one pixel
+	// at a time
+	if ((traceUI->isEnableJittering() || isBlurred()) && (x1 - x0 > 1 || y1 - y0 > 1))
+	{
+		for( int j = y0; j < y1; ++j )
+			for( int i = x0; i < x1; ++i )
+				traceTile(i, j, i + 1, j + 1);
+		return;
+	}
+
+	std::vector<PixelSample> samples;
+	getPixelSamples(samples);
+	int n = samples.size();
+
+	std::vector<ray> rays;
+	rays.reserve((x1 - x0) * (y1 - y0) * n);
+	scene->getCamera()->raysThroughTile(x0, y0, x1, y1, buffer_width, buffer_height, samples, rays);
+
+	int depth = traceUI->getDepth();
+	int k = 0;
+	for( int j = y0; j < y1; ++j )
+	{
+		for( int i = x0; i < x1; ++i )
+		{
+			vec3f col;
+			for( int s = 0; s < n; ++s )
+				col += traceRay( scene, rays[k++], vec3f(1.0,1.0,1.0), depth ).clamp();
+			col = col / n;
+
+			unsigned char *pixel = buffer + ( i + j * buffer_width ) * 3;
+
+			pixel[0] = (int)( 255.0 * col[0]);
+			pixel[1] = (int)( 255.0 * col[1]);
+			pixel[2] = (int)( 255.0 * col[2]);
+		}
+	}
+}
+
+void RayTracer::tracePixel( int i, int j )
+{
+	traceTile(i, j, i + 1, j + 1);
+}
+
+// Whether pixels need lens or time samples: the camera has an aperture or
+// something in the scene moves.
+bool RayTracer::isBlurred()
+{
+	return scene && (scene->getCamera()->getLensRadius() > 0.0 || scene->hasMotion());
+}
+
+// Where in each pixel to sample, from the UI settings: once at the
+// pixel's position, a (size+1) x (size+1) grid for antialiasing, or once at
+// a random offset when jittering.
+//
+// For depth of field and motion blur there are at least the UI's number of
+// blur samples, going round the positions above as often as needed.  Their
+// lens positions are stratified N-rooks style over the lens square, and
+// their times are stratified over the shutter interval, each in a different
+// random order so that lens, time and position don't correlate.
+void RayTracer::getPixelSamples( std::vector<PixelSample>& samples )
+{
+	samples.clear();
+	PixelSample s;
+	s.lensU = 0.5;
+	s.lensV = 0.5;
+	s.time = 0.0;
 	if (traceUI->isEnableJittering())
 	{
-		double jitter_x = double(rand() % 10 - 5)/10.0;
-		double jitter_y = double(rand() % 10 - 5)/10.0;
-		double x = double(i + jitter_x)/double(buffer_width);
-		double y = double(j + jitter_y)/double(buffer_height);
-		col = trace( scene, x, y);
+		s.dx = double(rand() % 10 - 5)/10.0;
+		s.dy = double(rand() % 10 - 5)/10.0;
+		samples.push_back(s);
 	}
 	else
 	{
 		int range = traceUI->getAntialiasingSize();
 		if (range == 0)
 		{
-			double x = double(i)/double(buffer_width);
-			double y = double(j)/double(buffer_height);
-			col = trace( scene, x, y);
+			s.dx = 0.0;
+			s.dy = 0.0;
+			samples.push_back(s);
 		}
-		else 
+		else
 		{
+			double step = 1.0/range;
 			for (int m = 0; m < range + 1; ++m)
 			{
-				double step = 1.0/range; 
 				for (int n = 0; n < range + 1; ++n)
 				{
-					double x = double(i - 0.5 + m * step)/double(buffer_width);
-					double y = double(j - 0.5 + n * step)/double(buffer_height);
-					col += trace( scene, x, y);
+					s.dx = -0.5 + m * step;
+					s.dy = -0.5 + n * step;
+					samples.push_back(s);
 				}
 			}
-			col = col / (range + 1) / (range + 1);
 		}
 	}
-	
 
+	if (!isBlurred())
+	{
+		return;
+	}
 
-	unsigned char *pixel = buffer + ( i + j * buffer_width ) * 3;
+	int positions = samples.size();
+	int n = max(positions, traceUI->getBlurSamples());
+	samples.resize(n);
+	for (int k = positions; k < n; ++k)
+	{
+		samples[k] = samples[k % positions];
+	}
 
-	pixel[0] = (int)( 255.0 * col[0]);
-	pixel[1] = (int)( 255.0 * col[1]);
-	pixel[2] = (int)( 255.0 * col[2]);
+	vector<int> lensPerm(n), timePerm(n);
+	for (int k = 0; k < n; ++k)
+	{
+		lensPerm[k] = timePerm[k] = k;
+	}
+	for (int k = n - 1; k > 0; --k)
+	{
+		swap(lensPerm[k], lensPerm[rand() % (k + 1)]);
+		swap(timePerm[k], timePerm[rand() % (k + 1)]);
+	}
+	for (int k = 0; k < n; ++k)
+	{
+		samples[k].lensU = (k + rand() / (RAND_MAX + 1.0)) / n;
+		samples[k].lensV = (lensPerm[k] + rand() / (RAND_MAX + 1.0)) / n;
+		samples[k].time = (timePerm[k] + rand() / (RAND_MAX + 1.0)) / n;
+	}
 }
 
 double RayTracer::getFresnelCoeff(isect& i, const ray& r)
@@ -437,7 +606,7 @@ double RayTracer::getFresnelCoeff(isect& i, const ray& r)
 			{
 				indexA = mediaHistory.rbegin()->second.index;
 			}
-			mediaHistory.erase(i.obj->getOrder());
+			mediaHistory.erase(mediumKey(i));
 			if (mediaHistory.empty())
 			{
 				indexB = 1.0;
@@ -447,7 +616,7 @@ double RayTracer::getFresnelCoeff(isect& i, const ray& r)
 				indexB = mediaHistory.rbegin()->second.index;
 			}
 			normal = -i.N;
-			mediaHistory.insert(make_pair(i.obj->getOrder(), i.getMaterial()));
+			mediaHistory.insert(make_pair(mediumKey(i), i.getMaterial()));
 		}
 		// For ray get in the object
 		else
@@ -461,9 +630,9 @@ double RayTracer::getFresnelCoeff(isect& i, const ray& r)
 				indexA = mediaHistory.rbegin()->second.index;
 			}
 			normal = i.N;
-			mediaHistory.insert(make_pair(i.obj->getOrder(), i.getMaterial()));
+			mediaHistory.insert(make_pair(mediumKey(i), i.getMaterial()));
 			indexB = mediaHistory.rbegin()->second.index;
-			mediaHistory.erase(i.obj->getOrder());
+			mediaHistory.erase(mediumKey(i));
 		}
 
 		double r0 = (indexA - indexB) / (indexA + indexB);
@@ -509,6 +678,17 @@ vec3f RayTracer::SphereInverse(const ray& r, isect& i)
 	{
 		u = 1- theta;
 	}
-	return gettextureColor(u, v);
+
+	// The pixel covers about pixelSpread * t of the surface (ignoring
+	// the path before this ray).  v runs over half a great circle of the
+	// object, whose radius we take from its bounding box.
+	double footprint = 0.0;
+	BoundingBox bounds = i.geometry->getPartBounds(i.obj);
+	double radius = 0.5 * maxComponent(bounds.max - bounds.min);
+	if (radius > 0.0)
+	{
+		footprint = i.footprint / (pipipi * radius);
+	}
+	return gettextureColor(u, v, footprint);
 
 }
\ No newline at end of file
@@ -6,6 +6,10 @@
 #include "scene/scene.h"
 #include "scene/ray.h"
 #include <map>
+#include <vector>
+
+class Texture;
+class EnvironmentMap;
 
 class RayTracer
 {
@@ -14,36 +18,43 @@ public:
     ~RayTracer();
 
     vec3f trace( Scene *scene, double x, double y );
-	vec3f traceRay( Scene *scene, const ray& r, const vec3f& thresh, int depth );
+	vec3f traceRay( Scene *scene, const ray& r, const vec3f& weight, int depth );
+	vec3f traceGlossy( Scene *scene, const vec3f& P, const vec3f& N,
+		const vec3f& R, const Material& m, const vec3f& weight, int depth, double time );
+	double rayWeightScale( const vec3f& w );
 
 
 	void getBuffer( unsigned char *&buf, int &w, int &h );
 	double aspectRatio();
 	void traceSetup( int w, int h );
 	void traceLines( int start = 0, int stop = 10000000 );
+	void traceTile( int x0, int y0, int x1, int y1 );
 	void tracePixel( int i, int j );
+	void getPixelSamples( std::vector<PixelSample>& samples );
+	bool isBlurred();
 
 	bool loadScene( char* fn );
 	void loadbackgroundImage( char* fn);
 	void loadtextureMappingImage( char* fn);
-	vec3f getbackgroundColor(double x, double y);
-	vec3f gettextureColor(double x, double y);
+	vec3f getbackgroundColor(const vec3f& dir, double spread);
+	vec3f gettextureColor(double x, double y, double footprint);
 
 	vec3f SphereInverse(const ray& r, isect& i);
 
 	bool sceneLoaded();
+	Scene *getScene() { return scene; }
 	double getFresnelCoeff(isect& i, const ray& r);
 
 private:
-	unsigned char *backgroundImage;
+	EnvironmentMap *environment;
 	unsigned char *buffer;
-	unsigned char *textureMappingImage;
+	Texture *textureMap;
 	int buffer_width, buffer_height;
 	int bufferSize;
-	int background_width, background_height;
-	int texture_width, texture_height;
+	double pixelSpread;
 	Scene *scene;
-	std::map<int, Material> mediaHistory;
+	// the media the ray is inside, by object order and the object hit
+	std::map<std::pair<int, const Geometry*>, Material> mediaHistory;
 	bool m_bSceneLoaded;
 };
 
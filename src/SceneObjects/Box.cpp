@@ -2,6 +2,7 @@
 #include <assert.h>
 
 #include "Box.h"
+#include "../vecmath/double4.h"
 
 bool intersectionParallel(double A, double B, double C, double D, const ray&r)
 {
@@ -18,6 +19,34 @@ double intersectQuadrilaterals(double A, double B, double C, double D, const ray
 	double t = -(pn.dot(p) + D)/(pn.dot(d));
 	return t;
 }
+// Slab test of r against the box from lo to hi.  tMin is where the ray
+// enters the last of the three slabs, so that slab's axis is the face it
+// hits.  A ray parallel to a slab gets infinite distances for it, which
+// rule the box out or not without a special case.
+static bool intersectSlabs( const vec3f& lo, const vec3f& hi, const ray& r,
+	double& tMin, int& axis )
+{
+	const vec3f& p = r.getPosition();
+	const vec3f& d = r.getDirection();
+
+	tMin = -1.0e308;
+	double tMax = 1.0e308;
+	axis = 0;
+	for( int a = 0; a < 3; ++a ) {
+		double inv = 1.0 / d[a];
+		double t0 = (lo[a] - p[a]) * inv;
+		double t1 = (hi[a] - p[a]) * inv;
+		double tNear = (inv < 0.0) ? t1 : t0;
+		double tFar = (inv < 0.0) ? t0 : t1;
+		if( tNear > tMin ) {
+			tMin = tNear;
+			axis = a;
+		}
+		tMax = (tFar < tMax) ? tFar : tMax;
+	}
+	return tMin <= tMax;
+}
+
 bool Box::intersectLocal( const ray& r, isect& i ) const
 {
 	// YOUR CODE HERE:
@@ -119,42 +148,138 @@ bool Box::intersectLocal( const ray& r, isect& i ) const
 	// }
 	// return intersect;
 
-	BoundingBox localbounds;
-	localbounds.max = vec3f(0.5, 0.5, 0.5);
-	localbounds.min = vec3f(-0.5, -0.5, -0.5);
+	double tMin;
+	int axis;
+	if( !intersectSlabs( vec3f( -0.5, -0.5, -0.5 ), vec3f( 0.5, 0.5, 0.5 ), r, tMin, axis ) ||
+		tMin < RAY_EPSILON ) {
+		return false;
+	}
 
-	double tMin = -1.0e308;
-	double tMax = 1.0e308;
-	
-	if (localbounds.intersect(r, tMin, tMax))
-	{
-
-		if (tMin < RAY_EPSILON)
-			return false;
-		i.obj = this;
-		i.t = tMin;
-		if (r.at(tMin)[0] - 0.5<RAY_EPSILON && r.at(tMin)[0] - 0.5>-RAY_EPSILON){
-			i.N = vec3f(1.0, 0.0, 0.0); 
-		}
-		else if (r.at(tMin)[0] + 0.5<RAY_EPSILON && r.at(tMin)[0] + 0.5>-RAY_EPSILON){
-			i.N = vec3f(-1.0, 0.0, 0.0); 
-		}
-		else if (r.at(tMin)[1] - 0.5<RAY_EPSILON && r.at(tMin)[1] - 0.5>-RAY_EPSILON){
-			i.N = vec3f(0.0, 1.0, 0.0); 
-		}
-		else if (r.at(tMin)[1] + 0.5<RAY_EPSILON && r.at(tMin)[1] + 0.5>-RAY_EPSILON){
-			i.N = vec3f(0.0, -1.0, 0.0); 
+	i.obj = this;
+	i.t = tMin;
+	vec3f N;
+	N[axis] = (r.getDirection()[axis] > 0.0) ? -1.0 : 1.0;
+	i.N = N;
+
+	return true;
+}
+
+// A box that is only scaled along the axes and translated is still a box
+// lined up with the axes in world space: its bounding box.
+void Box::bakeTransform()
+{
+	baked = getAxisAlignedTransform( scale, center );
+}
+
+bool Box::intersectBaked( const ray& r, isect& i ) const
+{
+	double tMin;
+	int axis;
+	if( !intersectSlabs( bounds.min, bounds.max, r, tMin, axis ) ) {
+		return false;
+	}
+
+	// RAY_EPSILON is in intersectLocal's units
+	vec3f d = r.getDirection();
+	vec3f localD( d[0] / scale[0], d[1] / scale[1], d[2] / scale[2] );
+	if( tMin * localD.length() < RAY_EPSILON ) {
+		return false;
+	}
+
+	vec3f P = r.at( tMin ) - center;
+	i.obj = this;
+	i.t = tMin;
+	i.localP = vec3f( P[0] / scale[0], P[1] / scale[1], P[2] / scale[2] );
+	vec3f N;
+	N[axis] = (d[axis] > 0.0) ? -1.0 : 1.0;
+	i.N = N;
+
+	return true;
+}
+
+// intersectLocal or intersectBaked, whichever each box would use, as one
+// slab test over four lanes.  A baked lane tests the world ray against the
+// box's bounds; any other tests its local ray against the unit box.  The
+// baked ones need no transform, so each lane's ray is set up on its own
+// rather than with toLocal4.
+int Box::nearest4( Geometry *const *objs, int n, const ray& r, double tMax )
+{
+	double p[3][4], d[3][4], lo[3][4], hi[3][4];
+	double epsScale[4];         // RAY_EPSILON is in local units
+	double tScale[4];           // local t is tScale times world t
+	for( int k = 0; k < 4; ++k ) {
+		// unused lanes repeat the first
+		if( k >= n ) {
+			for( int a = 0; a < 3; ++a ) {
+				p[a][k] = p[a][0];
+				d[a][k] = d[a][0];
+				lo[a][k] = lo[a][0];
+				hi[a][k] = hi[a][0];
+			}
+			epsScale[k] = epsScale[0];
+			tScale[k] = tScale[0];
+			continue;
 		}
-		else if (r.at(tMin)[2] - 0.5<RAY_EPSILON && r.at(tMin)[2] - 0.5>-RAY_EPSILON){
-			i.N = vec3f(0.0, 0.0, 1.0); 
+
+		const Box *box = static_cast<const Box*>( objs[k] );
+		vec3f P, D, L, H;
+		if( box->baked ) {
+			P = r.getPosition();
+			D = r.getDirection();
+			L = box->bounds.min;
+			H = box->bounds.max;
+			const vec3f& s = box->scale;
+			epsScale[k] = vec3f( D[0] / s[0], D[1] / s[1], D[2] / s[2] ).length();
+			tScale[k] = 1.0;
+		} else {
+			ray localRay( r );
+			mat3f movedNormi;
+			box->toLocal( r, localRay, tScale[k], movedNormi );
+			P = localRay.getPosition();
+			D = localRay.getDirection();
+			L = vec3f( -0.5, -0.5, -0.5 );
+			H = vec3f( 0.5, 0.5, 0.5 );
+			epsScale[k] = 1.0;
 		}
-		else if (r.at(tMin)[2] + 0.5<RAY_EPSILON && r.at(tMin)[2] + 0.5>-RAY_EPSILON){
-			i.N = vec3f(0.0, 0.0, -1.0); 
+		for( int a = 0; a < 3; ++a ) {
+			p[a][k] = P[a];
+			d[a][k] = D[a];
+			lo[a][k] = L[a];
+			hi[a][k] = H[a];
 		}
-		else;
+	}
 
-		return true;
+	// intersectSlabs
+	double4 tMin( -1.0e308 );
+	double4 tFar( 1.0e308 );
+	for( int a = 0; a < 3; ++a ) {
+		double4 pa( p[a][0], p[a][1], p[a][2], p[a][3] );
+		double4 inv = double4( 1.0 ) / double4( d[a][0], d[a][1], d[a][2], d[a][3] );
+		double4 t0 = (double4( lo[a][0], lo[a][1], lo[a][2], lo[a][3] ) - pa) * inv;
+		double4 t1 = (double4( hi[a][0], hi[a][1], hi[a][2], hi[a][3] ) - pa) * inv;
+		double4 backwards = inv < double4( 0.0 );
+		double4 tNear = select( backwards, t1, t0 );
+		double4 tLeave = select( backwards, t0, t1 );
+		tMin = select( tNear > tMin, tNear, tMin );
+		tFar = select( tLeave < tFar, tLeave, tFar );
 	}
-	return false;
+
+	double4 eps( epsScale[0], epsScale[1], epsScale[2], epsScale[3] );
+	double4 t = tMin / double4( tScale[0], tScale[1], tScale[2], tScale[3] );
+	double4 hit = andNot( tMin <= tFar, tMin * eps < double4( RAY_EPSILON ) ) &
+		(t < double4( tMax ));
+	return minLane( t, hit, n );
 }
 
+// Each face gets the whole image, mapped along the two axes it spans.
+void Box::getUV( const vec3f& P, double& u, double& v ) const
+{
+	int axis = 0;
+	for( int k = 1; k < 3; ++k ) {
+		if( fabs( P[k] ) > fabs( P[axis] ) ) {
+			axis = k;
+		}
+	}
+	u = P[ (axis + 1) % 3 ] + 0.5;
+	v = P[ (axis + 2) % 3 ] + 0.5;
+}
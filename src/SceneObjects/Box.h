@@ -7,12 +7,22 @@ class Box
 	: public MaterialSceneObject
 {
 public:
-	Box( Scene *scene, Material *mat )
+	Box( Scene *scene, int mat )
 		: MaterialSceneObject( scene, mat )
 	{
 	}
 
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
+	virtual void bakeTransform();
+	virtual bool intersectBaked( const ray& r, isect& i ) const;
+
+	// Of the n <= 4 boxes in objs, the one r hits first before tMax, as
+	// intersect would find it, or -1 if it hits none.  The four are tested
+	// together, a lane each (see double4.h); only the distances are worked
+	// out, so the caller then intersects the one returned.
+	static int nearest4( Geometry *const *objs, int n, const ray& r, double tMax );
+
+	virtual void getUV( const vec3f& P, double& u, double& v ) const;
 	virtual bool hasBoundingBoxCapability() const { return true; }
     virtual BoundingBox ComputeLocalBoundingBox()
     {
@@ -21,6 +31,11 @@ public:
 		localbounds.min = vec3f(-0.5, -0.5, -0.5);
         return localbounds;
     }
+
+private:
+	// when baked; the world box is its bounding box
+	vec3f center;
+	vec3f scale;
 };
 
 #endif // __BOX_H__
@@ -1,144 +1,153 @@
-
-#include <cmath>
-
-#include "Cone.h"
-
-bool Cone::intersectLocal( const ray& r, isect& i ) const
-{
-	i.obj = this;
-
-	if( intersectCaps( r, i ) ) {
-		isect ii;
-		if( intersectBody( r, ii ) ) {
-			if( ii.t < i.t ) {
-				i = ii;
-				i.obj = this;
-			}
-		}
-		return true;
-	} else {
-		return intersectBody( r, i );
-	}
-}
-
-
-bool Cone::intersectBody( const ray& r, isect& i ) const
-{
-	vec3f d = r.getDirection();
-	vec3f p = r.getPosition();
-
-	double a = (d[0]*d[0]) + (d[1]*d[1]) - (C*d[2]*d[2]);
-	double b = 2.0 * (d[0]*p[0] + d[1]*p[1] - C*d[2]*p[2]) - B*d[2];
-	double c = (p[0]*p[0]) + (p[1]*p[1]) - A - (B*p[2]) - (C*p[2]*p[2]);
-
-	double disc = b*b - 4.0*a*c;
-
-	if( disc <= 0.0 ) {
-		return false;
-	}
-
-	disc = sqrt( disc );
-
-	double t1 = (-b - disc) / (2.0 * a);
-	double t2 = (-b + disc) / (2.0 * a);
-
-	if( t2 < RAY_EPSILON ) {
-		return false;
-	}
-
-	if( t1 > RAY_EPSILON ) {
-		// Two intersections.
-		vec3f P = r.at( t1 );
-		double z = P[2];
-		if( z >= 0.0 && z <= height ) {
-			// It's okay.
-			i.t = t1;
-            i.N = vec3f( P[0], P[1], 
-              -(C*P[2]+(t_radius-b_radius)*t_radius/height)).normalize();
-				
-			
-			return true;
-		}
-	}
-
-	vec3f P = r.at( t2 );
-	double z = P[2];
-	if( z >= 0.0 && z <= height ) {
-		i.t = t2;
-        i.N = vec3f( P[0], P[1], 
-              -(C*P[2]+(t_radius-b_radius)*t_radius/height)).normalize();
-		// In case we are _inside_ the _uncapped_ cone, we need to flip the normal.
-		// Essentially, the cone in this case is a double-sided surface
-		// and has _2_ normals
-	
-		if( !capped && (i.N).dot( r.getDirection() ) > 0 )
-				i.N = -i.N;
-
-        return true;
-	}
-
-	return false;
-}
-
-bool Cone::intersectCaps( const ray& r, isect& i ) const
-{
-	if( !capped ) {
-		return false;
-	}
-
-	double pz = r.getPosition()[2];
-	double dz = r.getDirection()[2];
-
-	if( 0.0 == dz ) {
-		return false;
-	}
-
-	double t1;
-	double t2;
-	double r1;
-	double r2;
-
-	if( dz > 0.0 ) {
-		t1 = (-pz)/dz;
-		t2 = (height-pz)/dz;
-		r1 = b_radius;
-		r2 = t_radius;
-	} else {
-		t1 = (height-pz)/dz;
-		t2 = (-pz)/dz;
-		r1 = t_radius;
-		r2 = b_radius;
-	}
-
-	if( t2 < RAY_EPSILON ) {
-		return false;
-	}
-
-	if( t1 >= RAY_EPSILON ) {
-		vec3f p( r.at( t1 ) );
-		if( (p[0]*p[0] + p[1]*p[1]) <= r1 * r1 ) {
-			i.t = t1;
-			if( dz > 0.0 ) {
-				// Intersection with cap at z = 0.
-				i.N = vec3f( 0.0, 0.0, -1.0 );
-			} else {
-				i.N = vec3f( 0.0, 0.0, 1.0 );
-			}
-			return true;
-		}
-	}
-
-	vec3f p( r.at( t2 ) );
-	if( (p[0]*p[0] + p[1]*p[1]) <= r2 * r2 ) {
-		i.t = t2;
-		if( dz > 0.0 ) {
-			// Intersection with interior of cap at z = 1.
-			i.N = vec3f( 0.0, 0.0, 1.0 );
-		} else {
-			i.N = vec3f( 0.0, 0.0, -1.0 );
-		}
-		return true;
-	}
-
-	return false;
-}
+
+#include <cmath>
+
+#include "Cone.h"
+#include "../vecmath/double4.h"
+
+// As the cylinder: the body and the caps in one pass, keeping the nearest
+// hit, with a cap winning a tie.
+bool Cone::intersectLocal( const ray& r, isect& i ) const
+{
+	const vec3f& p = r.getPosition();
+	const vec3f& d = r.getDirection();
+
+	double tBest = 1.0e308;
+	vec3f N;
+
+	// the body: x^2 + y^2 = (b_radius + (t_radius - b_radius) z / height)^2,
+	// for z in [0, height]
+	double a = (d[0]*d[0]) + (d[1]*d[1]) - (C*d[2]*d[2]);
+	double b = 2.0 * (d[0]*p[0] + d[1]*p[1] - C*d[2]*p[2]) - B*d[2];
+	double c = (p[0]*p[0]) + (p[1]*p[1]) - A - (B*p[2]) - (C*p[2]*p[2]);
+	double disc = b*b - 4.0*a*c;
+
+	if( disc > 0.0 ) {
+		disc = sqrt( disc );
+		double t1 = (-b - disc) / (2.0 * a);
+		double t2 = (-b + disc) / (2.0 * a);
+		double z1 = p[2] + t1 * d[2];
+		double z2 = p[2] + t2 * d[2];
+		double slope = (t_radius - b_radius) * t_radius / height;
+
+		if( t2 >= RAY_EPSILON && t1 > RAY_EPSILON && z1 >= 0.0 && z1 <= height ) {
+			tBest = t1;
+			N = vec3f( p[0] + t1 * d[0], p[1] + t1 * d[1], -(C*z1 + slope) ).normalize();
+		} else if( t2 >= RAY_EPSILON && z2 >= 0.0 && z2 <= height ) {
+			tBest = t2;
+			N = vec3f( p[0] + t2 * d[0], p[1] + t2 * d[1], -(C*z2 + slope) ).normalize();
+			// In case we are _inside_ the _uncapped_ cone, we need to flip the normal.
+			// Essentially, the cone in this case is a double-sided surface
+			// and has _2_ normals
+			if( !capped && N.dot( d ) > 0 ) {
+				N = -N;
+			}
+		}
+	}
+
+	// the caps, at z = 0 facing down and z = height facing up
+	if( capped && d[2] != 0.0 ) {
+		double invDz = 1.0 / d[2];
+		for( int k = 0; k < 2; ++k ) {
+			double t = ((k ? height : 0.0) - p[2]) * invDz;
+			double x = p[0] + t * d[0];
+			double y = p[1] + t * d[1];
+			double radius = k ? t_radius : b_radius;
+			if( t >= RAY_EPSILON && t <= tBest && x*x + y*y <= radius * radius ) {
+				tBest = t;
+				N = vec3f( 0.0, 0.0, k ? 1.0 : -1.0 );
+			}
+		}
+	}
+
+	if( tBest == 1.0e308 ) {
+		return false;
+	}
+
+	i.obj = this;
+	i.t = tBest;
+	i.N = N;
+	return true;
+}
+
+// intersectLocal over four lanes, each with its cone's local ray and
+// shape.
+int Cone::nearest4( Geometry *const *objs, int n, const ray& r, double tMax )
+{
+	double4 p[3], d[3], length;
+	toLocal4( objs, n, r, p, d, length );
+	const double4& px = p[0];
+	const double4& py = p[1];
+	const double4& pz = p[2];
+	const double4& dx = d[0];
+	const double4& dy = d[1];
+	const double4& dz = d[2];
+
+	double capped[4], A[4], B[4], C[4], height[4], bottom[4], top[4];
+	for( int k = 0; k < 4; ++k ) {
+		const Cone *cone = static_cast<const Cone*>( objs[ k < n ? k : 0 ] );
+		capped[k] = double4::maskValue( cone->capped );
+		A[k] = cone->A;
+		B[k] = cone->B;
+		C[k] = cone->C;
+		height[k] = cone->height;
+		bottom[k] = cone->b_radius;
+		top[k] = cone->t_radius;
+	}
+
+	double4 a4( A[0], A[1], A[2], A[3] );
+	double4 b4( B[0], B[1], B[2], B[3] );
+	double4 c4( C[0], C[1], C[2], C[3] );
+	double4 h( height[0], height[1], height[2], height[3] );
+	double4 zero( 0.0 ), eps( RAY_EPSILON ), none( 1.0e308 );
+
+	// the body; most rays miss it in every lane, and skip the divisions
+	double4 a = (dx*dx) + (dy*dy) - (c4*dz*dz);
+	double4 b = double4( 2.0 ) * (dx*px + dy*py - c4*dz*pz) - b4*dz;
+	double4 c = (px*px) + (py*py) - a4 - (b4*pz) - (c4*pz*pz);
+	double4 disc = b*b - double4( 4.0 )*a*c;
+	double4 body = disc > zero;
+	double4 tBest = none;
+	if( any( body ) ) {
+		disc = sqrt( disc );
+		double4 t1 = (-b - disc) / (double4( 2.0 ) * a);
+		double4 t2 = (-b + disc) / (double4( 2.0 ) * a);
+		double4 z1 = pz + t1 * dz;
+		double4 z2 = pz + t2 * dz;
+		double4 nearSide = body & (t2 >= eps) & (t1 > eps) & (z1 >= zero) & (z1 <= h);
+		double4 farSide = andNot( body & (t2 >= eps) & (z2 >= zero) & (z2 <= h), nearSide );
+		tBest = select( nearSide, t1, select( farSide, t2, none ) );
+	}
+
+	// the caps
+	double4 caps = double4( capped[0], capped[1], capped[2], capped[3] ) & (dz != zero);
+	if( any( caps ) ) {
+		double4 invDz = double4( 1.0 ) / dz;
+		for( int k = 0; k < 2; ++k ) {
+			double4 t = ((k ? h : zero) - pz) * invDz;
+			double4 x = px + t * dx;
+			double4 y = py + t * dy;
+			double4 radius = k ? double4( top[0], top[1], top[2], top[3] )
+				: double4( bottom[0], bottom[1], bottom[2], bottom[3] );
+			double4 cap = caps & (t >= eps) & (t <= tBest) & (x*x + y*y <= radius * radius);
+			tBest = select( cap, t, tBest );
+		}
+	}
+
+	double4 hit = tBest != none;
+	if( !any( hit ) ) {
+		return -1;
+	}
+	double4 t = tBest / length;
+	return minLane( t, hit & (t < double4( tMax )), n );
+}
+
+// Same projection as the cylinder, with v running from the base to the top.
+void Cone::getUV( const vec3f& P, double& u, double& v ) const
+{
+	const double pi = 3.1415926535;
+	u = atan2( P[1], P[0] ) / (2 * pi);
+	if( u < 0.0 ) {
+		u += 1.0;
+	}
+	v = P[2] / height;
+}
@@ -7,7 +7,7 @@ class Cone
 	: public MaterialSceneObject
 {
 public:
-	Cone( Scene *scene, Material *mat, 
+	Cone( Scene *scene, int mat, 
 			double h = 1.0, double br = 1.0, double tr = 0.0, 
 			bool cap = false )
 		: MaterialSceneObject( scene, mat )
@@ -21,6 +21,12 @@ public:
 	}
 
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
+
+	// As Box::nearest4: of the n <= 4 cones in objs, the one r hits
+	// first before tMax, or -1.
+	static int nearest4( Geometry *const *objs, int n, const ray& r, double tMax );
+
+	virtual void getUV( const vec3f& P, double& u, double& v ) const;
 	virtual bool hasBoundingBoxCapability() const { return true; }
 
     virtual BoundingBox ComputeLocalBoundingBox()
@@ -33,10 +39,6 @@ public:
         return localbounds;
     }
 
-	bool intersectBody( const ray& r, isect& i ) const;
-	bool intersectCaps( const ray& r, isect& i ) const;
-
-
 protected:
 	void computeABC()
 	{
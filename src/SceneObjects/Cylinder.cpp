@@ -1,143 +1,142 @@
 #include <cmath>
 
 #include "Cylinder.h"
+#include "../vecmath/double4.h"
 
+// The body and the caps are tested in one pass, keeping the nearest of
+// their hits past RAY_EPSILON.  A cap wins a tie with the body.
 bool Cylinder::intersectLocal( const ray& r, isect& i ) const
 {
-	i.obj = this;
-
-	if( intersectCaps( r, i ) ) {
-		isect ii;
-		if( intersectBody( r, ii ) ) {
-			if( ii.t < i.t ) {
-				i = ii;
-				i.obj = this;
-			}
-		}
-		return true;
-	} else {
-		return intersectBody( r, i );
-	}
-}
-
-bool Cylinder::intersectBody( const ray& r, isect& i ) const
-{
-	double x0 = r.getPosition()[0];
-	double y0 = r.getPosition()[1];
-	double x1 = r.getDirection()[0];
-	double y1 = r.getDirection()[1];
+	const vec3f& p = r.getPosition();
+	const vec3f& d = r.getDirection();
 
-	double a = x1*x1+y1*y1;
-	double b = 2.0*(x0*x1 + y0*y1);
-	double c = x0*x0 + y0*y0 - 1.0;
-
-	if( 0.0 == a ) {
-		// This implies that x1 = 0.0 and y1 = 0.0, which further
-		// implies that the ray is aligned with the body of the cylinder,
-		// so no intersection.
-		return false;
-	}
+	double tBest = 1.0e308;
+	vec3f N;
+	bool throughSide = false;
 
+	// the body: x^2 + y^2 = 1, for z in [0, 1]
+	double a = d[0]*d[0] + d[1]*d[1];
+	double b = 2.0*(p[0]*d[0] + p[1]*d[1]);
+	double c = p[0]*p[0] + p[1]*p[1] - 1.0;
 	double discriminant = b*b - 4.0*a*c;
 
-	if( discriminant < 0.0 ) {
-		return false;
-	}
-	
-	discriminant = sqrt( discriminant );
-
-	double t2 = (-b + discriminant) / (2.0 * a);
-
-	if( t2 <= RAY_EPSILON ) {
-		return false;
+	// a is 0 for a ray along the axis, which can't hit the body
+	if( a != 0.0 && discriminant >= 0.0 ) {
+		discriminant = sqrt( discriminant );
+		double t1 = (-b - discriminant) / (2.0 * a);
+		double t2 = (-b + discriminant) / (2.0 * a);
+		double z1 = p[2] + t1 * d[2];
+		double z2 = p[2] + t2 * d[2];
+
+		// the point is on the unit circle, so (x, y, 0) is already unit
+		if( t1 > RAY_EPSILON && z1 >= 0.0 && z1 <= 1.0 ) {
+			throughSide = true;
+			tBest = t1;
+			N = vec3f( p[0] + t1 * d[0], p[1] + t1 * d[1], 0.0 );
+		} else if( t2 > RAY_EPSILON && z2 >= 0.0 && z2 <= 1.0 ) {
+			tBest = t2;
+			N = vec3f( p[0] + t2 * d[0], p[1] + t2 * d[1], 0.0 );
+			// From inside an uncapped cylinder the body is seen from
+			// the back, so it is double sided.
+			if( !capped && N.dot( d ) > 0 ) {
+				N = -N;
+			}
+		}
 	}
 
-	double t1 = (-b - discriminant) / (2.0 * a);
-
-	if( t1 > RAY_EPSILON ) {
-		// Two intersections.
-		vec3f P = r.at( t1 );
-		double z = P[2];
-		if( z >= 0.0 && z <= 1.0 ) {
-			// It's okay.
-			i.t = t1;
-			i.N = vec3f( P[0], P[1], 0.0 ).normalize();
-			return true;
+	// The caps, at z = 0 facing down and z = 1 facing up.  A ray that comes
+	// in through the side can't reach a cap first.
+	if( capped && !throughSide && d[2] != 0.0 ) {
+		double invDz = 1.0 / d[2];
+		for( int k = 0; k < 2; ++k ) {
+			double t = (k - p[2]) * invDz;
+			double x = p[0] + t * d[0];
+			double y = p[1] + t * d[1];
+			if( t >= RAY_EPSILON && t <= tBest && x*x + y*y <= 1.0 ) {
+				tBest = t;
+				N = vec3f( 0.0, 0.0, k ? 1.0 : -1.0 );
+			}
 		}
 	}
 
-	vec3f P = r.at( t2 );
-	double z = P[2];
-	if( z >= 0.0 && z <= 1.0 ) {
-		i.t = t2;
-
-		vec3f normal( P[0], P[1], 0.0 );
-		// In case we are _inside_ the _uncapped_ cone, we need to flip the normal.
-		// Essentially, the cone in this case is a double-sided surface
-		// and has _2_ normals
-		if( !capped && normal.dot( r.getDirection() ) > 0 )
-			normal = -normal;
-
-		i.N = normal.normalize();
-		return true;
+	if( tBest == 1.0e308 ) {
+		return false;
 	}
 
-	return false;
+	i.obj = this;
+	i.t = tBest;
+	i.N = N;
+	return true;
 }
 
-bool Cylinder::intersectCaps( const ray& r, isect& i ) const
+// intersectLocal over four lanes, each with its cylinder's local ray.
+int Cylinder::nearest4( Geometry *const *objs, int n, const ray& r, double tMax )
 {
-	if( !capped ) {
-		return false;
+	double4 p[3], d[3], length;
+	toLocal4( objs, n, r, p, d, length );
+	const double4& px = p[0];
+	const double4& py = p[1];
+	const double4& pz = p[2];
+	const double4& dx = d[0];
+	const double4& dy = d[1];
+	const double4& dz = d[2];
+
+	double capped[4];
+	for( int k = 0; k < 4; ++k ) {
+		const Cylinder *cyl = static_cast<const Cylinder*>( objs[ k < n ? k : 0 ] );
+		capped[k] = double4::maskValue( cyl->capped );
 	}
-
-	double pz = r.getPosition()[2];
-	double dz = r.getDirection()[2];
-
-	if( 0.0 == dz ) {
-		return false;
+	double4 zero( 0.0 ), one( 1.0 ), eps( RAY_EPSILON ), none( 1.0e308 );
+
+	// the body; most rays miss it in every lane, and skip the divisions
+	double4 a = dx*dx + dy*dy;
+	double4 b = double4( 2.0 )*(px*dx + py*dy);
+	double4 c = px*px + py*py - one;
+	double4 discriminant = b*b - double4( 4.0 )*a*c;
+	double4 body = (a != zero) & (discriminant >= zero);
+	double4 tBest = none;
+	double4 throughSide = zero;
+	if( any( body ) ) {
+		discriminant = sqrt( discriminant );
+		double4 t1 = (-b - discriminant) / (double4( 2.0 ) * a);
+		double4 t2 = (-b + discriminant) / (double4( 2.0 ) * a);
+		double4 z1 = pz + t1 * dz;
+		double4 z2 = pz + t2 * dz;
+		throughSide = body & (t1 > eps) & (z1 >= zero) & (z1 <= one);
+		double4 farSide = andNot( body & (t2 > eps) & (z2 >= zero) & (z2 <= one), throughSide );
+		tBest = select( throughSide, t1, select( farSide, t2, none ) );
 	}
 
-	double t1;
-	double t2;
-
-	if( dz > 0.0 ) {
-		t1 = (-pz)/dz;
-		t2 = (1.0-pz)/dz;
-	} else {
-		t1 = (1.0-pz)/dz;
-		t2 = (-pz)/dz;
-	}
-
-	if( t2 < RAY_EPSILON ) {
-		return false;
-	}
-
-	if( t1 >= RAY_EPSILON ) {
-		vec3f p( r.at( t1 ) );
-		if( (p[0]*p[0] + p[1]*p[1]) <= 1.0 ) {
-			i.t = t1;
-			if( dz > 0.0 ) {
-				// Intersection with cap at z = 0.
-				i.N = vec3f( 0.0, 0.0, -1.0 );
-			} else {
-				i.N = vec3f( 0.0, 0.0, 1.0 );
-			}
-			return true;
+	// the caps
+	double4 caps = andNot( double4( capped[0], capped[1], capped[2], capped[3] ) &
+		(dz != zero), throughSide );
+	if( any( caps ) ) {
+		double4 invDz = one / dz;
+		for( int k = 0; k < 2; ++k ) {
+			double4 t = (double4( k ) - pz) * invDz;
+			double4 x = px + t * dx;
+			double4 y = py + t * dy;
+			double4 cap = caps & (t >= eps) & (t <= tBest) & (x*x + y*y <= one);
+			tBest = select( cap, t, tBest );
 		}
 	}
 
-	vec3f p( r.at( t2 ) );
-	if( (p[0]*p[0] + p[1]*p[1]) <= 1.0 ) {
-		i.t = t2;
-		if( dz > 0.0 ) {
-			// Intersection with cap at z = 1.
-			i.N = vec3f( 0.0, 0.0, 1.0 );
-		} else {
-			i.N = vec3f( 0.0, 0.0, -1.0 );
-		}
-		return true;
+	double4 hit = tBest != none;
+	if( !any( hit ) ) {
+		return -1;
 	}
+	double4 t = tBest / length;
+	return minLane( t, hit & (t < double4( tMax )), n );
+}
 
-	return false;
+// Cylindrical projection: u goes around the z axis, v along it.  The caps
+// just repeat the image's edge.
+void Cylinder::getUV( const vec3f& P, double& u, double& v ) const
+{
+	const double pi = 3.1415926535;
+	u = atan2( P[1], P[0] ) / (2 * pi);
+	if( u < 0.0 ) {
+		u += 1.0;
+	}
+	v = P[2];
 }
@@ -7,12 +7,18 @@ class Cylinder
 	: public MaterialSceneObject
 {
 public:
-	Cylinder( Scene *scene, Material *mat , bool cap = true)
+	Cylinder( Scene *scene, int mat , bool cap = true)
 		: MaterialSceneObject( scene, mat ), capped( cap )
 	{
 	}
 
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
+
+	// As Box::nearest4: of the n <= 4 cylinders in objs, the one r hits
+	// first before tMax, or -1.
+	static int nearest4( Geometry *const *objs, int n, const ray& r, double tMax );
+
+	virtual void getUV( const vec3f& P, double& u, double& v ) const;
 	virtual bool hasBoundingBoxCapability() const { return true; }
 
     virtual BoundingBox ComputeLocalBoundingBox()
@@ -23,8 +29,6 @@ public:
         return localbounds;
     }
 
-    bool intersectBody( const ray& r, isect& i ) const;
-	bool intersectCaps( const ray& r, isect& i ) const;
 
 protected:
 	bool capped;
@@ -34,3 +34,60 @@ bool Sphere::intersectLocal( const ray& r, isect& i ) const
 	return true;
 }
 
+// A sphere that is only translated and scaled the same along every axis
+// is still a sphere in world space.
+void Sphere::bakeTransform()
+{
+	vec3f scale;
+	baked = getAxisAlignedTransform( scale, center ) &&
+		scale[0] > 0.0 && scale[0] == scale[1] && scale[1] == scale[2];
+	radius = scale[0];
+}
+
+bool Sphere::intersectBaked( const ray& r, isect& i ) const
+{
+	// as intersectLocal, but r's direction needn't be a unit vector
+	vec3f d = r.getDirection();
+	vec3f v = center - r.getPosition();
+	double a = d.length_squared();
+	double b = v.dot(d);
+	double discriminant = b*b - a * (v.dot(v) - radius*radius);
+
+	if( discriminant < 0.0 ) {
+		return false;
+	}
+
+	// RAY_EPSILON is in intersectLocal's units
+	double epsilon = RAY_EPSILON * radius / sqrt( a );
+
+	discriminant = sqrt( discriminant );
+	double t2 = (b + discriminant) / a;
+
+	if( t2 <= epsilon ) {
+		return false;
+	}
+
+	i.obj = this;
+
+	double t1 = (b - discriminant) / a;
+	i.t = (t1 > epsilon) ? t1 : t2;
+	i.localP = (r.at( i.t ) - center) / radius;
+	i.N = i.localP.normalize();
+
+	return true;
+}
+
+
+// Latitude/longitude: u goes around the y axis, v from the bottom pole (-y)
+// to the top one.
+void Sphere::getUV( const vec3f& P, double& u, double& v ) const
+{
+	const double pi = 3.1415926535;
+	vec3f N = P.normalize();
+	u = atan2( -N[2], N[0] ) / (2 * pi);
+	if( u < 0.0 ) {
+		u += 1.0;
+	}
+	double y = N[1] < -1.0 ? -1.0 : (N[1] > 1.0 ? 1.0 : N[1]);
+	v = acos( -y ) / pi;
+}
@@ -7,12 +7,15 @@ class Sphere
 	: public MaterialSceneObject
 {
 public:
-	Sphere( Scene *scene, Material *mat )
+	Sphere( Scene *scene, int mat )
 		: MaterialSceneObject( scene, mat )
 	{
 	}
     
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
+	virtual void bakeTransform();
+	virtual bool intersectBaked( const ray& r, isect& i ) const;
+	virtual void getUV( const vec3f& P, double& u, double& v ) const;
 	virtual bool hasBoundingBoxCapability() const { return true; }
 
     virtual BoundingBox ComputeLocalBoundingBox()
@@ -22,5 +25,10 @@ public:
 		localbounds.max = vec3f(1.0f, 1.0f, 1.0f);
         return localbounds;
     }
+
+private:
+	// in world space, when baked
+	vec3f center;
+	double radius;
 };
 #endif // __SPHERE_H__
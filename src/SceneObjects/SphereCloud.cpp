@@ -0,0 +1,254 @@
+#include <cmath>
+#include <cfloat>
+#include <cstdio>
+#include <algorithm>
+
+#include "SphereCloud.h"
+
+// Spheres per leaf.
+static const int LEAF_SIZE = 4;
+
+// The tree is split at the median, so it is about log2(n / LEAF_SIZE)
+// deep; this is plenty for any number of spheres that fits in memory.
+static const int MAX_STACK = 64;
+
+// float versions of v that are no greater, and no less, than it, so that
+// the node boxes never cut off the edge of a sphere
+static float roundDown( double v )
+{
+	float f = (float)v;
+	return (f > v) ? (float)(f - fabs( f ) * FLT_EPSILON - FLT_MIN) : f;
+}
+
+static float roundUp( double v )
+{
+	float f = (float)v;
+	return (f < v) ? (float)(f + fabs( f ) * FLT_EPSILON + FLT_MIN) : f;
+}
+
+void SphereCloud::addSphere( const vec3f& center, double radius )
+{
+	Particle p;
+	p.x = (float)center[0];
+	p.y = (float)center[1];
+	p.z = (float)center[2];
+	p.radius = (float)fabs( radius );
+	spheres.push_back( p );
+}
+
+bool SphereCloud::addSpheres( const char *filename )
+{
+	FILE *f = fopen( filename, "rb" );
+	if( f == NULL ) {
+		return false;
+	}
+
+	fseek( f, 0, SEEK_END );
+	long size = ftell( f );
+	fseek( f, 0, SEEK_SET );
+	if( size < 0 || size % sizeof( Particle ) != 0 ) {
+		fclose( f );
+		return false;
+	}
+
+	size_t first = spheres.size();
+	size_t count = size / sizeof( Particle );
+	spheres.resize( first + count );
+	bool ok = count == 0 || fread( &spheres[first], sizeof( Particle ), count, f ) == count;
+	fclose( f );
+	if( !ok ) {
+		spheres.resize( first );
+		return false;
+	}
+
+	for( size_t k = first; k < spheres.size(); ++k ) {
+		spheres[k].radius = fabs( spheres[k].radius );
+	}
+	return true;
+}
+
+// orders spheres by their center along one axis
+struct SphereCloud::CenterLess
+{
+	int axis;
+
+	bool operator()( const Particle& a, const Particle& b ) const
+	{
+		return (&a.x)[axis] < (&b.x)[axis];
+	}
+};
+
+void SphereCloud::build()
+{
+	nodes.clear();
+	if( spheres.empty() ) {
+		return;
+	}
+
+	nodes.reserve( 2 * (spheres.size() / LEAF_SIZE + 1) );
+	nodes.push_back( Node() );
+	buildNode( 0, 0, spheres.size() );
+}
+
+// Make node the root of a subtree over spheres[first .. last), splitting
+// them in half along the axis their centers spread furthest.
+void SphereCloud::buildNode( int node, int first, int last )
+{
+	double lo[3], hi[3], cmin[3], cmax[3];
+	for( int k = first; k < last; ++k ) {
+		const Particle& p = spheres[k];
+		const float *c = &p.x;
+		for( int a = 0; a < 3; ++a ) {
+			if( k == first || c[a] - p.radius < lo[a] ) lo[a] = c[a] - p.radius;
+			if( k == first || c[a] + p.radius > hi[a] ) hi[a] = c[a] + p.radius;
+			if( k == first || c[a] < cmin[a] ) cmin[a] = c[a];
+			if( k == first || c[a] > cmax[a] ) cmax[a] = c[a];
+		}
+	}
+
+	for( int a = 0; a < 3; ++a ) {
+		nodes[node].min[a] = roundDown( lo[a] );
+		nodes[node].max[a] = roundUp( hi[a] );
+	}
+	nodes[node].first = first;
+	nodes[node].count = last - first;
+
+	if( last - first <= LEAF_SIZE ) {
+		return;
+	}
+
+	CenterLess less;
+	less.axis = 0;
+	for( int a = 1; a < 3; ++a ) {
+		if( cmax[a] - cmin[a] > cmax[less.axis] - cmin[less.axis] ) {
+			less.axis = a;
+		}
+	}
+
+	int mid = (first + last) / 2;
+	std::nth_element( spheres.begin() + first, spheres.begin() + mid,
+		spheres.begin() + last, less );
+
+	int child = nodes.size();
+	nodes.push_back( Node() );
+	nodes.push_back( Node() );
+	nodes[node].first = child;
+	nodes[node].count = 0;
+	buildNode( child, first, mid );
+	buildNode( child + 1, mid, last );
+}
+
+BoundingBox SphereCloud::ComputeLocalBoundingBox()
+{
+	BoundingBox localbounds;
+	if( !nodes.empty() ) {
+		localbounds.min = vec3f( nodes[0].min[0], nodes[0].min[1], nodes[0].min[2] );
+		localbounds.max = vec3f( nodes[0].max[0], nodes[0].max[1], nodes[0].max[2] );
+	}
+	return localbounds;
+}
+
+bool SphereCloud::hitBox( const Node& node, const vec3f& P, const vec3f& invD,
+	double tMax, double& tEnter ) const
+{
+	double tNear = 0.0;
+	double tFar = tMax;
+	for( int a = 0; a < 3; ++a ) {
+		double t0 = (node.min[a] - P[a]) * invD[a];
+		double t1 = (node.max[a] - P[a]) * invD[a];
+		if( t0 > t1 ) {
+			std::swap( t0, t1 );
+		}
+		if( t0 > tNear ) tNear = t0;
+		if( t1 < tFar ) tFar = t1;
+	}
+
+	tEnter = tNear;
+	return tNear <= tFar * (1.0 + 1.0e-12);
+}
+
+bool SphereCloud::intersectLocal( const ray& r, isect& i ) const
+{
+	if( nodes.empty() ) {
+		return false;
+	}
+
+	vec3f P = r.getPosition();
+	vec3f D = r.getDirection();
+	vec3f invD( 1.0 / D[0], 1.0 / D[1], 1.0 / D[2] );
+
+	double tMax = 1.0e308;
+	int nearest = -1;
+
+	int stack[ MAX_STACK ];
+	int top = 0;
+	double tEnter;
+	if( !hitBox( nodes[0], P, invD, tMax, tEnter ) ) {
+		return false;
+	}
+	stack[ top++ ] = 0;
+
+	while( top > 0 ) {
+		const Node& node = nodes[ stack[ --top ] ];
+
+		if( node.count > 0 ) {
+			// as Sphere::intersectLocal, for a sphere away from the origin,
+			// one sphere at a time.  Testing the leaf's four packed spheres
+			// at once with SSE measured slower, with ray -b spheres: in
+			// double, to keep the hits exact, as in float with an exact test
+			// of the lanes it can't rule out.  Most spheres are ruled out by
+			// the discriminant, a few multiplies in, and the time goes to
+			// the walk down the tree.
+			for( int k = node.first; k < node.first + node.count; ++k ) {
+				const Particle& s = spheres[k];
+				vec3f v( s.x - P[0], s.y - P[1], s.z - P[2] );
+				double b = v.dot( D );
+				double discriminant = b*b - v.dot( v ) + (double)s.radius * s.radius;
+				if( discriminant < 0.0 ) {
+					continue;
+				}
+
+				discriminant = sqrt( discriminant );
+				double t2 = b + discriminant;
+				if( t2 <= RAY_EPSILON ) {
+					continue;
+				}
+
+				double t1 = b - discriminant;
+				double t = (t1 > RAY_EPSILON) ? t1 : t2;
+				if( t < tMax ) {
+					tMax = t;
+					nearest = k;
+				}
+			}
+			continue;
+		}
+
+		double t0, t1;
+		bool hit0 = hitBox( nodes[ node.first ], P, invD, tMax, t0 );
+		bool hit1 = hitBox( nodes[ node.first + 1 ], P, invD, tMax, t1 );
+		if( hit0 && hit1 ) {
+			if( t0 <= t1 ) {
+				stack[ top++ ] = node.first + 1;
+				stack[ top++ ] = node.first;
+			} else {
+				stack[ top++ ] = node.first;
+				stack[ top++ ] = node.first + 1;
+			}
+		} else if( hit0 ) {
+			stack[ top++ ] = node.first;
+		} else if( hit1 ) {
+			stack[ top++ ] = node.first + 1;
+		}
+	}
+
+	if( nearest < 0 ) {
+		return false;
+	}
+
+	const Particle& s = spheres[ nearest ];
+	i.obj = this;
+	i.t = tMax;
+	i.N = (r.at( tMax ) - vec3f( s.x, s.y, s.z )).normalize();
+	return true;
+}
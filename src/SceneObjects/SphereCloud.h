@@ -0,0 +1,65 @@
+#ifndef __SPHERECLOUD_H__
+#define __SPHERECLOUD_H__
+
+#include <vector>
+
+#include "../scene/scene.h"
+
+// Many spheres with one material and one transform, as a single scene
+// object: the output of a particle simulation, say.  A sphere is only its
+// center and radius, four floats, and the cloud keeps its own bounding
+// volume hierarchy over them, so that millions of spheres take tens of
+// bytes each instead of a whole Sphere and TransformNode.
+class SphereCloud
+	: public MaterialSceneObject
+{
+public:
+	SphereCloud( Scene *scene, int mat )
+		: MaterialSceneObject( scene, mat )
+	{
+	}
+
+	void addSphere( const vec3f& center, double radius );
+
+	// Add the spheres in a binary file of 32 bit floats in the machine's
+	// byte order, four per sphere: x, y, z and the radius.  Returns false
+	// if the file can't be read or its size isn't a whole number of
+	// spheres.
+	bool addSpheres( const char *filename );
+
+	int getNumSpheres() const { return spheres.size(); }
+
+	// Build the hierarchy, once all the spheres are added.
+	void build();
+
+	virtual bool intersectLocal( const ray& r, isect& i ) const;
+	virtual bool hasBoundingBoxCapability() const { return true; }
+	virtual BoundingBox ComputeLocalBoundingBox();
+
+private:
+	struct Particle
+	{
+		float x, y, z, radius;
+	};
+
+	// A leaf covers spheres[first .. first+count); an interior node has
+	// count 0 and its children at first and first+1.
+	struct Node
+	{
+		float min[3];
+		float max[3];
+		int first;
+		int count;
+	};
+
+	struct CenterLess;
+
+	void buildNode( int node, int first, int last );
+	bool hitBox( const Node& node, const vec3f& P, const vec3f& invD,
+		double tMax, double& tEnter ) const;
+
+	std::vector<Particle> spheres;
+	std::vector<Node> nodes;
+};
+
+#endif // __SPHERECLOUD_H__
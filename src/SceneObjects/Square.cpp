@@ -37,3 +37,68 @@ bool Square::intersectLocal( const ray& r, isect& i ) const
 
 	return true;
 }
+
+// The square's plane, and where a point is on it, are affine functions of
+// world space under any fixed transform, so only moving squares aren't
+// baked.  What is saved is transforming the whole ray and the normal.
+void Square::bakeTransform()
+{
+	baked = !isMoving();
+	if( !baked ) {
+		return;
+	}
+
+	const mat4f& inverse = transform->getInverse();
+	for( int a = 0; a < 3; ++a ) {
+		toLocal[a] = vec3f( inverse[a][0], inverse[a][1], inverse[a][2] );
+		offset[a] = inverse[a][3];
+	}
+	normal = transform->localToGlobalCoordsNormal( vec3f( 0.0, 0.0, 1.0 ) );
+}
+
+bool Square::intersectBaked( const ray& r, isect& i ) const
+{
+	vec3f p = r.getPosition();
+	vec3f d = r.getDirection();
+
+	// the ray's direction in local coordinates, not normalized
+	vec3f ld( toLocal[0].dot(d), toLocal[1].dot(d), toLocal[2].dot(d) );
+
+	if( ld[2] == 0.0 ) {
+		return false;
+	}
+
+	double t = -(toLocal[2].dot(p) + offset[2]) / ld[2];
+
+	// RAY_EPSILON is in intersectLocal's units
+	if( t * ld.length() <= RAY_EPSILON ) {
+		return false;
+	}
+
+	double x = toLocal[0].dot(p) + offset[0] + t * ld[0];
+	if( x < -0.5 || x > 0.5 ) {
+		return false;
+	}
+
+	double y = toLocal[1].dot(p) + offset[1] + t * ld[1];
+	if( y < -0.5 || y > 0.5 ) {
+		return false;
+	}
+
+	i.obj = this;
+	i.t = t;
+	i.localP = vec3f( x, y, 0.0 );
+	if( ld[2] > 0.0 ) {
+		i.N = -normal;
+	} else {
+		i.N = normal;
+	}
+
+	return true;
+}
+
+void Square::getUV( const vec3f& P, double& u, double& v ) const
+{
+	u = P[0] + 0.5;
+	v = P[1] + 0.5;
+}
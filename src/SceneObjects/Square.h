@@ -7,12 +7,15 @@ class Square
 	: public MaterialSceneObject
 {
 public:
-	Square( Scene *scene, Material *mat )
+	Square( Scene *scene, int mat )
 		: MaterialSceneObject( scene, mat )
 	{
 	}
 
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
+	virtual void bakeTransform();
+	virtual bool intersectBaked( const ray& r, isect& i ) const;
+	virtual void getUV( const vec3f& P, double& u, double& v ) const;
 	virtual bool hasBoundingBoxCapability() const { return true; }
 
     virtual BoundingBox ComputeLocalBoundingBox()
@@ -22,6 +25,14 @@ public:
 		localbounds.max = vec3f(0.5f, 0.5f, RAY_EPSILON);
         return localbounds;
     }
+
+private:
+	// when baked: local coordinate a of a world point P is
+	// toLocal[a].dot( P ) + offset[a]; normal is the world normal of the
+	// local +z side
+	vec3f toLocal[3];
+	vec3f offset;
+	vec3f normal;
 };
 
 #endif // __SQUARE_H__
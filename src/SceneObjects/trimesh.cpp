@@ -2,21 +2,13 @@
 #include <float.h>
 #include "trimesh.h"
 
-Trimesh::~Trimesh()
-{
-    for( Materials::iterator i = materials.begin(); i != materials.end(); ++i )
-    {
-        delete *i;
-    }
-}
-
 // must add vertices, normals, and materials IN ORDER
 void Trimesh::addVertex( const vec3f &v )
 {
     vertices.push_back( v );
 }
 
-void Trimesh::addMaterial( Material *m )
+void Trimesh::addMaterial( int m )
 {
     materials.push_back( m );
 }
@@ -34,7 +26,18 @@ bool Trimesh::addFace( int a, int b, int c )
     if( a >= vcnt || b >= vcnt || c >= vcnt )
         return false;
 
-    TrimeshFace *newFace = new TrimeshFace( scene, new Material(*this->material), this, a, b, c );
+    // precompute everything the ray test needs that doesn't depend on the ray
+    TrimeshTriangle tri;
+    tri.a = vertices[a];
+    tri.ab = vertices[b] - vertices[a];
+    tri.ac = vertices[c] - vertices[a];
+    vec3f cv = tri.ab.cross(tri.ac);
+    tri.degenerate = cv.iszero();
+    tri.n = tri.degenerate ? vec3f() : cv.normalize();
+    tri.detEpsilon = NORMAL_EPSILON * cv.length();
+    triangles.push_back( tri );
+
+    TrimeshFace *newFace = new( scene->getArena() ) TrimeshFace( scene, material, this, a, b, c, faces.size() );
     newFace->setTransform(this->transform);
     faces.push_back( newFace );
     scene->add(newFace);
@@ -57,64 +60,117 @@ Trimesh::doubleCheck()
 // Intersect ray r with the triangle abc.  If it hits returns true,
 // and put the parameter in t and the barycentric coordinates of the
 // intersection in bary.
-// Uses the algorithm and notation from _Graphic Gems 5_, p. 232.
-//
-// Calculates and returns the normal of the triangle too.
-bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
+// Uses the Moller-Trumbore algorithm on the edges precomputed in addFace.
+// Like before, only hits on the front side of the triangle are reported.
+bool TrimeshFace::intersectFast( const ray& r, double& t, vec3f& bary ) const
 {
-    const vec3f& a = parent->vertices[ids[0]];
-    const vec3f& b = parent->vertices[ids[1]];
-    const vec3f& c = parent->vertices[ids[2]];
-    
-    vec3f bary;
-    float t;
-    vec3f n;
-    
+    const TrimeshTriangle& tri = parent->triangles[index];
+
+    // there exists some bad triangles such that two vertices coincide
+    if( tri.degenerate )
+        return false;
+
     vec3f p = r.getPosition();
     vec3f v = r.getDirection();
-    
-    vec3f ab = b - a;
-    vec3f ac = c - a;
-    vec3f ap = p - a;
-    
-	vec3f cv=ab.cross(ac);
-
-	// there exists some bad triangles such that two vertices coincide
-	// check this before normalize
-	if (cv.iszero()) return false;
-    n = (cv).normalize();
-	
-    double vdotn = v*n;
-    if( -vdotn < NORMAL_EPSILON )
+
+    // det = -(v . (ab x ac)), so this is the old "-vdotn < NORMAL_EPSILON"
+    // back-face test without normalizing the cross product.
+    vec3f pvec = v.cross(tri.ac);
+    double det = tri.ab * pvec;
+    if( det < tri.detEpsilon )
         return false;
-    
-    t = - (ap*n)/vdotn;
-    
-    if( t < RAY_EPSILON )
+
+    double invDet = 1.0 / det;
+    vec3f ap = p - tri.a;
+
+    bary[1] = (ap * pvec) * invDet;
+    if( bary[1] < 0 || bary[1] > 1 )
         return false;
 
-    // find k where k is the index of the component
-    // of normal vector with greatest absolute value
-    float greatestMag = FLT_MIN;
-    int k = -1;
-    for( int j = 0; j < 3; ++j )
-    {
-        float val = n[j];
-        if( val < 0 )
-            val *= -1;
-        if( val > greatestMag )
-        {
-            k = j;
-            greatestMag = val;
-        }
-    }
+    vec3f qvec = ap.cross(tri.ab);
+    bary[2] = (v * qvec) * invDet;
+    if( bary[2] < 0 || bary[1] + bary[2] > 1 )
+        return false;
+
+    t = (tri.ac * qvec) * invDet;
+    if( t < RAY_EPSILON )
+        return false;
 
-    vec3f am = ap + t * v;
-    
-	bary[1] = (am.cross(ac))[k]/(ab.cross(ac))[k];
-    bary[2] = (ab.cross(am))[k]/(ab.cross(ac))[k];
     bary[0] = 1-bary[1]-bary[2];
-    if( bary[0] < 0 || bary[1] < 0 || bary[1] > 1 || bary[2] < 0 || bary[2] > 1 )
+    return true;
+}
+
+// Same contract as intersectFast, using the watertight algorithm of
+// Woop, Benthin and Wald (JCGT 2013).  The vertices are translated to the
+// ray origin and sheared so the ray runs down the z axis; the edge
+// functions are then evaluated from the original vertex positions, so
+// two triangles sharing an edge compute exactly negated values for it and
+// a ray can't slip between them.  A value of zero counts as inside.
+// There is no grazing-angle cutoff: front faces are those with all edge
+// functions non-negative.
+bool TrimeshFace::intersectWatertight( const ray& r, double& t, vec3f& bary ) const
+{
+    vec3f p = r.getPosition();
+    vec3f d = r.getDirection();
+
+    // permute so that z is the dominant axis of the direction, swapping
+    // x and y when needed to keep the winding
+    int kz = 0;
+    if( fabs( d[1] ) > fabs( d[kz] ) )
+        kz = 1;
+    if( fabs( d[2] ) > fabs( d[kz] ) )
+        kz = 2;
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if( d[kz] < 0.0 )
+        swap( kx, ky );
+
+    double Sz = 1.0 / d[kz];
+    double Sx = d[kx] * Sz;
+    double Sy = d[ky] * Sz;
+
+    vec3f A = parent->vertices[ids[0]] - p;
+    vec3f B = parent->vertices[ids[1]] - p;
+    vec3f C = parent->vertices[ids[2]] - p;
+
+    double Ax = A[kx] - Sx * A[kz];
+    double Ay = A[ky] - Sy * A[kz];
+    double Bx = B[kx] - Sx * B[kz];
+    double By = B[ky] - Sy * B[kz];
+    double Cx = C[kx] - Sx * C[kz];
+    double Cy = C[ky] - Sy * C[kz];
+
+    // scaled barycentrics of a, b and c
+    double U = Cx * By - Cy * Bx;
+    double V = Ax * Cy - Ay * Cx;
+    double W = Bx * Ay - By * Ax;
+
+    if( U < 0.0 || V < 0.0 || W < 0.0 )
+        return false;
+
+    double det = U + V + W;
+    if( det == 0.0 )
+        return false;
+
+    double T = Sz * (U * A[kz] + V * B[kz] + W * C[kz]);
+    if( T < RAY_EPSILON * det )
+        return false;
+
+    double invDet = 1.0 / det;
+    t = T * invDet;
+    bary = vec3f( U * invDet, V * invDet, W * invDet );
+    return true;
+}
+
+// Calculates and returns the normal of the triangle too.
+bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
+{
+    double t;
+    vec3f bary;
+
+    bool hit = scene->isWatertight() ? intersectWatertight( r, t, bary )
+                                     : intersectFast( r, t, bary );
+    if( !hit )
         return false;
 
     // if we get this far, we have an intersection.  Fill in the info.
@@ -126,7 +182,7 @@ bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
                  + bary[1] * parent->normals[ids[1]]
                  + bary[2] * parent->normals[ids[2]]).normalize() );
     } else {
-        i.setN( n );           // use face normal
+        i.setN( parent->triangles[index].n );   // use face normal
     }
     i.obj = this;
 
@@ -135,7 +191,7 @@ bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
     {
         Material *m = new Material();
         for( int jj = 0; jj < 3; ++jj )
-            (*m) += bary[jj] * (*parent->materials[ ids[jj] ]);
+            (*m) += bary[jj] * scene->getMaterial( parent->materials[ ids[jj] ] );
         i.setMaterial( m );
     }
     
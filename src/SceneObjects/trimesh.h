@@ -9,32 +9,46 @@
 #include "../scene/scene.h"
 class TrimeshFace;
 
+// Per-triangle data that only depends on the vertex positions.  It is
+// filled in once by Trimesh::addFace so that the ray test doesn't have to
+// rebuild the edges and the face normal for every ray.
+struct TrimeshTriangle
+{
+    vec3f a;                // first vertex
+    vec3f ab;               // edge a->b
+    vec3f ac;               // edge a->c
+    vec3f n;                // unit face normal
+    double detEpsilon;      // back-face cutoff, NORMAL_EPSILON * |ab x ac|
+    bool degenerate;        // two of the vertices coincide
+};
+
 class Trimesh : public MaterialSceneObject
 {
     friend class TrimeshFace;
     typedef vector<vec3f> Normals;
     typedef vector<vec3f> Vertices;
     typedef vector<TrimeshFace*> Faces;
-    typedef vector<Material*> Materials;
+    typedef vector<int> Materials;
+    typedef vector<TrimeshTriangle> Triangles;
     Vertices vertices;
     Faces faces;
     Normals normals;
     Materials materials;
+    Triangles triangles;    // one entry per face, in the same order
 public:
-    Trimesh( Scene *scene, Material *mat, TransformNode *transform )
+    Trimesh( Scene *scene, int mat, TransformNode *transform )
         : MaterialSceneObject(scene, mat)
     {
         this->transform = transform;
     }
-
-    ~Trimesh();
     
     // must add vertices, normals, and materials IN ORDER
     void addVertex( const vec3f & );
-    void addMaterial( Material *m );
+    void addMaterial( int m );
     void addNormal( const vec3f & );
 
     bool addFace( int a, int b, int c );
+    const Faces& getFaces() const { return faces; }
 
     char *doubleCheck();
     
@@ -45,14 +59,16 @@ class TrimeshFace : public MaterialSceneObject
 {
     Trimesh *parent;
     int ids[3];
+    int index;              // position of this face in parent->triangles
 public:
-    TrimeshFace( Scene *scene, Material *mat, Trimesh *parent, int a, int b, int c)
+    TrimeshFace( Scene *scene, int mat, Trimesh *parent, int a, int b, int c, int idx )
         : MaterialSceneObject( scene, mat )
     {
         this->parent = parent;
         ids[0] = a;
         ids[1] = b;
         ids[2] = c;
+        index = idx;
     }
 
     int operator[]( int i ) const
@@ -62,6 +78,11 @@ public:
 
     virtual bool intersectLocal( const ray& r, isect& i ) const;
 
+    // ray/triangle kernels used by intersectLocal: the t of the hit and
+    // the barycentric coordinates of a, b and c
+    bool intersectFast( const ray& r, double& t, vec3f& bary ) const;
+    bool intersectWatertight( const ray& r, double& t, vec3f& bary ) const;
+
     virtual bool hasBoundingBoxCapability() const { return true; }
       
     virtual BoundingBox ComputeLocalBoundingBox()
@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "SceneObjects/trimesh.h"
+#include "SceneObjects/Box.h"
+#include "SceneObjects/Cylinder.h"
+#include "SceneObjects/Cone.h"
+#include "SceneObjects/SphereCloud.h"
+
+// Passes over the rays; enough for a run to take a second or so.
+static const int PASSES = 5;
+
+// The random numbers are the same every run, so the rays are too.
+static double uniform()
+{
+	return rand() / (RAND_MAX + 1.0);
+}
+
+static void report( const char *what, double tests, clock_t ticks, long hits )
+{
+	double seconds = (double)ticks / CLOCKS_PER_SEC;
+	printf( "%-12s %7.2f M tests/s  (%.0f tests in %.3f seconds, %ld hits)\n",
+		what, seconds > 0.0 ? tests / seconds / 1.0e6 : 0.0, tests, seconds, hits );
+}
+
+// 2000 random triangles, facing up, scattered over a thin slab, and 2000
+// rays straight down through it.  Every ray is tested against every
+// triangle with TrimeshFace::intersectLocal, so that nothing but the
+// triangle test is timed.
+static void benchTriangles()
+{
+	const int NUM_TRIANGLES = 2000;
+	const int NUM_RAYS = 2000;
+
+	Scene scene;
+	srand( 1 );
+	Trimesh *mesh = scene.getArena().own( new( scene.getArena() )
+		Trimesh( &scene, scene.addMaterial( Material() ), &scene.transformRoot ) );
+	for( int k = 0; k < NUM_TRIANGLES; ++k ) {
+		vec3f a( uniform() - 0.5, uniform() - 0.5, uniform() * 0.1 );
+		vec3f b( uniform() - 0.5, uniform() - 0.5, uniform() * 0.1 );
+		vec3f c( uniform() - 0.5, uniform() - 0.5, uniform() * 0.1 );
+		vec3f n = (b - a).cross( c - a );
+		mesh->addVertex( a );
+		mesh->addVertex( n[2] >= 0.0 ? b : c );
+		mesh->addVertex( n[2] >= 0.0 ? c : b );
+		mesh->addFace( 3 * k, 3 * k + 1, 3 * k + 2 );
+	}
+	const std::vector<TrimeshFace*>& faces = mesh->getFaces();
+
+	std::vector<ray> rays;
+	for( int k = 0; k < NUM_RAYS; ++k ) {
+		rays.push_back( ray( vec3f( uniform() - 0.5, uniform() - 0.5, 1.0 ),
+			vec3f( 0.0, 0.0, -1.0 ) ) );
+	}
+
+	long hits = 0;
+	isect i;
+	clock_t start = clock();
+	for( int pass = 0; pass < PASSES; ++pass ) {
+		for( size_t r = 0; r < rays.size(); ++r ) {
+			for( size_t f = 0; f < faces.size(); ++f ) {
+				if( faces[f]->intersectLocal( rays[r], i ) ) {
+					++hits;
+				}
+			}
+		}
+	}
+	report( "triangle", (double)PASSES * rays.size() * faces.size(),
+		clock() - start, hits / PASSES );
+}
+
+// A point uniformly distributed in the ball of the given radius.
+static vec3f inBall( double radius )
+{
+	vec3f p;
+	do {
+		p = vec3f( 2.0 * uniform() - 1.0, 2.0 * uniform() - 1.0, 2.0 * uniform() - 1.0 );
+	} while( p.length_squared() > 1.0 );
+	return radius * p;
+}
+
+// 1000 T's, made by make, scattered through a ball, each turned and
+// scaled at random unless only the scale is to be random, and 2000 rays
+// from all around through it.  Each ray is tested against every object a
+// run of four at a time, keeping the nearest hit, as a BVH leaf does: once
+// one object at a time with intersectAs<T>, and once with T::nearest4.
+template <class T>
+static void benchFours( const char *name, T *(*make)( Scene& scene ),
+	bool alignedToo )
+{
+	const int NUM_OBJECTS = 1000;
+	const int NUM_RAYS = 2000;
+
+	Scene scene;
+	srand( 1 );
+	std::vector<Geometry*> objs;
+	for( int k = 0; k < NUM_OBJECTS; ++k ) {
+		double s = 0.1 + 0.2 * uniform();
+		mat4f m = mat4f::translate( inBall( 3.0 ) );
+		if( alignedToo && k % 2 ) {
+			m = m * mat4f::scale( vec3f( s, 1.5 * s, 0.7 * s ) );
+		} else {
+			m = m * mat4f::rotate( inBall( 1.0 ), 6.3 * uniform() ) *
+				mat4f::scale( vec3f( s, s, s ) );
+		}
+
+		T *obj = make( scene );
+		obj->setTransform( scene.transformRoot.createChild( m ) );
+		scene.add( obj );
+		obj->bakeTransform();
+		objs.push_back( obj );
+	}
+
+	std::vector<ray> rays;
+	for( int k = 0; k < NUM_RAYS; ++k ) {
+		vec3f from = 10.0 * inBall( 1.0 ).normalize();
+		rays.push_back( ray( from, (inBall( 3.0 ) - from).normalize() ) );
+	}
+
+	isect i;
+	for( int wide = 0; wide < 2; ++wide ) {
+		long hits = 0;
+		clock_t start = clock();
+		for( int pass = 0; pass < PASSES; ++pass ) {
+			for( size_t r = 0; r < rays.size(); ++r ) {
+				double tMax = 1.0e308;
+				bool have_one = false;
+				for( int k = 0; k < NUM_OBJECTS; k += 4 ) {
+					if( wide ) {
+						int first = T::nearest4( &objs[k], 4, rays[r], tMax );
+						if( first >= 0 && objs[ k + first ]->intersectAs<T>( rays[r], i ) &&
+							i.t < tMax ) {
+							tMax = i.t;
+							have_one = true;
+						}
+						continue;
+					}
+					for( int j = k; j < k + 4; ++j ) {
+						if( objs[j]->intersectAs<T>( rays[r], i ) && i.t < tMax ) {
+							tMax = i.t;
+							have_one = true;
+						}
+					}
+				}
+				hits += have_one;
+			}
+		}
+		report( (std::string( name ) + (wide ? " x4" : "")).c_str(),
+			(double)PASSES * rays.size() * objs.size(), clock() - start, hits / PASSES );
+	}
+}
+
+static Box *makeBox( Scene& scene )
+{
+	return scene.getArena().own( new( scene.getArena() ) Box( &scene, scene.addMaterial( Material() ) ) );
+}
+
+static Cylinder *makeCylinder( Scene& scene )
+{
+	return scene.getArena().own( new( scene.getArena() )
+		Cylinder( &scene, scene.addMaterial( Material() ), uniform() < 0.5 ) );
+}
+
+static Cone *makeCone( Scene& scene )
+{
+	return scene.getArena().own( new( scene.getArena() ) Cone( &scene,
+		scene.addMaterial( Material() ), 1.0, 1.0, 0.4 * uniform(), uniform() < 0.5 ) );
+}
+
+// Half the boxes are only scaled, and are intersected in world space
+// (see Box::bakeTransform).
+static void benchBoxes()
+{
+	benchFours( "box", makeBox, true );
+}
+
+static void benchCylinders()
+{
+	benchFours( "cylinder", makeCylinder, false );
+}
+
+static void benchCones()
+{
+	benchFours( "cone", makeCone, false );
+}
+
+// A cloud of 100000 small spheres through a ball, and 100000 rays from all
+// around through it, each tested against the whole cloud with
+// SphereCloud::intersectLocal, so that a test is a walk down its hierarchy
+// as well as the sphere tests in the leaves it reaches.
+static void benchSpheres()
+{
+	const int NUM_SPHERES = 100000;
+	const int NUM_RAYS = 100000;
+
+	Scene scene;
+	srand( 1 );
+	SphereCloud *cloud = scene.getArena().own( new( scene.getArena() )
+		SphereCloud( &scene, scene.addMaterial( Material() ) ) );
+	for( int k = 0; k < NUM_SPHERES; ++k ) {
+		cloud->addSphere( inBall( 3.0 ), 0.01 + 0.02 * uniform() );
+	}
+	cloud->build();
+
+	std::vector<ray> rays;
+	for( int k = 0; k < NUM_RAYS; ++k ) {
+		vec3f from = 10.0 * inBall( 1.0 ).normalize();
+		rays.push_back( ray( from, (inBall( 3.0 ) - from).normalize() ) );
+	}
+
+	long hits = 0;
+	isect i;
+	clock_t start = clock();
+	for( int pass = 0; pass < PASSES; ++pass ) {
+		for( size_t r = 0; r < rays.size(); ++r ) {
+			if( cloud->intersectLocal( rays[r], i ) ) {
+				++hits;
+			}
+		}
+	}
+	report( "spheres", (double)PASSES * rays.size(), clock() - start, hits / PASSES );
+}
+
+struct Benchmark
+{
+	const char *name;
+	void (*run)();
+};
+
+static const Benchmark benchmarks[] = {
+	{ "triangle", benchTriangles },
+	{ "box", benchBoxes },
+	{ "cylinder", benchCylinders },
+	{ "cone", benchCones },
+	{ "spheres", benchSpheres },
+};
+
+static const int NUM_BENCHMARKS = sizeof( benchmarks ) / sizeof( benchmarks[0] );
+
+bool runBenchmark( const char *name )
+{
+	bool all = strcmp( name, "all" ) == 0;
+	bool found = false;
+	for( int k = 0; k < NUM_BENCHMARKS; ++k ) {
+		if( all || strcmp( name, benchmarks[k].name ) == 0 ) {
+			benchmarks[k].run();
+			found = true;
+		}
+	}
+	return found;
+}
+
+const char *benchmarkNames()
+{
+	static std::string names;
+	if( names.empty() ) {
+		for( int k = 0; k < NUM_BENCHMARKS; ++k ) {
+			names += std::string( benchmarks[k].name ) + " ";
+		}
+		names += "all";
+	}
+	return names.c_str();
+}
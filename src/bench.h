@@ -0,0 +1,22 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+// Microbenchmarks of the ray-primitive tests, for measuring changes to
+// them apart from the rest of the renderer:
+//
+//     ray -b triangle
+//     ray -b box           (and cylinder, cone: each one at a time, and
+//                          four at a time, as a BVH leaf tests them)
+//     ray -b spheres       (rays against a whole SphereCloud)
+//
+// Each one builds its primitives in a scene of its own, times the same
+// seeded rays against them every run and reports tests per second.
+
+// Run the named benchmark, or every one for "all", printing the results.
+// Returns false if there is no such benchmark.
+bool runBenchmark( const char *name );
+
+// the names runBenchmark knows, separated by spaces
+const char *benchmarkNames();
+
+#endif // __BENCH_H__
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "checkpoint.h"
+
+static const char MAGIC[8] = { 'R', 'A', 'Y', 'C', 'K', 'P', 'T', '1' };
+
+unsigned int hashBytes( unsigned int h, const void *data, size_t size )
+{
+	const unsigned char *p = (const unsigned char *)data;
+	for( size_t k = 0; k < size; ++k ) {
+		h ^= p[k];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+unsigned int hashFile( unsigned int h, const char *name )
+{
+	FILE *f = fopen( name, "rb" );
+	if( f == NULL )
+		return h;
+
+	unsigned char buf[ 4096 ];
+	size_t n;
+	while( (n = fread( buf, 1, sizeof( buf ), f )) > 0 )
+		h = hashBytes( h, buf, n );
+	fclose( f );
+	return h;
+}
+
+Checkpoint::Checkpoint( const std::string& fn, unsigned int renderHash,
+	int w, int h, int ts )
+	: filename( fn ), sceneHash( renderHash ),
+	  width( w ), height( h ), tileSize( ts )
+{
+	tilesX = (width + tileSize - 1) / tileSize;
+	tilesY = (height + tileSize - 1) / tileSize;
+}
+
+void Checkpoint::getTile( int k, int& x0, int& y0, int& x1, int& y1 ) const
+{
+	x0 = (k % tilesX) * tileSize;
+	y0 = (k / tilesX) * tileSize;
+	x1 = x0 + tileSize < width ? x0 + tileSize : width;
+	y1 = y0 + tileSize < height ? y0 + tileSize : height;
+}
+
+// The file is the magic number; the image size, tile size and scene hash
+// as 32 bit integers in the machine's byte order; a byte per tile, 1 if it
+// is finished; then the whole image, RGB, bottom row first.  Unfinished
+// tiles' pixels are whatever they were.
+
+// Read the magic number and header, returning true if they are this
+// render's.
+bool Checkpoint::readHeader( FILE *f ) const
+{
+	char magic[8];
+	unsigned int header[4];
+	return fread( magic, sizeof( magic ), 1, f ) == 1 &&
+		memcmp( magic, MAGIC, sizeof( MAGIC ) ) == 0 &&
+		fread( header, sizeof( header ), 1, f ) == 1 &&
+		header[0] == (unsigned int)width && header[1] == (unsigned int)height &&
+		header[2] == (unsigned int)tileSize && header[3] == sceneHash;
+}
+
+bool Checkpoint::isStale() const
+{
+	FILE *f = fopen( filename.c_str(), "rb" );
+	if( f == NULL )
+		return false;
+	bool ours = readHeader( f );
+	fclose( f );
+	return !ours;
+}
+
+bool Checkpoint::load( unsigned char *image, std::vector<bool>& done ) const
+{
+	FILE *f = fopen( filename.c_str(), "rb" );
+	if( f == NULL )
+		return false;
+
+	int n = getNumTiles();
+	std::vector<unsigned char> flags( n );
+	std::vector<unsigned char> pixels( width * height * 3 );
+
+	bool ok = readHeader( f ) &&
+		fread( &flags[0], n, 1, f ) == 1 &&
+		fread( &pixels[0], pixels.size(), 1, f ) == 1;
+	fclose( f );
+	if( !ok )
+		return false;
+
+	done.resize( n, false );
+	for( int k = 0; k < n; ++k ) {
+		if( !flags[k] )
+			continue;
+		done[k] = true;
+
+		int x0, y0, x1, y1;
+		getTile( k, x0, y0, x1, y1 );
+		for( int y = y0; y < y1; ++y ) {
+			int row = (y * width + x0) * 3;
+			memcpy( &image[row], &pixels[row], (x1 - x0) * 3 );
+		}
+	}
+	return true;
+}
+
+bool Checkpoint::save( const unsigned char *image, const std::vector<bool>& done ) const
+{
+	// write a new file beside the old one, then put it in its place
+	std::string temp = filename + ".tmp";
+	FILE *f = fopen( temp.c_str(), "wb" );
+	if( f == NULL )
+		return false;
+
+	unsigned int header[4] = { (unsigned int)width, (unsigned int)height,
+		(unsigned int)tileSize, sceneHash };
+	int n = getNumTiles();
+	std::vector<unsigned char> flags( n );
+	for( int k = 0; k < n; ++k )
+		flags[k] = k < (int)done.size() && done[k];
+
+	bool ok = fwrite( MAGIC, sizeof( MAGIC ), 1, f ) == 1 &&
+		fwrite( header, sizeof( header ), 1, f ) == 1 &&
+		fwrite( &flags[0], n, 1, f ) == 1 &&
+		fwrite( image, width * height * 3, 1, f ) == 1;
+	ok = (fclose( f ) == 0) && ok;
+	if( !ok ) {
+		::remove( temp.c_str() );
+		return false;
+	}
+
+#ifdef WIN32
+	// rename won't replace a file on Windows
+	::remove( filename.c_str() );
+#endif
+	return rename( temp.c_str(), filename.c_str() ) == 0;
+}
+
+void Checkpoint::remove() const
+{
+	::remove( filename.c_str() );
+}
@@ -0,0 +1,59 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+// A checkpoint file keeps the finished tiles of an image being rendered,
+// so that a render that is killed can be resumed without redoing them.
+//
+// Tiles are tileSize pixels square (smaller along the top and right
+// edges), numbered a row of tiles at a time from the bottom of the image,
+// left to right.  The file also records the hash of the render the tiles
+// came from (see renderHash in main.cpp): of the scene file, the texture and
+// sphere files it reads, and the render settings.  A checkpoint with
+// another hash isn't loaded.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// FNV-1a hashes, for telling whether two renders are of the same thing.
+// Each carries on from h, the hash of what came before, starting from
+// HASH_START.  A file that can't be read adds nothing.
+const unsigned int HASH_START = 2166136261u;
+unsigned int hashBytes( unsigned int h, const void *data, size_t size );
+unsigned int hashFile( unsigned int h, const char *name );
+
+class Checkpoint
+{
+public:
+	Checkpoint( const std::string& filename, unsigned int renderHash,
+		int width, int height, int tileSize );
+
+	int getNumTiles() const { return tilesX * tilesY; }
+	void getTile( int k, int& x0, int& y0, int& x1, int& y1 ) const;
+
+	// Copy the tiles the file has into image (width * height RGB bytes)
+	// and set their flags in done.  Returns false, leaving both alone, if
+	// there is no checkpoint for this render.
+	bool load( unsigned char *image, std::vector<bool>& done ) const;
+
+	// Is there a checkpoint, but of another image, scene or settings?
+	bool isStale() const;
+
+	// Replace the file with the tiles flagged in done.  The old file stays
+	// whole until the new one is, so a crash while saving loses nothing.
+	bool save( const unsigned char *image, const std::vector<bool>& done ) const;
+
+	// the image is finished; the file isn't needed
+	void remove() const;
+
+private:
+	bool readHeader( FILE *f ) const;
+
+	std::string filename;
+	unsigned int sceneHash;
+	int width, height, tileSize;
+	int tilesX, tilesY;
+};
+
+#endif // __CHECKPOINT_H__
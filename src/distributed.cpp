@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#pragma comment( lib, "ws2_32.lib" )
+#define MSG_NOSIGNAL 0
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#endif
+
+#include "distributed.h"
+#include "RayTracer.h"
+#include "checkpoint.h"
+
+// The protocol is a few 32 bit integers, in network byte order, per
+// message:
+//
+//   coordinator -> worker, on joining:  width height hash
+//   worker -> coordinator, in reply:    hash
+//   coordinator -> worker, a tile:      id x0 y0 x1 y1
+//   coordinator -> worker, no more:     -1 0 0 0 0
+//   worker -> coordinator, a result:    id, then the tile's rows of RGB
+//                                       bytes, bottom row first
+
+static bool initSockets()
+{
+#ifdef WIN32
+	static bool started = false;
+	if( !started ) {
+		WSADATA data;
+		if( WSAStartup( MAKEWORD( 2, 0 ), &data ) != 0 )
+			return false;
+		started = true;
+	}
+#endif
+	return true;
+}
+
+static bool sendAll( SOCKET s, const void *data, int size )
+{
+	const char *p = (const char *)data;
+	while( size > 0 ) {
+		int n = send( s, p, size, MSG_NOSIGNAL );
+		if( n <= 0 )
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool recvAll( SOCKET s, void *data, int size )
+{
+	char *p = (char *)data;
+	while( size > 0 ) {
+		int n = recv( s, p, size, 0 );
+		if( n <= 0 )
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool sendInts( SOCKET s, const int *v, int count )
+{
+	unsigned int buf[ 8 ];
+	for( int k = 0; k < count; ++k )
+		buf[k] = htonl( (unsigned int)v[k] );
+	return sendAll( s, buf, count * 4 );
+}
+
+static bool recvInts( SOCKET s, int *v, int count )
+{
+	unsigned int buf[ 8 ];
+	if( !recvAll( s, buf, count * 4 ) )
+		return false;
+	for( int k = 0; k < count; ++k )
+		v[k] = (int)ntohl( buf[k] );
+	return true;
+}
+
+struct TileCoordinator::Worker
+{
+	SOCKET sock;
+	bool joined;                    // has sent a matching hash
+	int tile;                       // the one it is rendering, or -1
+	std::vector<unsigned char> in;  // received, not yet handled
+};
+
+TileCoordinator::TileCoordinator( int w, int h, int tileSize, unsigned int hash )
+	: width( w ), height( h ), renderHash( hash ), nextStart( 0 ), image( w * h * 3, 0 ),
+	  checkpoint( NULL ), checkpointPeriod( 0 )
+{
+	for( int y = 0; y < height; y += tileSize ) {
+		for( int x = 0; x < width; x += tileSize ) {
+			Tile t;
+			t.x0 = x;
+			t.y0 = y;
+			t.x1 = x + tileSize < width ? x + tileSize : width;
+			t.y1 = y + tileSize < height ? y + tileSize : height;
+			t.done = false;
+			t.copies = 0;
+			t.started = 0;
+			tiles.push_back( t );
+		}
+	}
+
+	// handed out from the back, so the image fills in from the bottom
+	for( int k = tiles.size() - 1; k >= 0; --k )
+		queue.push_back( k );
+	remaining = tiles.size();
+}
+
+void TileCoordinator::setCheckpoint( Checkpoint *c, int period, bool resume )
+{
+	checkpoint = c;
+	checkpointPeriod = period;
+
+	std::vector<bool> done;
+	if( !resume || !checkpoint->load( &image[0], done ) )
+		return;
+
+	queue.clear();
+	for( int k = tiles.size() - 1; k >= 0; --k ) {
+		if( done[k] ) {
+			tiles[k].done = true;
+			--remaining;
+		} else {
+			queue.push_back( k );
+		}
+	}
+}
+
+// Give w its next tile: one nobody has, or else a copy of the one that has
+// been out longest.  A worker with nothing to do is left idle.
+void TileCoordinator::assign( Worker& w )
+{
+	int id = -1;
+	if( !queue.empty() ) {
+		id = queue.back();
+		queue.pop_back();
+	} else {
+		for( int k = 0; k < (int)tiles.size(); ++k ) {
+			const Tile& t = tiles[k];
+			if( t.done || t.copies == 0 || k == w.tile )
+				continue;
+			if( id < 0 || t.copies < tiles[id].copies ||
+				(t.copies == tiles[id].copies && t.started < tiles[id].started) )
+				id = k;
+		}
+	}
+
+	w.tile = id;
+	if( id < 0 )
+		return;
+
+	Tile& t = tiles[id];
+	if( t.copies++ == 0 )
+		t.started = nextStart++;
+	int msg[5] = { id, t.x0, t.y0, t.x1, t.y1 };
+	sendInts( w.sock, msg, 5 );     // a failure shows up as a closed socket
+}
+
+// Read what w has sent, storing any finished tile.  Returns false if the
+// worker has gone or sent nonsense.
+bool TileCoordinator::receive( Worker& w )
+{
+	char buf[ 65536 ];
+	int n = recv( w.sock, buf, sizeof( buf ), 0 );
+	if( n <= 0 )
+		return false;
+	w.in.insert( w.in.end(), buf, buf + n );
+
+	while( w.in.size() >= 4 ) {
+		unsigned int raw;
+		memcpy( &raw, &w.in[0], 4 );
+		raw = ntohl( raw );
+
+		// a worker first says what it is rendering
+		if( !w.joined ) {
+			if( raw != renderHash )
+				return false;
+			w.joined = true;
+			w.in.erase( w.in.begin(), w.in.begin() + 4 );
+			assign( w );
+			continue;
+		}
+
+		int id = (int)raw;
+		if( id < 0 || id >= (int)tiles.size() || id != w.tile )
+			return false;
+
+		Tile& t = tiles[id];
+		int rowBytes = (t.x1 - t.x0) * 3;
+		size_t size = 4 + rowBytes * (t.y1 - t.y0);
+		if( w.in.size() < size )
+			return true;
+
+		if( !t.done ) {
+			const unsigned char *p = &w.in[4];
+			for( int y = t.y0; y < t.y1; ++y, p += rowBytes )
+				memcpy( &image[ (y * width + t.x0) * 3 ], p, rowBytes );
+			t.done = true;
+			--remaining;
+		}
+		--t.copies;
+		w.in.erase( w.in.begin(), w.in.begin() + size );
+
+		assign( w );
+	}
+	return true;
+}
+
+// Forget a worker, putting its tile back in the queue if nobody else has
+// it.
+void TileCoordinator::drop( Worker& w )
+{
+	closesocket( w.sock );
+	if( w.tile >= 0 ) {
+		Tile& t = tiles[ w.tile ];
+		if( --t.copies == 0 && !t.done )
+			queue.push_back( w.tile );
+		w.tile = -1;
+	}
+}
+
+bool TileCoordinator::run( int port, bool report )
+{
+	if( !initSockets() )
+		return false;
+
+	SOCKET listener = socket( AF_INET, SOCK_STREAM, 0 );
+	if( listener == INVALID_SOCKET )
+		return false;
+
+	int on = 1;
+	setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof( on ) );
+
+	sockaddr_in addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl( INADDR_ANY );
+	addr.sin_port = htons( (unsigned short)port );
+	if( bind( listener, (sockaddr *)&addr, sizeof( addr ) ) != 0 ||
+		listen( listener, 16 ) != 0 ) {
+		closesocket( listener );
+		return false;
+	}
+
+	if( report )
+		fprintf( stderr, "waiting for workers on port %d, %d of %d tiles to render\n",
+			port, remaining, (int)tiles.size() );
+
+	std::vector<Worker> workers;
+	time_t lastSave = time( NULL );
+	while( remaining > 0 ) {
+		fd_set readable;
+		FD_ZERO( &readable );
+		FD_SET( listener, &readable );
+		SOCKET top = listener;
+		for( size_t k = 0; k < workers.size(); ++k ) {
+			FD_SET( workers[k].sock, &readable );
+			if( workers[k].sock > top )
+				top = workers[k].sock;
+		}
+
+		// wake up now and then to save a checkpoint, even if the workers
+		// are quiet
+		timeval wait = { 1, 0 };
+		if( select( (int)top + 1, &readable, NULL, NULL, checkpoint ? &wait : NULL ) < 0 )
+			break;
+
+		for( size_t k = 0; k < workers.size(); ) {
+			if( FD_ISSET( workers[k].sock, &readable ) && !receive( workers[k] ) ) {
+				bool joined = workers[k].joined;
+				drop( workers[k] );
+				workers.erase( workers.begin() + k );
+				if( report && joined )
+					fprintf( stderr, "worker left, %d left\n", (int)workers.size() );
+				else if( report )
+					fprintf( stderr, "worker with another scene or settings turned away\n" );
+			} else {
+				++k;
+			}
+		}
+
+		if( FD_ISSET( listener, &readable ) ) {
+			Worker w;
+			w.sock = accept( listener, NULL, NULL );
+			w.joined = false;
+			w.tile = -1;
+			int hello[3] = { width, height, (int)renderHash };
+			if( w.sock != INVALID_SOCKET && sendInts( w.sock, hello, 3 ) ) {
+				workers.push_back( w );
+				if( report )
+					fprintf( stderr, "worker joined, %d now\n", (int)workers.size() );
+			} else if( w.sock != INVALID_SOCKET ) {
+				closesocket( w.sock );
+			}
+		}
+
+		// tiles may have come back into the queue, or a new worker may
+		// have joined
+		for( size_t k = 0; k < workers.size(); ++k ) {
+			if( workers[k].joined && workers[k].tile < 0 && remaining > 0 )
+				assign( workers[k] );
+		}
+
+		if( checkpoint && time( NULL ) - lastSave >= checkpointPeriod ) {
+			std::vector<bool> done( tiles.size() );
+			for( size_t k = 0; k < tiles.size(); ++k )
+				done[k] = tiles[k].done;
+			checkpoint->save( &image[0], done );
+			lastSave = time( NULL );
+		}
+	}
+
+	int finished[5] = { -1, 0, 0, 0, 0 };
+	for( size_t k = 0; k < workers.size(); ++k ) {
+		sendInts( workers[k].sock, finished, 5 );
+		closesocket( workers[k].sock );
+	}
+	closesocket( listener );
+
+	return remaining == 0;
+}
+
+bool runTileWorker( RayTracer *tracer, const char *host, int port,
+	unsigned int renderHash )
+{
+	if( !initSockets() )
+		return false;
+
+	hostent *he = gethostbyname( host );
+	if( he == NULL )
+		return false;
+
+	SOCKET s = socket( AF_INET, SOCK_STREAM, 0 );
+	if( s == INVALID_SOCKET )
+		return false;
+
+	sockaddr_in addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	memcpy( &addr.sin_addr, he->h_addr_list[0], he->h_length );
+	addr.sin_port = htons( (unsigned short)port );
+	if( connect( s, (sockaddr *)&addr, sizeof( addr ) ) != 0 ) {
+		closesocket( s );
+		return false;
+	}
+
+	int hello[3];
+	int reply = (int)renderHash;
+	if( !recvInts( s, hello, 3 ) || (unsigned int)hello[2] != renderHash ||
+		!sendInts( s, &reply, 1 ) ) {
+		closesocket( s );
+		return false;
+	}
+	int width = hello[0];
+	tracer->traceSetup( width, hello[1] );
+
+	std::vector<unsigned char> out;
+	int msg[5];
+	while( recvInts( s, msg, 5 ) && msg[0] >= 0 ) {
+		int x0 = msg[1], y0 = msg[2], x1 = msg[3], y1 = msg[4];
+		tracer->traceTile( x0, y0, x1, y1 );
+
+		unsigned char *buf;
+		int w, h;
+		tracer->getBuffer( buf, w, h );
+
+		int rowBytes = (x1 - x0) * 3;
+		out.resize( 4 + rowBytes * (y1 - y0) );
+		unsigned int id = htonl( (unsigned int)msg[0] );
+		memcpy( &out[0], &id, 4 );
+		for( int y = y0; y < y1; ++y )
+			memcpy( &out[ 4 + (y - y0) * rowBytes ], &buf[ (y * width + x0) * 3 ], rowBytes );
+
+		if( !sendAll( s, &out[0], out.size() ) )
+			break;
+	}
+
+	closesocket( s );
+	return true;
+}
@@ -0,0 +1,75 @@
+#ifndef __DISTRIBUTED_H__
+#define __DISTRIBUTED_H__
+
+// Rendering one image with several processes, possibly on several
+// machines.  A coordinator listens on a TCP port and hands out tiles of
+// the image; each worker loads the same scene, renders the tiles it is
+// given with its own RayTracer and sends the pixels back.
+//
+// The coordinator and each worker hash the scene and the render settings
+// (see renderHash in main.cpp); a worker whose hash differs is turned
+// away, since its tiles wouldn't match the others'.
+//
+// Workers may come and go while the image is rendered.  A tile whose
+// worker disconnects goes back in the queue; once the queue is empty,
+// idle workers are given copies of tiles that are still out, so one slow
+// or hung worker can't hold up the image.  Whichever copy comes back
+// first is used.
+
+#include <vector>
+
+class RayTracer;
+class Checkpoint;
+
+class TileCoordinator
+{
+public:
+	TileCoordinator( int width, int height, int tileSize, unsigned int renderHash );
+
+	// Save the finished tiles to checkpoint, which must have the same
+	// size and tiles, every 'period' seconds.  If resuming, the tiles
+	// already in it aren't rendered again.
+	void setCheckpoint( Checkpoint *checkpoint, int period, bool resume );
+
+	// Serve tiles on the port until every one is back.  Returns false if
+	// the port can't be listened on.
+	bool run( int port, bool report );
+
+	// the finished image, as RayTracer::getBuffer
+	unsigned char *getBuffer() { return &image[0]; }
+
+private:
+	struct Tile
+	{
+		int x0, y0, x1, y1;
+		bool done;
+		int copies;             // workers rendering it now
+		int started;            // order in which tiles were first given out
+	};
+
+	struct Worker;
+
+	void assign( Worker& w );
+	bool receive( Worker& w );
+	void drop( Worker& w );
+
+	int width, height;
+	unsigned int renderHash;
+	std::vector<Tile> tiles;
+	std::vector<int> queue;         // tiles not given to anyone yet
+	int remaining;                  // tiles not yet back
+	int nextStart;
+	std::vector<unsigned char> image;
+
+	Checkpoint *checkpoint;
+	int checkpointPeriod;
+};
+
+// Join the coordinator at host:port and render tiles for it with tracer,
+// whose scene must already be loaded, until it has no more.  Returns false
+// if it can't be reached, or is rendering something whose hash isn't
+// renderHash.
+bool runTileWorker( RayTracer *tracer, const char *host, int port,
+	unsigned int renderHash );
+
+#endif // __DISTRIBUTED_H__
@@ -19,9 +19,12 @@
 #include "../SceneObjects/Cylinder.h"
 #include "../SceneObjects/Sphere.h"
 #include "../SceneObjects/Square.h"
+#include "../SceneObjects/SphereCloud.h"
 #include "../scene/light.h"
+#include "../scene/animation.h"
+#include "../scene/instance.h"
 
-typedef map<string,Material*> mmap;
+typedef map<string,int> mmap;  // material names to ids in the scene's table
 
 static void processObject( Obj *obj, Scene *scene, mmap& materials );
 static Obj *getColorField( Obj *obj );
@@ -32,10 +35,27 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 	const mmap& materials, TransformNode *transform );
 static void processTrimesh( string name, Obj *child, Scene *scene,
                                      const mmap& materials, TransformNode *transform );
+static void processSpheres( Obj *child, Scene *scene,
+	const mmap& materials, TransformNode *transform );
 static void processCamera( Obj *child, Scene *scene );
-static Material *getMaterial( Obj *child, const mmap& bindings );
-static Material *processMaterial( Obj *child, mmap *bindings = NULL );
+static void processPrototype( Obj *child, Scene *scene, const mmap& materials );
+static int getMaterial( Obj *child, Scene *scene, const mmap& bindings );
+static int processMaterial( Obj *child, Scene *scene, mmap *bindings = NULL );
 static void verifyTuple( const mytuple& tup, size_t size );
+static void readHeader( istream& is );
+static void processKey( Obj *obj, Animation *animation );
+
+// Directory of the scene file being read, with a trailing separator.
+// Relative file names, of textures and sphere files, are looked up there.
+static string sceneDirectory;
+
+// fname as given, or in sceneDirectory if it is relative
+static string scenePath( const string& fname )
+{
+	bool absolute = !fname.empty() &&
+		(fname[0] == '/' || fname[0] == '\\' || fname.find( ':' ) != string::npos);
+	return absolute ? fname : sceneDirectory + fname;
+}
 
 Scene *readScene( const string& filename )
 {
@@ -45,6 +65,9 @@ Scene *readScene( const string& filename )
 		return NULL;
 	}
 
+	string::size_type slash = filename.find_last_of( "/\\" );
+	sceneDirectory = (slash == string::npos) ? string() : filename.substr( 0, slash + 1 );
+
 	try {
 		return readScene( ifs );
 	} catch( ParseError& pe ) {
@@ -56,7 +79,70 @@ Scene *readScene( const string& filename )
 Scene *readScene( istream& is )
 {
 	Scene *ret = new Scene;
-	
+
+	readHeader( is );
+
+	// vector<Obj*> result;
+	mmap materials;
+
+	while( true ) {
+		Obj *cur = readFile( is );
+		if( !cur ) {
+			break;
+		}
+
+		try {
+			processObject( cur, ret, materials );
+		} catch( ... ) {
+			// what has been read so far goes with the scene
+			delete cur;
+			delete ret;
+			throw;
+		}
+		delete cur;
+	}
+
+	return ret;
+}
+
+Animation *readAnimation( const string& filename )
+{
+	ifstream ifs( filename.c_str() );
+	if( !ifs ) {
+		cerr << "Error: couldn't read keyframe file " << filename << endl;
+		return NULL;
+	}
+
+	try {
+		return readAnimation( ifs );
+	} catch( ParseError& pe ) {
+		cout << "Parse error: " << pe << endl;
+		return NULL;
+	}
+}
+
+Animation *readAnimation( istream& is )
+{
+	Animation *ret = new Animation;
+
+	readHeader( is );
+
+	while( true ) {
+		Obj *cur = readFile( is );
+		if( !cur ) {
+			break;
+		}
+
+		processKey( cur, ret );
+		delete cur;
+	}
+
+	return ret;
+}
+
+// Check the "SBT-raytracer 1.0" line at the start of a file.
+static void readHeader( istream& is )
+{
 	// Extract the file header
 	static const int MAXNAME = 80;
 	char buf[ MAXNAME ];
@@ -86,21 +172,6 @@ Scene *readScene( istream& is )
 
 		throw ParseError( string( oss.str() ) );
 	}
-
-	// vector<Obj*> result;
-	mmap materials;
-
-	while( true ) {
-		Obj *cur = readFile( is );
-		if( !cur ) {
-			break;
-		}
-
-		processObject( cur, ret, materials );
-		delete cur;
-	}
-
-	return ret;
 }
 
 // Find a color field inside some object.  Now, I recognize that not
@@ -259,6 +330,18 @@ static void processGeometry( string name, Obj *child, Scene *scene,
                                                                         tup[1]->getScalar(),
                                                                         tup[2]->getScalar() ) ) ) );
 		}
+	} else if( name == "move" ) {
+		// translated by nothing when the shutter opens, by the given offset
+		// when it closes
+		const mytuple& tup = child->getTuple();
+		verifyTuple( tup, 4 );
+		processGeometry( tup[3],
+                         scene,
+                         materials,
+                         transform->createMovingChild( mat4f(),
+                                                       mat4f::translate( vec3f(tup[0]->getScalar(),
+                                                                               tup[1]->getScalar(),
+                                                                               tup[2]->getScalar() ) ) ) );
 	} else if( name == "transform" ) {
 		const mytuple& tup = child->getTuple();
 		verifyTuple( tup, 5 );
@@ -293,21 +376,34 @@ static void processGeometry( string name, Obj *child, Scene *scene,
                                                              l4[3]->getScalar() ) ) ) );
 	} else if( name == "trimesh" || name == "polymesh" ) { // 'polymesh' is for backwards compatibility
         processTrimesh( name, child, scene, materials, transform);
+	} else if( name == "spheres" ) {
+		processSpheres( child, scene, materials, transform );
+	} else if( name == "instance" ) {
+		string protoName = getField( child, "name" )->getString();
+		Prototype *proto = scene->getPrototype( protoName );
+		if( proto == NULL ) {
+			throw ParseError( string( "Unknown prototype: " ) + protoName );
+		}
+
+		Instance *inst = new( scene->getArena() ) Instance( scene, proto );
+		inst->setTransform( transform );
+		scene->add( inst );
     } else {
 		SceneObject *obj = NULL;
-       	Material *mat;
+       	int mat;
+		Arena& arena = scene->getArena();
         
         //if( hasField( child, "material" ) )
-        mat = getMaterial(getField( child, "material" ), materials );
+        mat = getMaterial(getField( child, "material" ), scene, materials );
         //else
         //    mat = new Material();
 
 		if( name == "sphere" ) {
-			obj = new Sphere( scene, mat );
+			obj = new( arena ) Sphere( scene, mat );
 		} else if( name == "box" ) {
-			obj = new Box( scene, mat );
+			obj = new( arena ) Box( scene, mat );
 		} else if( name == "cylinder" ) {
-			obj = new Cylinder( scene, mat );
+			obj = new( arena ) Cylinder( scene, mat );
 		} else if( name == "cone" ) {
 			double height = 1.0;
 			double bottom_radius = 1.0;
@@ -319,9 +415,9 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 			maybeExtractField( child, "top_radius", top_radius );
 			maybeExtractField( child, "capped", capped );
 
-			obj = new Cone( scene, mat, height, bottom_radius, top_radius, capped );
+			obj = new( arena ) Cone( scene, mat, height, bottom_radius, top_radius, capped );
 		} else if( name == "square" ) {
-			obj = new Square( scene, mat );
+			obj = new( arena ) Square( scene, mat );
 		}
 
         obj->setTransform(transform);
@@ -333,14 +429,15 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 static void processTrimesh( string name, Obj *child, Scene *scene,
                                      const mmap& materials, TransformNode *transform )
 {
-    Material *mat;
+    int mat;
+    Arena& arena = scene->getArena();
     
     if( hasField( child, "material" ) )
-        mat = getMaterial( getField( child, "material" ), materials );
+        mat = getMaterial( getField( child, "material" ), scene, materials );
     else
-        mat = new Material();
+        mat = scene->addMaterial( Material() );
     
-    Trimesh *tmesh = new Trimesh( scene, mat, transform);
+    Trimesh *tmesh = arena.own( new( arena ) Trimesh( scene, mat, transform) );
 
     const mytuple &points = getField( child, "points" )->getTuple();
     for( mytuple::const_iterator pi = points.begin(); pi != points.end(); ++pi )
@@ -377,7 +474,7 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
     {
         const mytuple &mats = getField( child, "materials" )->getTuple();
         for( mytuple::const_iterator mi = mats.begin(); mi != mats.end(); ++mi )
-            tmesh->addMaterial( getMaterial( *mi, materials ) );
+            tmesh->addMaterial( getMaterial( *mi, scene, materials ) );
     }
     if( hasField( child, "normals" ) )
     {
@@ -390,10 +487,63 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
     if( error = tmesh->doubleCheck() )
         throw ParseError( error );
 
-    scene->add(tmesh);
+    // The mesh itself is never hit, only the faces addFace put in the
+    // scene, so it isn't added; the arena keeps it for them.
+}
+
+// spheres { centers = ( (x,y,z), ... ); radii = ( r, ... ); }, with a
+// single radius = r instead of radii if they are all the same, and/or
+// file = "name" for a binary file of them (see SphereCloud::addSpheres).
+static void processSpheres( Obj *child, Scene *scene,
+	const mmap& materials, TransformNode *transform )
+{
+	int mat;
+	Arena& arena = scene->getArena();
+	if( hasField( child, "material" ) )
+		mat = getMaterial( getField( child, "material" ), scene, materials );
+	else
+		mat = scene->addMaterial( Material() );
+
+	SphereCloud *cloud = arena.own( new( arena ) SphereCloud( scene, mat ) );
+
+	if( hasField( child, "file" ) ) {
+		string fname = scenePath( getField( child, "file" )->getString() );
+		if( !cloud->addSpheres( fname.c_str() ) ) {
+			throw ParseError( string( "Couldn't read spheres file " ) + fname );
+		}
+		scene->addInputFile( fname );
+	}
+
+	if( hasField( child, "centers" ) ) {
+		const mytuple &centers = getField( child, "centers" )->getTuple();
+		double radius = 1.0;
+		maybeExtractField( child, "radius", radius );
+
+		const mytuple *radii = NULL;
+		if( hasField( child, "radii" ) ) {
+			radii = &getField( child, "radii" )->getTuple();
+			if( radii->size() != centers.size() ) {
+				throw ParseError( "spheres needs one radius per center." );
+			}
+		}
+
+		for( size_t k = 0; k < centers.size(); ++k ) {
+			cloud->addSphere( tupleToVec( centers[k] ),
+				radii ? (*radii)[k]->getScalar() : radius );
+		}
+	}
+
+	if( cloud->getNumSpheres() == 0 ) {
+		throw ParseError( "spheres has no spheres." );
+	}
+
+	cloud->build();
+	cloud->setTransform( transform );
+	scene->giveOrder( cloud );
+	scene->add( cloud );
 }
 
-static Material *getMaterial( Obj *child, const mmap& bindings )
+static int getMaterial( Obj *child, Scene *scene, const mmap& bindings )
 {
 	string tfield = child->getTypeName();
 	if( tfield == "id" ) {
@@ -408,45 +558,57 @@ static Material *getMaterial( Obj *child, const mmap& bindings )
 		} 
 	} 
 	// Don't allow binding.
-	return processMaterial( child );
+	return processMaterial( child, scene );
 }
 
-static Material *processMaterial( Obj *child, mmap *bindings )
+static int processMaterial( Obj *child, Scene *scene, mmap *bindings )
 // Generate a material from a parse sub-tree
 //
 // child   - root of parse tree
 // mmap    - bindings of names to materials (if non-null)
 // defmat  - material to start with (if non-null)
 {
-    Material *mat;
-    mat = new Material();
+    Material mat;
 	
     if( hasField( child, "emissive" ) ) {
-        mat->ke = tupleToVec( getField( child, "emissive" ) );
+        mat.ke = tupleToVec( getField( child, "emissive" ) );
     }
     if( hasField( child, "ambient" ) ) {
-        mat->ka = tupleToVec( getField( child, "ambient" ) );
+        mat.ka = tupleToVec( getField( child, "ambient" ) );
     }
     if( hasField( child, "specular" ) ) {
-        mat->ks = tupleToVec( getField( child, "specular" ) );
+        mat.ks = tupleToVec( getField( child, "specular" ) );
     }
     if( hasField( child, "diffuse" ) ) {
-        mat->kd = tupleToVec( getField( child, "diffuse" ) );
+        mat.kd = tupleToVec( getField( child, "diffuse" ) );
     }
     if( hasField( child, "reflective" ) ) {
-        mat->kr = tupleToVec( getField( child, "reflective" ) );
+        mat.kr = tupleToVec( getField( child, "reflective" ) );
     } else {
-        mat->kr = mat->ks; // defaults to ks if none given.
+        mat.kr = mat.ks; // defaults to ks if none given.
     }
     if( hasField( child, "transmissive" ) ) {
-        mat->kt = tupleToVec( getField( child, "transmissive" ) );
+        mat.kt = tupleToVec( getField( child, "transmissive" ) );
     }
     if( hasField( child, "index" ) ) { // index of refraction
-        mat->index = getField( child, "index" )->getScalar();
+        mat.index = getField( child, "index" )->getScalar();
     }
     if( hasField( child, "shininess" ) ) {
-        mat->shininess = getField( child, "shininess" )->getScalar();
+        mat.shininess = getField( child, "shininess" )->getScalar();
     }
+    if( hasField( child, "texture" ) ) { // image file, replaces diffuse
+        string fname = scenePath( getField( child, "texture" )->getString() );
+
+        // Materials naming the same file share one copy of it
+        mat.texture = TextureRef( fname );
+        if( !mat.texture.get() ) {
+            throw ParseError( string( "Couldn't read texture file " ) + fname );
+        }
+        scene->addInputFile( fname );
+    }
+
+    // an inline material repeated on many objects is stored once
+    int id = scene->addMaterial( mat );
 
     if( bindings != NULL ) {
         // Want to bind, better have "name" field:
@@ -460,14 +622,14 @@ static Material *processMaterial( Obj *child, mmap *bindings )
                 name = field->getString();
             }
 
-            (*bindings)[ name ] = mat;
+            (*bindings)[ name ] = id;
         } else {
             throw ParseError( 
                 string( "Attempt to bind material with no name" ) );
         }
     }
 
-    return mat;
+    return id;
 }
 
 static void
@@ -490,6 +652,10 @@ processCamera( Obj *child, Scene *scene )
         scene->getCamera()->setFOV( getField( child, "fov" )->getScalar() );
     if( hasField( child, "aspectratio" ) )
         scene->getCamera()->setAspectRatio( getField( child, "aspectratio" )->getScalar() );
+    if( hasField( child, "lens_radius" ) )
+        scene->getCamera()->setLensRadius( getField( child, "lens_radius" )->getScalar() );
+    if( hasField( child, "focus_distance" ) )
+        scene->getCamera()->setFocalDistance( getField( child, "focus_distance" )->getScalar() );
     if( hasField( child, "viewdir" ) && hasField( child, "updir" ) )
     {
         scene->getCamera()->setLook( tupleToVec( getField( child, "viewdir" ) ).normalize(),
@@ -497,6 +663,122 @@ processCamera( Obj *child, Scene *scene )
     }
 }
 
+// A keyframe, one of
+//
+//   camera_key { frame = 0; position = (0,0,-4); fov = 30; ... }
+//   light_key { frame = 0; light = 1; colour = (1,1,1); ... }
+//   object_key { frame = 0; object = 2; translate = (0,1,0); rotate = (0,0,1.57); scale = (2,2,2); }
+//
+// giving the values some of the camera's or a light's fields (as named in
+// the scene file) have at that frame, or how far an object has moved from
+// where the scene file puts it (see Animation::addObjectKey).  Lights and
+// objects are numbered in the order the scene file gives them, from 0;
+// an object is a top level translate, rotate, scale, transform or move.
+static void processKey( Obj *obj, Animation *animation )
+{
+	if( obj->getTypeName() != "named" ) {
+		ostrstream oss;
+		oss << "Unknown keyframe object ";
+		obj->printOn( oss );
+
+		throw ParseError( string( oss.str() ) );
+	}
+
+	string name = obj->getName();
+	Obj *child = obj->getChild();
+	double frame = getField( child, "frame" )->getScalar();
+
+	if( name == "camera_key" ) {
+		static const char *vectors[] = { "position", "viewdir", "updir" };
+		static const char *scalars[] = { "fov", "lens_radius", "focus_distance" };
+		int k;
+
+		if( hasField( child, "viewdir" ) != hasField( child, "updir" ) ) {
+			throw ParseError( "camera_key needs both viewdir and updir, or neither" );
+		}
+		for( k = 0; k < 3; ++k ) {
+			if( hasField( child, vectors[k] ) ) {
+				animation->addKey( Animation::CAMERA, vectors[k], frame,
+					tupleToVec( getField( child, vectors[k] ) ) );
+			}
+		}
+		for( k = 0; k < 3; ++k ) {
+			double value;
+			if( maybeExtractField( child, scalars[k], value ) ) {
+				animation->addKey( Animation::CAMERA, scalars[k], frame,
+					vec3f( value, 0.0, 0.0 ) );
+			}
+		}
+	} else if( name == "light_key" ) {
+		int light = int( getField( child, "light" )->getScalar() );
+		if( light < 0 ) {
+			throw ParseError( "light_key with a negative light number" );
+		}
+
+		if( hasField( child, "position" ) ) {
+			animation->addKey( light, "position", frame,
+				tupleToVec( getField( child, "position" ) ) );
+		}
+		if( hasField( child, "direction" ) ) {
+			animation->addKey( light, "direction", frame,
+				tupleToVec( getField( child, "direction" ) ) );
+		}
+		if( hasField( child, "color" ) || hasField( child, "colour" ) ) {
+			animation->addKey( light, "colour", frame,
+				tupleToVec( getColorField( child ) ) );
+		}
+	} else if( name == "object_key" ) {
+		static const char *vectors[] = { "translate", "rotate", "scale" };
+
+		int object = int( getField( child, "object" )->getScalar() );
+		if( object < 0 ) {
+			throw ParseError( "object_key with a negative object number" );
+		}
+
+		for( int k = 0; k < 3; ++k ) {
+			if( hasField( child, vectors[k] ) ) {
+				animation->addObjectKey( object, vectors[k], frame,
+					tupleToVec( getField( child, vectors[k] ) ) );
+			}
+		}
+	} else {
+		throw ParseError( string( "Unrecognized keyframe: " ) + name );
+	}
+}
+
+// A prototype for instances to share:
+//
+//   prototype { name = "tree"; object = polymesh { ... }; }
+//
+// object may also be a tuple of objects.  Nothing is added to the scene
+// until an instance { name = "tree"; } puts a copy there.
+static void processPrototype( Obj *child, Scene *scene, const mmap& materials )
+{
+	string name = getField( child, "name" )->getString();
+	if( scene->getPrototype( name ) ) {
+		throw ParseError( string( "Prototype defined twice: " ) + name );
+	}
+
+	// read the objects into the scene as usual, then take them out again
+	Arena& arena = scene->getArena();
+	Prototype *proto = arena.own( new( arena ) Prototype( arena ) );
+	int first = scene->getNumObjects();
+	Obj *object = getField( child, "object" );
+	if( object->getTypeName() == "tuple" ) {
+		const mytuple& tup = object->getTuple();
+		for( mytuple::const_iterator i = tup.begin(); i != tup.end(); ++i ) {
+			processGeometry( *i, scene, materials, &proto->transformRoot );
+		}
+	} else {
+		processGeometry( object, scene, materials, &proto->transformRoot );
+	}
+
+	list<Geometry*> objects;
+	scene->removeObjects( first, objects );
+	proto->init( objects );
+	scene->addPrototype( name, proto );
+}
+
 static void processObject( Obj *obj, Scene *scene, mmap& materials )
 {
 	// Assume the object is named.
@@ -543,21 +825,51 @@ static void processObject( Obj *obj, Scene *scene, mmap& materials )
 			tupleToVec( getColorField( child ) ),
 			getField( child, "angle" )->getScalar(),
 			tupleToVec( getField( child, "direction" ) ).normalize() ) );
+	} else if( name == "rectangle_light" ) {
+		if( child == NULL ) {
+			throw ParseError( "No info for rectangle_light" );
+		}
+
+		double samples = 16.0;
+		maybeExtractField( child, "samples", samples );
+		scene->add( new RectangleLight( scene, 
+			tupleToVec( getField( child, "position" ) ),
+			tupleToVec( getField( child, "u" ) ),
+			tupleToVec( getField( child, "v" ) ),
+			tupleToVec( getColorField( child ) ),
+			int( samples ) ) );
+	} else if( name == "sphere_light" ) {
+		if( child == NULL ) {
+			throw ParseError( "No info for sphere_light" );
+		}
+
+		double samples = 16.0;
+		maybeExtractField( child, "samples", samples );
+		scene->add( new SphereLight( scene, 
+			tupleToVec( getField( child, "position" ) ),
+			getField( child, "radius" )->getScalar(),
+			tupleToVec( getColorField( child ) ),
+			int( samples ) ) );
 	} else if( 	name == "sphere" ||
 				name == "box" ||
 				name == "cylinder" ||
 				name == "cone" ||
 				name == "square" ||
 				name == "translate" ||
+				name == "move" ||
 				name == "rotate" ||
 				name == "scale" ||
 				name == "transform" ||
+				name == "instance" ||
+				name == "spheres" ||
                 name == "trimesh" ||
                 name == "polymesh") { // polymesh is for backwards compatibility.
 		processGeometry( name, child, scene, materials, &scene->transformRoot);
 		//scene->add( geo );
 	} else if( name == "material" ) {
-		processMaterial( child, &materials );
+		processMaterial( child, scene, &materials );
+	} else if( name == "prototype" ) {
+		processPrototype( child, scene, materials );
 	} else if( name == "camera" ) {
 		processCamera( child, scene );
 	} else {
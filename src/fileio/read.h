@@ -6,7 +6,14 @@
 
 #include "../scene/scene.h"
 
+class Animation;
+
 Scene *readScene( const string& filename );
 Scene *readScene( istream& is );
 
+// Keyframes for the camera and lights, from a file in the scene file
+// format (see processKey in read.cpp).
+Animation *readAnimation( const string& filename );
+Animation *readAnimation( istream& is );
+
 #endif // __READ_H__
@@ -55,7 +55,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <time.h>
+#include <ctype.h>
+#include <vector>
 
 #include <FL/Fl.h>
 #include <FL/Fl_Window.H>
@@ -65,8 +68,14 @@
 
 #include "ui/TraceUI.h"
 #include "RayTracer.h"
+#include "distributed.h"
+#include "checkpoint.h"
+#include "bench.h"
 
 #include "fileio/bitmap.h"
+#include "fileio/read.h"
+#include "scene/animation.h"
+#include "scene/texture.h"
 
 // ***********************************************************
 // from getopt.cpp 
@@ -88,23 +97,88 @@ int g_height;
 int g_width = 150;
 bool bReport = false;
 char *progname, *rayName, *imgName;
+char *keyName = NULL;
+int firstFrame = 0, lastFrame = -1;	// default: every frame with keys
+int coordinatorPort = 0;
+char *workerAddress = NULL;
+int tileSize = 32;
+int checkpointPeriod = 0;	// seconds, 0 for no checkpoints
+bool bResume = false;
+char *benchName = NULL;
 
 void usage()
 {
 #ifdef WIN32
-	fl_alert( "usage: %s [-r <#> -w <#> -t] [input.ray output.bmp]\n", progname );
+	fl_alert( "usage: %s [-r <#> -w <#> -m <#> -a <keys> -f <#>-<#> -c <port> -s <#> -k <#> --resume -t] [input.ray output.bmp]\n"
+		"       %s -j <host>:<port> input.ray\n"
+		"       %s -b <benchmark>\n", progname, progname, progname );
 #else
 	fprintf( stderr, "usage: %s [options] [input.ray output.bmp]\n", progname );
+	fprintf( stderr, "       %s -j <host>:<port> input.ray\n", progname );
+	fprintf( stderr, "       %s -b <benchmark>\n", progname );
 	fprintf( stderr, "  -r <#>      set recurssion level (default %d)\n", recursion_depth );
 	fprintf( stderr, "  -w <#>      set output image width (default %d)\n", g_width );
+	fprintf( stderr, "  -m <#>      set texture memory budget in MB (default %d)\n",
+		int( TextureCache::instance().getBudget() >> 20 ) );
+	fprintf( stderr, "  -a <file>   render an animation with the camera, lights and objects\n" );
+	fprintf( stderr, "              keyframed in file; output.bmp gets the frame number\n" );
+	fprintf( stderr, "              where it has a %%d or %%04d, say, else before the\n" );
+	fprintf( stderr, "              extension\n" );
+	fprintf( stderr, "  -f <#>-<#>  frames to render with -a (default all keyed)\n" );
+	fprintf( stderr, "  -c <port>   coordinate workers on port to render the image\n" );
+	fprintf( stderr, "  -s <#>      tile size for -c and -k (default %d)\n", tileSize );
+	fprintf( stderr, "  -k <#>      save finished tiles to output.bmp.ckpt every # seconds\n" );
+	fprintf( stderr, "  --resume    carry on from output.bmp.ckpt (checkpointing every\n" );
+	fprintf( stderr, "              60 seconds unless -k says otherwise)\n" );
+	fprintf( stderr, "  -j <h>:<p>  work for the coordinator on host h, port p, with\n" );
+	fprintf( stderr, "              the same input.ray\n" );
 	fprintf( stderr, "  -t			report time statistics\n" );
+	fprintf( stderr, "  -b <name>   time a ray-primitive test instead of rendering: %s\n",
+		benchmarkNames() );
 #endif
 }
 
+// Is name fit to be the printf format of an animation's output files:
+// exactly one %d, or %0Nd for a zero padded width, with any other %
+// doubled?
+static bool isFrameFormat( const char *name )
+{
+	int conversions = 0;
+	for ( const char *p = name; *p; ++p ) {
+		if ( *p != '%' )
+			continue;
+		if ( *++p == '%' )
+			continue;
+		if ( *p == '0' ) {
+			if ( !isdigit( (unsigned char)*++p ) )
+				return false;
+			if ( isdigit( (unsigned char)p[1] ) )
+				++p;
+			++p;
+		}
+		if ( *p != 'd' )
+			return false;
+		++conversions;
+	}
+	return conversions == 1;
+}
+
 bool processArgs(int argc, char **argv) {
 	int i;
 
-    while ( (i = getopt( argc, argv, "tr:w:h:" )) != EOF )
+	// getopt only knows single letter options, so take out --resume first
+	int kept = 1;
+	for ( i = 1; i < argc; ++i ) {
+		if ( strcmp( argv[i], "--resume" ) == 0 )
+			bResume = true;
+		else
+			argv[kept++] = argv[i];
+	}
+	argc = kept;
+	if ( bResume && checkpointPeriod == 0 )
+		checkpointPeriod = 60;
+
+    while ( (i = getopt( argc, argv, "tr:w:h:m:a:f:c:j:s:k:b:" )) != EOF )
 	{
 		switch ( i )
 		{
@@ -124,23 +198,272 @@ bool processArgs(int argc, char **argv) {
 			g_height = atoi( optarg );
 			break;
 
+			case 'm':
+			TextureCache::instance().setBudget( size_t( atoi( optarg ) ) << 20 );
+			break;
+
+			case 'a':
+			keyName = optarg;
+			break;
+
+			case 'f':
+			if ( sscanf( optarg, "%d-%d", &firstFrame, &lastFrame ) != 2 )
+				return false;
+			if ( lastFrame < firstFrame ) {
+				fprintf( stderr, "frame range %s is backwards.\n", optarg );
+				return false;
+			}
+			break;
+
+			case 'c':
+			coordinatorPort = atoi( optarg );
+			break;
+
+			case 'j':
+			workerAddress = optarg;
+			break;
+
+			case 's':
+			tileSize = atoi( optarg );
+			if ( tileSize < 1 )
+				return false;
+			break;
+
+			case 'k':
+			checkpointPeriod = atoi( optarg );
+			if ( checkpointPeriod < 1 )
+				return false;
+			break;
+
+			case 'b':
+			benchName = optarg;
+			break;
+
 			default:
 			return false;
 		}
     }
 
-    if ( optind >= argc-1 )
+	// a benchmark needs no files
+	if ( benchName )
+		return true;
+
+	// a worker doesn't write an image
+    if ( optind >= argc - (workerAddress ? 0 : 1) )
     {
 		fprintf( stderr, "no input and/or output name.\n" );
 		return false;
     }
 
     rayName = argv[optind];
-    imgName = argv[optind+1];
+    imgName = workerAddress ? NULL : argv[optind+1];
+
+	if ( keyName && strchr( imgName, '%' ) && !isFrameFormat( imgName ) ) {
+		fprintf( stderr, "%s needs exactly one %%d or %%0Nd for the frame number.\n", imgName );
+		return false;
+	}
 
 	return true;
 }
 
+// Output file name for a frame of an animation.  A name with a % in it
+// has been checked by isFrameFormat.
+string frameName( const char *name, int frame )
+{
+	char buf[ 16 ];
+	string s( name );
+	if ( s.find( '%' ) != string::npos ) {
+		vector<char> out( snprintf( NULL, 0, name, frame ) + 1 );
+		snprintf( &out[0], out.size(), name, frame );
+		return &out[0];
+	}
+
+	string::size_type dot = s.find_last_of( '.' );
+	string::size_type slash = s.find_last_of( "/\\" );
+	if ( dot == string::npos || ( slash != string::npos && dot < slash ) )
+		dot = s.size();
+	snprintf( buf, sizeof( buf ), ".%04d", frame );
+	return s.substr( 0, dot ) + buf + s.substr( dot );
+}
+
+// Render every frame of an animation from the one loaded scene.  Nothing
+// about the geometry or the textures is loaded again between frames, and
+// objects that move only have the BVH refitted around them.
+void renderAnimation( Animation *animation )
+{
+	if ( lastFrame < firstFrame ) {
+		firstFrame = (int)ceil( animation->getFirstFrame() );
+		lastFrame = (int)floor( animation->getLastFrame() );
+	}
+
+	Scene *scene = theRayTracer->getScene();
+	if ( animation->getNumLights() > scene->getNumLights() )
+		fprintf( stderr, "warning: keys for light %d, but the scene has only %d lights\n",
+			animation->getNumLights() - 1, scene->getNumLights() );
+
+	int objects = distance( scene->transformRoot.beginChildren(), scene->transformRoot.endChildren() );
+	if ( animation->getNumObjects() > objects )
+		fprintf( stderr, "warning: keys for object %d, but the scene has only %d top level transformations\n",
+			animation->getNumObjects() - 1, objects );
+
+	clock_t total = 0;
+	for ( int frame = firstFrame; frame <= lastFrame; ++frame ) {
+		animation->apply( scene, frame );
+
+		// the field of view sets how wide each pixel's rays spread
+		theRayTracer->traceSetup( g_width, g_height );
+
+		clock_t start = clock();
+		theRayTracer->traceLines( 0, g_height );
+		clock_t end = clock();
+		total += end - start;
+
+		unsigned char* buf;
+		theRayTracer->getBuffer( buf, g_width, g_height );
+		string name = frameName( imgName, frame );
+		if ( buf )
+			writeBMP( const_cast<char*>( name.c_str() ), g_width, g_height, buf );
+
+		if ( bReport )
+			fprintf( stderr, "frame %d: %.3f seconds\n", frame,
+				(double)(end - start) / CLOCKS_PER_SEC );
+	}
+
+	if ( bReport ) {
+		double t = (double)total / CLOCKS_PER_SEC;
+#ifdef WIN32
+		fl_message( "total time = %.3f seconds\n", t );
+#else
+		fprintf( stderr, "total time = %.3f seconds\n", t );
+#endif
+	}
+}
+
+// A hash of everything the pixels depend on besides the image size: the
+// scene file, the files it reads, and the settings the tracer uses.
+// Workers and checkpoints with another hash are of another render.
+unsigned int renderHash()
+{
+	unsigned int h = hashFile( HASH_START, rayName );
+	const vector<string>& files = theRayTracer->getScene()->getInputFiles();
+	for ( size_t k = 0; k < files.size(); ++k )
+		h = hashFile( h, files[k].c_str() );
+
+	double settings[] = {
+		double( traceUI->getDepth() ),
+		traceUI->getAttenuationConstant(),
+		traceUI->getAttenuationLinear(),
+		traceUI->getAttenuationQuadratic(),
+		traceUI->getAmbientLight(),
+		double( traceUI->getAntialiasingSize() ),
+		traceUI->getThreshold(),
+		double( traceUI->getGlossySamples() ),
+		double( traceUI->getLightSamples() ),
+		double( traceUI->getBlurSamples() ),
+		double( traceUI->isEnableFresnel() ),
+		double( traceUI->isEnableJittering() ),
+		double( traceUI->isEnableTextureMapping() ),
+		double( traceUI->isEnableGlossy() ),
+		double( traceUI->isEnableWatertight() ),
+		double( traceUI->isEnableRoulette() )
+	};
+	return hashBytes( h, settings, sizeof( settings ) );
+}
+
+// Render tiles for the coordinator at workerAddress.
+void runWorker()
+{
+	char host[ 256 ];
+	int port;
+	if ( sscanf( workerAddress, "%255[^:]:%d", host, &port ) != 2 ) {
+		fprintf( stderr, "bad coordinator address %s, expected host:port\n", workerAddress );
+		exit( 1 );
+	}
+
+	if ( !runTileWorker( theRayTracer, host, port, renderHash() ) ) {
+		fprintf( stderr, "couldn't reach the coordinator at %s, or it is rendering\n"
+			"another scene or with other settings\n", workerAddress );
+		exit( 1 );
+	}
+}
+
+// With --resume, stop rather than overwrite a checkpoint of some other
+// render: the scene, a file it reads or a setting has changed since.
+void checkResumable( const Checkpoint& checkpoint )
+{
+	if ( bResume && checkpoint.isStale() ) {
+		fprintf( stderr, "%s.ckpt is of another scene or other settings; remove it\n"
+			"to start afresh\n", imgName );
+		exit( 1 );
+	}
+}
+
+// Render the image a tile at a time, saving the finished ones to a
+// checkpoint every checkpointPeriod seconds, and save it.
+void renderCheckpointed()
+{
+	Checkpoint checkpoint( string( imgName ) + ".ckpt", renderHash(), g_width, g_height, tileSize );
+	checkResumable( checkpoint );
+	theRayTracer->traceSetup( g_width, g_height );
+
+	unsigned char* buf;
+	theRayTracer->getBuffer( buf, g_width, g_height );
+
+	int n = checkpoint.getNumTiles();
+	vector<bool> done( n, false );
+	if ( bResume && !checkpoint.load( buf, done ) )
+		fprintf( stderr, "no checkpoint for this render, starting afresh\n" );
+
+	clock_t start = clock();
+	time_t lastSave = time( NULL );
+	for ( int k = 0; k < n; ++k ) {
+		if ( done[k] )
+			continue;
+
+		int x0, y0, x1, y1;
+		checkpoint.getTile( k, x0, y0, x1, y1 );
+		theRayTracer->traceTile( x0, y0, x1, y1 );
+		done[k] = true;
+
+		if ( time( NULL ) - lastSave >= checkpointPeriod ) {
+			if ( !checkpoint.save( buf, done ) )
+				fprintf( stderr, "couldn't save the checkpoint\n" );
+			lastSave = time( NULL );
+		}
+	}
+	clock_t end = clock();
+
+	writeBMP( imgName, g_width, g_height, buf );
+	checkpoint.remove();
+
+	if ( bReport )
+		fprintf( stderr, "total time = %.3f seconds\n", (double)(end - start) / CLOCKS_PER_SEC );
+}
+
+// Have workers render the image, and save it.
+void runCoordinator()
+{
+	unsigned int hash = renderHash();
+	TileCoordinator coordinator( g_width, g_height, tileSize, hash );
+
+	Checkpoint checkpoint( string( imgName ) + ".ckpt", hash, g_width, g_height, tileSize );
+	checkResumable( checkpoint );
+	if ( checkpointPeriod > 0 )
+		coordinator.setCheckpoint( &checkpoint, checkpointPeriod, bResume );
+
+	time_t start = time( NULL );
+	if ( !coordinator.run( coordinatorPort, bReport ) ) {
+		fprintf( stderr, "couldn't serve tiles on port %d\n", coordinatorPort );
+		exit( 1 );
+	}
+
+	writeBMP( imgName, g_width, g_height, coordinator.getBuffer() );
+	checkpoint.remove();
+
+	if ( bReport )
+		fprintf( stderr, "total time = %d seconds\n", (int)( time( NULL ) - start ) );
+}
+
 // usage : ray [option] in.ray out.bmp
 // Simply keying in ray will invoke a graphics mode version.
 // Use "ray --help" to see the detailed usage.
@@ -159,10 +482,41 @@ int main(int argc, char **argv) {
 			exit(1);
 		}
 		
+		Animation *animation = NULL;
+		if (keyName) {
+			animation = readAnimation(keyName);
+			if (!animation)
+				exit(1);
+		}
+
+		// the render settings are kept by the UI, even when it isn't shown
+		traceUI=new TraceUI();
+		traceUI->m_depthSlider->value(recursion_depth);
+		traceUI->m_depthSlider->do_callback();
+
+		if (benchName) {
+			if (!runBenchmark(benchName)) {
+				usage();
+				exit(1);
+			}
+			return 0;
+		}
+
 		theRayTracer=new RayTracer();
 		theRayTracer->loadScene(rayName);
 	
-		if (theRayTracer->sceneLoaded()) {
+		if (theRayTracer->sceneLoaded() && workerAddress) {
+			runWorker();
+		} else if (theRayTracer->sceneLoaded() && coordinatorPort) {
+			g_height = (int)(g_width / theRayTracer->aspectRatio() + 0.5);
+			runCoordinator();
+		} else if (theRayTracer->sceneLoaded() && animation) {
+			g_height = (int)(g_width / theRayTracer->aspectRatio() + 0.5);
+			renderAnimation(animation);
+		} else if (theRayTracer->sceneLoaded() && checkpointPeriod > 0) {
+			g_height = (int)(g_width / theRayTracer->aspectRatio() + 0.5);
+			renderCheckpointed();
+		} else if (theRayTracer->sceneLoaded()) {
 			g_height = (int)(g_width / theRayTracer->aspectRatio() + 0.5);
 
 			theRayTracer->traceSetup(g_width, g_height);
@@ -0,0 +1,175 @@
+#include <algorithm>
+
+#include "animation.h"
+#include "camera.h"
+#include "light.h"
+
+void Animation::addKey( int light, const string& name, double frame, const vec3f& value )
+{
+	insertKey( curves[ Channel( light, name ) ], frame, value );
+}
+
+void Animation::addObjectKey( int object, const string& name, double frame, const vec3f& value )
+{
+	insertKey( objectCurves[ Channel( object, name ) ], frame, value );
+}
+
+void Animation::insertKey( Curve& curve, double frame, const vec3f& value )
+{
+	// keep the keys in frame order; a second key at the same frame
+	// replaces the first
+	Curve::iterator i = curve.begin();
+	while( i != curve.end() && i->first < frame ) {
+		++i;
+	}
+	if( i != curve.end() && i->first == frame ) {
+		i->second = value;
+	} else {
+		curve.insert( i, make_pair( frame, value ) );
+	}
+}
+
+double Animation::getFirstFrame() const
+{
+	const map<Channel, Curve> *all[2] = { &curves, &objectCurves };
+	double first = 0.0;
+	bool any = false;
+	for( int k = 0; k < 2; ++k ) {
+		for( map<Channel, Curve>::const_iterator i = all[k]->begin(); i != all[k]->end(); ++i ) {
+			if( !any || i->second.front().first < first ) {
+				first = i->second.front().first;
+				any = true;
+			}
+		}
+	}
+	return first;
+}
+
+double Animation::getLastFrame() const
+{
+	const map<Channel, Curve> *all[2] = { &curves, &objectCurves };
+	double last = 0.0;
+	bool any = false;
+	for( int k = 0; k < 2; ++k ) {
+		for( map<Channel, Curve>::const_iterator i = all[k]->begin(); i != all[k]->end(); ++i ) {
+			if( !any || i->second.back().first > last ) {
+				last = i->second.back().first;
+				any = true;
+			}
+		}
+	}
+	return last;
+}
+
+int Animation::getNumLights() const
+{
+	int n = 0;
+	for( map<Channel, Curve>::const_iterator i = curves.begin(); i != curves.end(); ++i ) {
+		n = max( n, i->first.first + 1 );
+	}
+	return n;
+}
+
+int Animation::getNumObjects() const
+{
+	int n = 0;
+	for( map<Channel, Curve>::const_iterator i = objectCurves.begin(); i != objectCurves.end(); ++i ) {
+		n = max( n, i->first.first + 1 );
+	}
+	return n;
+}
+
+const Animation::Curve *Animation::find( const map<Channel, Curve>& in, int index,
+	const string& name )
+{
+	map<Channel, Curve>::const_iterator i = in.find( Channel( index, name ) );
+	return i == in.end() ? NULL : &i->second;
+}
+
+vec3f Animation::evaluate( const Curve& curve, double frame )
+{
+	if( frame <= curve.front().first ) {
+		return curve.front().second;
+	}
+	for( size_t k = 1; k < curve.size(); ++k ) {
+		if( frame < curve[k].first ) {
+			const pair<double, vec3f>& a = curve[k - 1];
+			const pair<double, vec3f>& b = curve[k];
+			double f = (frame - a.first) / (b.first - a.first);
+			return a.second + f * (b.second - a.second);
+		}
+	}
+	return curve.back().second;
+}
+
+void Animation::apply( Scene *scene, double frame ) const
+{
+	Camera *camera = scene->getCamera();
+	const Curve *c;
+
+	if( (c = find( curves, CAMERA, "position" )) ) {
+		camera->setEye( evaluate( *c, frame ) );
+	}
+	// the reader only takes viewdir and updir together
+	const Curve *up = find( curves, CAMERA, "updir" );
+	if( (c = find( curves, CAMERA, "viewdir" )) && up ) {
+		camera->setLook( evaluate( *c, frame ).normalize(), evaluate( *up, frame ).normalize() );
+	}
+	if( (c = find( curves, CAMERA, "fov" )) ) {
+		camera->setFOV( evaluate( *c, frame )[0] );
+	}
+	if( (c = find( curves, CAMERA, "lens_radius" )) ) {
+		camera->setLensRadius( evaluate( *c, frame )[0] );
+	}
+	if( (c = find( curves, CAMERA, "focus_distance" )) ) {
+		camera->setFocalDistance( evaluate( *c, frame )[0] );
+	}
+
+	int k = 0;
+	for( Scene::cliter l = scene->beginLights(); l != scene->endLights(); ++l, ++k ) {
+		if( (c = find( curves, k, "position" )) ) {
+			(*l)->setPosition( evaluate( *c, frame ) );
+		}
+		if( (c = find( curves, k, "direction" )) ) {
+			(*l)->setDirection( evaluate( *c, frame ).normalize() );
+		}
+		if( (c = find( curves, k, "colour" )) ) {
+			(*l)->setColor( evaluate( *c, frame ) );
+		}
+	}
+
+	if( objectCurves.empty() ) {
+		return;
+	}
+
+	// the top level transformations are the root's children, in the order
+	// the scene file gives them
+	TransformNode& root = scene->transformRoot;
+	k = 0;
+	for( TransformNode::child_iter n = root.beginChildren(); n != root.endChildren(); ++n, ++k ) {
+		const Curve *translate = find( objectCurves, k, "translate" );
+		const Curve *rotate = find( objectCurves, k, "rotate" );
+		const Curve *scale = find( objectCurves, k, "scale" );
+		if( !translate && !rotate && !scale ) {
+			continue;
+		}
+
+		mat4f m;
+		if( translate ) {
+			m = m * mat4f::translate( evaluate( *translate, frame ) );
+		}
+		if( rotate ) {
+			vec3f a = evaluate( *rotate, frame );
+			m = m * mat4f::rotate( vec3f( 0.0, 0.0, 1.0 ), a[2] )
+				* mat4f::rotate( vec3f( 0.0, 1.0, 0.0 ), a[1] )
+				* mat4f::rotate( vec3f( 1.0, 0.0, 0.0 ), a[0] );
+		}
+		if( scale ) {
+			m = m * mat4f::scale( evaluate( *scale, frame ) );
+		}
+		(*n)->setTransform( m * (*n)->getInitialTransform(), m * (*n)->getInitialEndTransform() );
+	}
+
+	// new bounds for what moved, and the BVH refitted to them
+	scene->updateTransforms();
+}
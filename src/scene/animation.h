@@ -0,0 +1,68 @@
+//
+// animation.h
+//
+// Keyframed camera, light and object parameters, for rendering a sequence
+// of frames from one loaded scene.  The geometry and its BVH are built
+// once; when objects move between frames the BVH is refitted to them (see
+// Scene::updateTransforms) rather than built again.
+//
+
+#ifndef __ANIMATION_H__
+#define __ANIMATION_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "scene.h"
+
+class Animation
+{
+public:
+	// Keys with this index belong to the camera rather than a light.
+	enum { CAMERA = -1 };
+
+	// Give a parameter of the camera or of the light'th light in the scene
+	// file (counting from 0) this value at the given frame.  Scalars are
+	// kept in the first component.  Camera parameters are position,
+	// viewdir, updir, fov, lens_radius and focus_distance; light ones are
+	// position, direction and colour.
+	void addKey( int light, const string& name, double frame, const vec3f& value );
+
+	// The same for the object'th transformation at the top level of the
+	// scene file (a translate, rotate, scale, transform or move, counting
+	// from 0).  The parameters are translate, rotate (radians about x, then
+	// y, then z) and scale, and together they move everything under the
+	// transformation by translate * rotate * scale, applied after the
+	// scene file's own transformation.
+	void addObjectKey( int object, const string& name, double frame, const vec3f& value );
+
+	bool empty() const { return curves.empty() && objectCurves.empty(); }
+	double getFirstFrame() const;
+	double getLastFrame() const;
+
+	// One more than the highest light index with a key.
+	int getNumLights() const;
+
+	// One more than the highest object index with a key.
+	int getNumObjects() const;
+
+	// Set the camera, lights and objects of the scene to how they are at
+	// 'frame'.  Parameters are interpolated linearly between keys, and hold
+	// their first and last values outside them.  Anything without keys is
+	// left as it is.
+	void apply( Scene *scene, double frame ) const;
+
+private:
+	typedef vector< pair<double, vec3f> > Curve;     // sorted by frame
+	typedef pair<int, string> Channel;
+
+	static void insertKey( Curve& curve, double frame, const vec3f& value );
+	static const Curve *find( const map<Channel, Curve>& in, int index, const string& name );
+	static vec3f evaluate( const Curve& curve, double frame );
+
+	map<Channel, Curve> curves;         // by light, or CAMERA
+	map<Channel, Curve> objectCurves;   // by object
+};
+
+#endif // __ANIMATION_H__
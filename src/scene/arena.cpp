@@ -0,0 +1,63 @@
+#include <cstdlib>
+#include <new>
+
+#include "arena.h"
+
+// Size of the blocks.  Anything bigger than a quarter of this gets a block
+// of its own, so that little of a block is ever wasted.
+static const size_t BLOCK_SIZE = 64 * 1024;
+
+// Everything is aligned to this, which suits doubles and any vector of them.
+static const size_t ALIGNMENT = 16;
+
+Arena::Arena()
+	: next( NULL ), left( 0 ), size( 0 )
+{
+}
+
+void *Arena::allocate( size_t n )
+{
+	n = (n + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+	size += n;
+
+	if( n > BLOCK_SIZE / 4 ) {
+		char *block = (char *)malloc( n );
+		if( block == NULL ) {
+			throw std::bad_alloc();
+		}
+		// the newest block keeps its room for what comes next
+		blocks.push_back( block );
+		return block;
+	}
+
+	if( n > left ) {
+		char *block = (char *)malloc( BLOCK_SIZE );
+		if( block == NULL ) {
+			throw std::bad_alloc();
+		}
+		blocks.push_back( block );
+		next = block;
+		left = BLOCK_SIZE;
+	}
+
+	void *p = next;
+	next += n;
+	left -= n;
+	return p;
+}
+
+void Arena::clear()
+{
+	for( size_t k = owned.size(); k > 0; --k ) {
+		owned[k - 1].destroy( owned[k - 1].obj );
+	}
+	owned.clear();
+
+	for( size_t k = 0; k < blocks.size(); ++k ) {
+		free( blocks[k] );
+	}
+	blocks.clear();
+	next = NULL;
+	left = 0;
+	size = 0;
+}
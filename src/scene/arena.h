@@ -0,0 +1,81 @@
+//
+// arena.h
+//
+// A region allocator for the things that last as long as a scene: its
+// objects, transformations, materials and prototypes.  They are placed one
+// after another in large blocks, instead of being allocated one at a time,
+// and are all freed together with the arena instead of being deleted one
+// at a time.
+//
+//     Material *m = arena.own( new( arena ) Material );
+//     Sphere *s = new( arena ) Sphere( scene, m );
+//
+// Nothing placed in an arena may be deleted.
+//
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <cstddef>
+#include <vector>
+
+class Arena
+{
+public:
+	Arena();
+	~Arena() { clear(); }
+
+	// size bytes, aligned for any type, that last until clear()
+	void *allocate( size_t size );
+
+	// Have obj, which must have been placed in this arena, destroyed when
+	// the arena is cleared, newest first.  An object whose destructor has
+	// nothing to do, like a Sphere's, needn't be owned.
+	template <class T>
+	T *own( T *obj )
+	{
+		Owned o;
+		o.obj = obj;
+		o.destroy = &Arena::destroy<T>;
+		owned.push_back( o );
+		return obj;
+	}
+
+	// Destroy the owned objects and free all the blocks.
+	void clear();
+
+	// bytes handed out so far
+	size_t getSize() const { return size; }
+
+private:
+	Arena( const Arena& );
+	Arena& operator=( const Arena& );
+
+	template <class T>
+	static void destroy( void *obj ) { static_cast<T*>( obj )->~T(); }
+
+	struct Owned
+	{
+		void *obj;
+		void (*destroy)( void *obj );
+	};
+
+	std::vector<char*> blocks;
+	char *next;                 // free space left in the newest block
+	size_t left;
+	size_t size;
+	std::vector<Owned> owned;
+};
+
+// new( arena ) T( ... ) puts a T in the arena.
+inline void *operator new( size_t size, Arena& arena )
+{
+	return arena.allocate( size );
+}
+
+// only called if the constructor throws; the memory goes with the arena
+inline void operator delete( void *, Arena& )
+{
+}
+
+#endif // __ARENA_H__
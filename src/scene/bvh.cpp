@@ -0,0 +1,477 @@
+#include <cmath>
+#include <algorithm>
+#include <typeinfo>
+
+#include "bvh.h"
+#include "../SceneObjects/Box.h"
+#include "../SceneObjects/Cylinder.h"
+#include "../SceneObjects/Cone.h"
+
+// Objects per leaf: a leaf is made once a node has this few, and splits
+// are never forced while it has no more than MAX_LEAF_SIZE.
+static const int MIN_LEAF_SIZE = 2;
+static const int MAX_LEAF_SIZE = 8;
+
+// Number of buckets the surface area heuristic considers splitting between.
+static const int NUM_BINS = 16;
+
+// Deeper nodes are always leaves, so the traversal stack can't overflow.
+static const int MAX_DEPTH = 60;
+
+// A refitted tree whose cost has grown by more than this factor since it
+// was built is rebuilt from scratch.
+static const double REBUILD_RATIO = 1.5;
+
+static double surfaceArea( const BoundingBox& b )
+{
+	vec3f d = b.max - b.min;
+	return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+static void growBox( BoundingBox& b, const BoundingBox& other, bool first )
+{
+	if( first ) {
+		b = other;
+	} else {
+		b.min = minimum( b.min, other.min );
+		b.max = maximum( b.max, other.max );
+	}
+}
+
+int BVH::kindOf( const Geometry *g )
+{
+	// exact types only: a subclass may have its own intersect
+	const type_info& t = typeid( *g );
+	if( t == typeid( Box ) ) return BOX;
+	if( t == typeid( Cylinder ) ) return CYLINDER;
+	if( t == typeid( Cone ) ) return CONE;
+	return OTHER;
+}
+
+// orders a leaf's (kind, object) pairs by kind
+static bool byKind( const pair<int, Geometry*>& a, const pair<int, Geometry*>& b )
+{
+	return a.first < b.first;
+}
+
+// Test count objects one at a time, through the virtual intersect, keeping
+// the nearest hit before tMax in i.
+static bool intersectRun( Geometry *const *objs, int count, const ray& r,
+	isect& i, double& tMax )
+{
+	bool have_one = false;
+	isect cur;
+	for( int k = 0; k < count; ++k ) {
+		if( objs[k]->intersect( r, cur ) && cur.t < tMax ) {
+			i = cur;
+			tMax = cur.t;
+			have_one = true;
+		}
+	}
+	return have_one;
+}
+
+// The same for objects that are all exactly a T, a box, cylinder or cone,
+// but four at a time: T::nearest4 finds which of them r hits first, and
+// only that one is intersected in full.  A single object left over is
+// tested alone.
+template <class T>
+static bool intersectRun4( Geometry *const *objs, int count, const ray& r,
+	isect& i, double& tMax )
+{
+	bool have_one = false;
+	isect cur;
+	for( int k = 0; k < count; k += 4 ) {
+		int n = count - k < 4 ? count - k : 4;
+		int first = n > 1 ? T::nearest4( objs + k, n, r, tMax ) : 0;
+		if( first >= 0 && objs[ k + first ]->intersectAs<T>( r, cur ) && cur.t < tMax ) {
+			i = cur;
+			tMax = cur.t;
+			have_one = true;
+		}
+	}
+	return have_one;
+}
+
+void BVH::build( const list<Geometry*>& objs )
+{
+	objects.assign( objs.begin(), objs.end() );
+	kinds.resize( objects.size() );
+	for( size_t k = 0; k < objects.size(); ++k ) {
+		kinds[k] = kindOf( objects[k] );
+	}
+	rebuild();
+}
+
+void BVH::rebuild()
+{
+	nodes.clear();
+
+	moving = false;
+	for( size_t k = 0; k < objects.size(); ++k ) {
+		if( objects[k]->isMoving() ) {
+			moving = true;
+		}
+	}
+
+	if( !objects.empty() ) {
+		nodes.reserve( 2 * objects.size() );
+		nodes.push_back( Node() );
+		buildNode( 0, 0, objects.size(), 0 );
+	}
+	groupLeaves();
+	builtCost = cost();
+}
+
+// Sort each leaf's objects by kind and record the runs of each kind.
+void BVH::groupLeaves()
+{
+	runs.clear();
+	vector< pair<int, Geometry*> > leaf;
+	for( size_t n = 0; n < nodes.size(); ++n ) {
+		Node& node = nodes[n];
+		node.firstRun = runs.size();
+		node.numRuns = 0;
+		if( node.count == 0 ) {
+			continue;
+		}
+
+		leaf.clear();
+		for( int k = node.first; k < node.first + node.count; ++k ) {
+			leaf.push_back( make_pair( kinds[k], objects[k] ) );
+		}
+		stable_sort( leaf.begin(), leaf.end(), byKind );
+		for( int k = node.first; k < node.first + node.count; ++k ) {
+			kinds[k] = leaf[ k - node.first ].first;
+			objects[k] = leaf[ k - node.first ].second;
+		}
+
+		for( int k = node.first; k < node.first + node.count; ++k ) {
+			int kind = kinds[k];
+			if( node.numRuns == 0 || runs.back().kind != kind ) {
+				Run run = { kind, k, 0 };
+				runs.push_back( run );
+				++node.numRuns;
+			}
+			++runs.back().count;
+		}
+	}
+}
+
+bool BVH::refit()
+{
+	moving = false;
+	for( size_t k = 0; k < objects.size(); ++k ) {
+		if( objects[k]->isMoving() ) {
+			moving = true;
+		}
+	}
+
+	// children always come after their parent, so going backwards sees
+	// every node after the nodes under it
+	for( int n = int( nodes.size() ) - 1; n >= 0; --n ) {
+		Node& node = nodes[n];
+		if( node.count > 0 ) {
+			for( int k = node.first; k < node.first + node.count; ++k ) {
+				growBox( node.start, objects[k]->getStartBoundingBox(), k == node.first );
+				growBox( node.end, objects[k]->getEndBoundingBox(), k == node.first );
+			}
+		} else {
+			const Node& a = nodes[ node.child ];
+			const Node& b = nodes[ node.child + 1 ];
+			growBox( node.start, a.start, true );
+			growBox( node.start, b.start, false );
+			growBox( node.end, a.end, true );
+			growBox( node.end, b.end, false );
+		}
+	}
+
+	// Objects that moved far from where they were built leave boxes that
+	// overlap and cover empty space, so more rays visit more nodes.
+	if( cost() > REBUILD_RATIO * builtCost ) {
+		rebuild();
+		return true;
+	}
+	return false;
+}
+
+double BVH::cost() const
+{
+	if( nodes.empty() ) {
+		return 0.0;
+	}
+
+	// The chance that a ray through a box also goes through a box inside
+	// it is about the ratio of their areas.  A node is charged one test
+	// for visiting it, a leaf one more for each of its objects.  Moving
+	// nodes are measured by everything they sweep over.
+	double total = 0.0;
+	double rootArea = 0.0;
+	for( size_t n = 0; n < nodes.size(); ++n ) {
+		BoundingBox all;
+		growBox( all, nodes[n].start, true );
+		growBox( all, nodes[n].end, false );
+		double area = surfaceArea( all );
+		if( n == 0 ) {
+			rootArea = area;
+		}
+		total += area * (1 + nodes[n].count);
+	}
+	return rootArea > 0.0 ? total / rootArea : 0.0;
+}
+
+// Make node the root of a subtree over objects[first .. last).  Splits are
+// picked with the binned surface area heuristic over the object centers.
+void BVH::buildNode( int node, int first, int last, int depth )
+{
+	BoundingBox start, end, centers;
+	for( int k = first; k < last; ++k ) {
+		const BoundingBox& b = objects[k]->getBoundingBox();
+		BoundingBox c;
+		c.min = c.max = 0.5 * (b.min + b.max);
+		growBox( start, objects[k]->getStartBoundingBox(), k == first );
+		growBox( end, objects[k]->getEndBoundingBox(), k == first );
+		growBox( centers, c, k == first );
+	}
+	nodes[node].start = start;
+	nodes[node].end = end;
+	nodes[node].first = first;
+	nodes[node].count = last - first;
+	nodes[node].child = -1;
+
+	int n = last - first;
+	if( n <= MIN_LEAF_SIZE || depth >= MAX_DEPTH ) {
+		return;
+	}
+
+	vec3f extent = centers.max - centers.min;
+	int axis = 0;
+	if( extent[1] > extent[axis] ) axis = 1;
+	if( extent[2] > extent[axis] ) axis = 2;
+	if( extent[axis] <= 0.0 ) {
+		return;                 // all centers coincide; can't split
+	}
+
+	// drop the object centers into buckets along the axis
+	int binCount[ NUM_BINS ] = { 0 };
+	BoundingBox binBounds[ NUM_BINS ];
+	double scale = NUM_BINS / extent[axis];
+	vector<int> bin( n );
+	for( int k = first; k < last; ++k ) {
+		const BoundingBox& b = objects[k]->getBoundingBox();
+		double c = 0.5 * (b.min[axis] + b.max[axis]);
+		int j = min( int( (c - centers.min[axis]) * scale ), NUM_BINS - 1 );
+		bin[ k - first ] = j;
+		growBox( binBounds[j], b, binCount[j] == 0 );
+		++binCount[j];
+	}
+
+	// cost of splitting after each bucket: the area of each side times the
+	// number of objects in it
+	double rightArea[ NUM_BINS ];
+	int rightCount[ NUM_BINS ];
+	BoundingBox acc;
+	int count = 0;
+	for( int j = NUM_BINS - 1; j > 0; --j ) {
+		if( binCount[j] ) {
+			growBox( acc, binBounds[j], count == 0 );
+			count += binCount[j];
+		}
+		rightArea[j] = count ? surfaceArea( acc ) : 0.0;
+		rightCount[j] = count;
+	}
+
+	double bestCost = 1.0e308;
+	int bestSplit = -1;
+	count = 0;
+	for( int j = 0; j < NUM_BINS - 1; ++j ) {
+		if( binCount[j] ) {
+			growBox( acc, binBounds[j], count == 0 );
+			count += binCount[j];
+		}
+		if( count == 0 || rightCount[j + 1] == 0 ) {
+			continue;
+		}
+		double cost = surfaceArea( acc ) * count + rightArea[j + 1] * rightCount[j + 1];
+		if( cost < bestCost ) {
+			bestCost = cost;
+			bestSplit = j;
+		}
+	}
+	if( bestSplit < 0 ) {
+		return;
+	}
+
+	// a small node stays a leaf if testing all its objects is cheaper
+	BoundingBox all;
+	growBox( all, start, true );
+	growBox( all, end, false );
+	if( n <= MAX_LEAF_SIZE && bestCost >= surfaceArea( all ) * n ) {
+		return;
+	}
+
+	// partition the objects, keeping kinds[] and bin[] in step
+	int mid = first;
+	for( int k = first; k < last; ++k ) {
+		if( bin[ k - first ] <= bestSplit ) {
+			swap( objects[k], objects[mid] );
+			swap( kinds[k], kinds[mid] );
+			swap( bin[ k - first ], bin[ mid - first ] );
+			++mid;
+		}
+	}
+
+	int child = nodes.size();
+	nodes.push_back( Node() );
+	nodes.push_back( Node() );
+	nodes[node].child = child;
+	nodes[node].count = 0;
+	buildNode( child, first, mid, depth + 1 );
+	buildNode( child + 1, mid, last, depth + 1 );
+}
+
+// Slab test of the ray against the node's box at the given time.  tEnter
+// is where the ray enters the box, if it does so before tMax.
+bool BVH::hitBox( const Node& node, const vec3f& P, const vec3f& invD,
+	double time, double tMax, double& tEnter ) const
+{
+	vec3f lo = node.start.min;
+	vec3f hi = node.start.max;
+	if( moving ) {
+		lo += time * (node.end.min - lo);
+		hi += time * (node.end.max - hi);
+	}
+
+	double tNear = 0.0;
+	double tFar = tMax;
+	for( int a = 0; a < 3; ++a ) {
+		double t0 = (lo[a] - P[a]) * invD[a];
+		double t1 = (hi[a] - P[a]) * invD[a];
+		if( t0 > t1 ) {
+			swap( t0, t1 );
+		}
+		// a ray parallel to a slab and on its edge gives NaN, which these
+		// comparisons ignore
+		if( t0 > tNear ) tNear = t0;
+		if( t1 < tFar ) tFar = t1;
+	}
+
+	// allow for rounding in the slab distances
+	tEnter = tNear;
+	return tNear <= tFar * (1.0 + 1.0e-12);
+}
+
+bool BVH::intersect( const ray& r, isect& i, double tMax ) const
+{
+	if( nodes.empty() ) {
+		return false;
+	}
+
+	vec3f P = r.getPosition();
+	vec3f D = r.getDirection();
+	vec3f invD( 1.0 / D[0], 1.0 / D[1], 1.0 / D[2] );
+	double time = r.getTime();
+
+	bool have_one = false;
+
+	int stack[ MAX_DEPTH + 2 ];
+	int top = 0;
+	double tEnter;
+	if( !hitBox( nodes[0], P, invD, time, tMax, tEnter ) ) {
+		return false;
+	}
+	stack[ top++ ] = 0;
+
+	while( top > 0 ) {
+		const Node& node = nodes[ stack[ --top ] ];
+
+		if( node.count > 0 ) {
+			for( int k = node.firstRun; k < node.firstRun + node.numRuns; ++k ) {
+				const Run& run = runs[k];
+				Geometry *const *objs = &objects[ run.first ];
+				bool hit;
+				switch( run.kind ) {
+				case BOX:      hit = intersectRun4<Box>( objs, run.count, r, i, tMax ); break;
+				case CYLINDER: hit = intersectRun4<Cylinder>( objs, run.count, r, i, tMax ); break;
+				case CONE:     hit = intersectRun4<Cone>( objs, run.count, r, i, tMax ); break;
+				default:       hit = intersectRun( objs, run.count, r, i, tMax ); break;
+				}
+				have_one = have_one || hit;
+			}
+			continue;
+		}
+
+		// visit the nearer child first, so that its hits can cut the
+		// farther one off
+		double t0, t1;
+		bool hit0 = hitBox( nodes[ node.child ], P, invD, time, tMax, t0 );
+		bool hit1 = hitBox( nodes[ node.child + 1 ], P, invD, time, tMax, t1 );
+		if( hit0 && hit1 ) {
+			if( t0 <= t1 ) {
+				stack[ top++ ] = node.child + 1;
+				stack[ top++ ] = node.child;
+			} else {
+				stack[ top++ ] = node.child;
+				stack[ top++ ] = node.child + 1;
+			}
+		} else if( hit0 ) {
+			stack[ top++ ] = node.child;
+		} else if( hit1 ) {
+			stack[ top++ ] = node.child + 1;
+		}
+	}
+
+	return have_one;
+}
+
+bool BVH::visit( const ray& r, double tMax, BVHVisitor& visitor ) const
+{
+	if( nodes.empty() ) {
+		return true;
+	}
+
+	vec3f P = r.getPosition();
+	vec3f D = r.getDirection();
+	vec3f invD( 1.0 / D[0], 1.0 / D[1], 1.0 / D[2] );
+	double time = r.getTime();
+
+	int stack[ MAX_DEPTH + 2 ];
+	int top = 0;
+	double tEnter;
+	if( !hitBox( nodes[0], P, invD, time, tMax, tEnter ) ) {
+		return true;
+	}
+	stack[ top++ ] = 0;
+
+	while( top > 0 ) {
+		const Node& node = nodes[ stack[ --top ] ];
+
+		if( node.count > 0 ) {
+			for( int k = node.first; k < node.first + node.count; ++k ) {
+				if( !visitor.visit( objects[k] ) ) {
+					return false;
+				}
+			}
+			continue;
+		}
+
+		double t0, t1;
+		bool hit0 = hitBox( nodes[ node.child ], P, invD, time, tMax, t0 );
+		bool hit1 = hitBox( nodes[ node.child + 1 ], P, invD, time, tMax, t1 );
+		if( hit0 && hit1 ) {
+			if( t0 <= t1 ) {
+				stack[ top++ ] = node.child + 1;
+				stack[ top++ ] = node.child;
+			} else {
+				stack[ top++ ] = node.child;
+				stack[ top++ ] = node.child + 1;
+			}
+		} else if( hit0 ) {
+			stack[ top++ ] = node.child;
+		} else if( hit1 ) {
+			stack[ top++ ] = node.child + 1;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,98 @@
+//
+// bvh.h
+//
+// Bounding volume hierarchy over the scene's bounded objects, so that a ray
+// is only tested against the objects whose boxes it passes through.
+//
+// Each leaf's boxes, cylinders and cones are grouped by type, so that they
+// can be tested four at a time (see Box::nearest4).  Everything else is
+// tested one object at a time.
+//
+
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <vector>
+
+#include "scene.h"
+
+// Told about each object a ray may pass through (see BVH::visit).
+class BVHVisitor
+{
+public:
+	virtual ~BVHVisitor() {}
+
+	// return false to stop the traversal
+	virtual bool visit( Geometry *obj ) = 0;
+};
+
+class BVH
+{
+public:
+	BVH() : moving( false ), builtCost( 0.0 ) {}
+
+	// Build the tree over the objects, replacing any earlier one.  Their
+	// bounding boxes must already be computed.
+	void build( const list<Geometry*>& objects );
+
+	// Update the node boxes bottom up after the objects' boxes have
+	// changed, keeping the tree's shape.  Returns true if the tree had
+	// degraded so much that it was rebuilt instead.
+	bool refit();
+
+	// The surface area heuristic's estimate of the work per ray: the box
+	// and object tests a ray that hits the root box can expect to make.
+	double cost() const;
+
+	// The nearest hit closer than tMax, as Scene::intersect.
+	bool intersect( const ray& r, isect& i, double tMax ) const;
+
+	// Show visitor every object whose box r passes through before tMax,
+	// the nearer parts of the tree first.  Returns false if the visitor
+	// stopped it.
+	bool visit( const ray& r, double tMax, BVHVisitor& visitor ) const;
+
+private:
+	// The types of object a leaf tests four at a time.  Anything else is
+	// OTHER and uses Geometry::intersect.
+	enum Kind { BOX, CYLINDER, CONE, OTHER };
+
+	// a leaf's objects of one kind, objects[first .. first+count)
+	struct Run
+	{
+		int kind;
+		int first;
+		int count;
+	};
+
+	// Each node keeps a box for the start and the end of the shutter
+	// interval.  Objects move linearly, so at time t everything under the
+	// node is inside the interpolation of the two: one tree serves every
+	// time sample.  In a scene with nothing moving the two are the same.
+	struct Node
+	{
+		BoundingBox start;
+		BoundingBox end;
+		int child;              // interior: index of the first of two children
+		int first;              // leaf: objects[first .. first+count)
+		int count;              // 0 for interior nodes
+		int firstRun;           // leaf: runs[firstRun .. firstRun+numRuns)
+		int numRuns;
+	};
+
+	void rebuild();
+	void buildNode( int node, int first, int last, int depth );
+	void groupLeaves();
+	static int kindOf( const Geometry *g );
+	bool hitBox( const Node& node, const vec3f& P, const vec3f& invD,
+		double time, double tMax, double& tEnter ) const;
+
+	vector<Node> nodes;
+	vector<Geometry*> objects;
+	vector<int> kinds;          // kindOf each of objects, found once in build
+	vector<Run> runs;
+	bool moving;
+	double builtCost;           // cost() when last rebuilt
+};
+
+#endif // __BVH_H__
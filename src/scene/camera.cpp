@@ -1,12 +1,44 @@
+#include <cmath>
+
 #include "camera.h"
 
 #define PI 3.14159265359
 #define SHOW(x) (cerr << #x << " = " << (x) << "\n")
 
+// Map (a,b) in [0,1)^2 onto the unit disk, keeping areas in proportion
+// (Shirley and Chiu's concentric mapping), so stratified lens samples stay
+// stratified.
+static void concentricDisk( double a, double b, double& x, double& y )
+{
+    a = 2 * a - 1;
+    b = 2 * b - 1;
+    if( a == 0 && b == 0 )
+    {
+        x = y = 0;
+        return;
+    }
+
+    double r, phi;
+    if( fabs( a ) > fabs( b ) )
+    {
+        r = a;
+        phi = (PI / 4) * (b / a);
+    }
+    else
+    {
+        r = b;
+        phi = (PI / 2) - (PI / 4) * (a / b);
+    }
+    x = r * cos( phi );
+    y = r * sin( phi );
+}
+
 Camera::Camera()
 {
     aspectRatio = 1;
     normalizedHeight = 1;
+    lensRadius = 0;
+    focalDistance = 1;
     
     eye = vec3f(0,0,0);
     u = vec3f( 1,0,0 );
@@ -15,16 +47,46 @@ Camera::Camera()
 }
 
 void
-Camera::rayThrough( double x, double y, ray &r )
+Camera::rayThrough( double x, double y, ray &r ) const
 // Ray through normalized window point x,y.  In normalized coordinates
 // the camera's x and y vary both vary from 0 to 1.
 {
-    nx=x;
-    ny=y;
+    rayThrough( x, y, 0.5, 0.5, 0.0, r );
+}
+
+void
+Camera::rayThrough( double x, double y, double lensU, double lensV, double time,
+    ray &r ) const
+{
     x -= 0.5;
     y -= 0.5;
     vec3f dir = look + x * u + y * v;
-    r = ray( eye, dir.normalize() );
+    vec3f offset = lensRadius > 0.0 ? lensOffset( lensU, lensV ) : vec3f();
+    r = throughLens( dir, offset, time );
+}
+
+vec3f
+Camera::lensOffset( double lensU, double lensV ) const
+{
+    // u and v are scaled by the image plane's size; the lens is round
+    vec3f right = u.normalize();
+    vec3f up = v.normalize();
+    double lx, ly;
+    concentricDisk( lensU, lensV, lx, ly );
+    return lensRadius * (lx * right + ly * up);
+}
+
+ray
+Camera::throughLens( const vec3f& dir, const vec3f& offset, double time ) const
+{
+    if( lensRadius <= 0.0 )
+        return ray( eye, dir.normalize(), time );
+
+    // look is a unit vector, so dir reaches the focal plane at
+    // focalDistance
+    vec3f origin = eye + offset;
+    vec3f d = eye + focalDistance * dir - origin;
+    return ray( origin, d.normalize(), time );
 }
 
 void
@@ -93,12 +155,42 @@ Camera::update()
     look = m * vec3f( 0,0,-1 );
 }
 
-double Camera::getnx(){
-    return nx;
-}
-
-double Camera::getny(){
-    return ny;
+void
+Camera::raysThroughTile( int x0, int y0, int x1, int y1, int width, int height,
+    const std::vector<PixelSample>& samples, std::vector<ray>& rays ) const
+// Same rays as rayThrough, but the part of the direction that only depends
+// on y is worked out once per row and sample rather than for every ray.
+// With a lens, each ray starts at its lens sample and passes through the
+// point the pinhole ray would reach at the focal distance.
+{
+    int n = samples.size();
+    std::vector<vec3f> rowDir( n );
+    std::vector<double> dx( n );
+    for( int k = 0; k < n; ++k )
+        dx[k] = samples[k].dx / width - 0.5;
+
+    std::vector<vec3f> offset( n );
+    if( lensRadius > 0.0 )
+    {
+        for( int k = 0; k < n; ++k )
+            offset[k] = lensOffset( samples[k].lensU, samples[k].lensV );
+    }
+
+    for( int j = y0; j < y1; ++j )
+    {
+        for( int k = 0; k < n; ++k )
+            rowDir[k] = look + ((j + samples[k].dy) / height - 0.5) * v;
+
+        for( int i = x0; i < x1; ++i )
+        {
+            double x = double( i ) / width;
+            for( int k = 0; k < n; ++k )
+            {
+                vec3f dir = rowDir[k] + (x + dx[k]) * u;
+                rays.push_back( throughLens( dir, offset[k], samples[k].time ) );
+            }
+        }
+    }
 }
 
 
@@ -1,33 +1,76 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include <vector>
+
 #include "ray.h"
 
+// Where a primary ray crosses its pixel, in pixels from the pixel's
+// position (i,j); where on the lens it starts, in [0,1)^2 (only used if the
+// camera has an aperture); and when in the shutter interval [0,1) it is cast.
+struct PixelSample
+{
+    double dx, dy;
+    double lensU, lensV;
+    double time;
+};
+
 class Camera
 {
 public:
     Camera();
-    void rayThrough( double x, double y, ray &r );
+
+    // The camera is not changed by generating rays, so several threads may
+    // share it.
+    void rayThrough( double x, double y, ray &r ) const;
+
+    // The ray through normalized window point (x,y) from point (lensU,lensV)
+    // of the lens (see PixelSample), cast at the given time.  The one
+    // above is the ray from the middle of the lens at time 0.
+    void rayThrough( double x, double y, double lensU, double lensV, double time,
+        ray &r ) const;
+
+    // Primary rays for pixels [x0,x1) x [y0,y1) of a width x height image,
+    // one per entry of 'samples' for each pixel.  They are appended to rays
+    // a pixel at a time, left to right and then row by row, with each
+    // pixel's samples in order.
+    void raysThroughTile( int x0, int y0, int x1, int y1, int width, int height,
+        const std::vector<PixelSample>& samples, std::vector<ray>& rays ) const;
+
     void setEye( const vec3f &eye );
     void setLook( double, double, double, double );
     void setLook( const vec3f &viewDir, const vec3f &upDir );
     void setFOV( double );
     void setAspectRatio( double );
-    double getnx();
-    double getny();
+
+    // Depth of field: rays start anywhere on a lens of this radius, and
+    // meet again focalDistance away along the view direction.  A radius of
+    // 0 is a pinhole camera, with everything in focus.
+    void setLensRadius( double r ) { lensRadius = r; }
+    void setFocalDistance( double d ) { focalDistance = d; }
+    double getLensRadius() const { return lensRadius; }
 
     double getAspectRatio() { return aspectRatio; }
+    double getNormalizedHeight() { return normalizedHeight; }
 private:
     mat3f m;                     // rotation matrix
     double normalizedHeight;    // dimensions of image place at unit dist from eye
     double aspectRatio;
+    double lensRadius;
+    double focalDistance;
     
     void update();              // using the above three values calculate look,u,v
+
+    // where a ray from lens sample (lensU,lensV) starts, relative to the eye
+    vec3f lensOffset( double lensU, double lensV ) const;
+
+    // the ray from eye + offset that the pinhole ray in direction dir
+    // focuses to
+    ray throughLens( const vec3f& dir, const vec3f& offset, double time ) const;
     
     vec3f eye;
     vec3f look;                  // direction to look
     vec3f u,v; 
-    double nx,ny;                  // u and v in the 
 };
 
 #endif
@@ -0,0 +1,94 @@
+#include <cmath>
+
+#include "envmap.h"
+
+EnvironmentMap::EnvironmentMap( const unsigned char *data, int width, int height )
+{
+	const double pi = 3.1415926535;
+
+	// a face a quarter of the image wide keeps about the same number of
+	// texels around the horizon
+	Texture latlong( data, width, height );
+	faceSize = max( width / 4, 1 );
+
+	// each face texel is the lat/long image filtered over about one face
+	// texel's worth of angle
+	double footprint = (2.0 / faceSize) / (2 * pi);
+	vector<float> texels( faceSize * faceSize * 3 );
+	for( int k = 0; k < 6; ++k ) {
+		for( int y = 0; y < faceSize; ++y ) {
+			for( int x = 0; x < faceSize; ++x ) {
+				vec3f d = faceDirection( k, (x + 0.5) / faceSize, (y + 0.5) / faceSize ).normalize();
+				double u = atan2( -d[2], d[0] ) / (2 * pi);
+				if( u < 0.0 ) {
+					u += 1.0;
+				}
+				double v = acos( -d[1] ) / pi;
+				if( v >= 1.0 ) {
+					v = 1.0 - 1.0e-9;
+				}
+
+				vec3f c = latlong.sample( u, v, footprint );
+				float *out = &texels[ (y * faceSize + x) * 3 ];
+				out[0] = float( c[0] );
+				out[1] = float( c[1] );
+				out[2] = float( c[2] );
+			}
+		}
+		faces[k] = new Texture( &texels[0], faceSize, faceSize );
+	}
+}
+
+EnvironmentMap::~EnvironmentMap()
+{
+	for( int k = 0; k < 6; ++k ) {
+		delete faces[k];
+	}
+}
+
+vec3f EnvironmentMap::sample( const vec3f& d, double spread ) const
+{
+	int face;
+	double u, v;
+	faceCoords( d, face, u, v );
+
+	// A cone 'spread' wide covers spread / m^2 of the face (face coordinates
+	// run from -1 to 1, so half that in u,v), where m is the major component
+	// of the unit direction: the face is 1/m away and seen at an angle.
+	vec3f n = d.normalize();
+	double m = fabs( n[ face / 2 ] );
+	return faces[face]->sample( u, v, spread / (2 * m * m) );
+}
+
+void EnvironmentMap::faceCoords( const vec3f& d, int& face, double& u, double& v )
+{
+	int a = 0;
+	for( int k = 1; k < 3; ++k ) {
+		if( fabs( d[k] ) > fabs( d[a] ) ) {
+			a = k;
+		}
+	}
+	face = 2 * a + (d[a] < 0.0 ? 1 : 0);
+
+	double m = fabs( d[a] );
+	u = 0.5 * (d[ (a + 1) % 3 ] / m + 1.0);
+	v = 0.5 * (d[ (a + 2) % 3 ] / m + 1.0);
+
+	// the far edges belong to the face too
+	if( u >= 1.0 ) {
+		u = 1.0 - 1.0e-9;
+	}
+	if( v >= 1.0 ) {
+		v = 1.0 - 1.0e-9;
+	}
+}
+
+vec3f EnvironmentMap::faceDirection( int face, double u, double v )
+{
+	int a = face / 2;
+	vec3f d;
+	d[a] = (face & 1) ? -1.0 : 1.0;
+	d[ (a + 1) % 3 ] = 2.0 * u - 1.0;
+	d[ (a + 2) % 3 ] = 2.0 * v - 1.0;
+	return d;
+}
@@ -0,0 +1,39 @@
+//
+// envmap.h
+//
+// An environment map: the color of the world infinitely far away, looked up
+// by direction.  Rays that leave the scene pick up their color here.
+//
+
+#ifndef __ENVMAP_H__
+#define __ENVMAP_H__
+
+#include "texture.h"
+
+class EnvironmentMap
+{
+public:
+	// data is a latitude/longitude image as returned by readBMP: u goes once
+	// around the y axis, v from straight down (-y, bottom row) to straight
+	// up (+y, top row).
+	EnvironmentMap( const unsigned char *data, int width, int height );
+	~EnvironmentMap();
+
+	// Color seen looking in direction d (need not be normalized), averaged
+	// over a cone about 'spread' radians wide.
+	vec3f sample( const vec3f& d, double spread ) const;
+
+private:
+	// The image is resampled once, at load time, onto the six faces of a
+	// cube.  Finding a face and the point on it only takes a compare and two
+	// divides, where the lat/long image would need an atan2 and an acos on
+	// every lookup.  Face k looks down axis k/2, in the positive direction
+	// for even k.
+	Texture *faces[6];
+	int faceSize;
+
+	static void faceCoords( const vec3f& d, int& face, double& u, double& v );
+	static vec3f faceDirection( int face, double u, double v );
+};
+
+#endif // __ENVMAP_H__
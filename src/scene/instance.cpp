@@ -0,0 +1,85 @@
+#include "instance.h"
+
+void Prototype::init( const list<Geometry*>& objs )
+{
+	objects = objs;
+
+	bool first_boundedobject = true;
+	for( list<Geometry*>::const_iterator j = objects.begin(); j != objects.end(); ++j ) {
+		(*j)->bakeTransform();
+
+		if( !(*j)->hasBoundingBoxCapability() ) {
+			nonboundedobjects.push_back( *j );
+			continue;
+		}
+
+		boundedobjects.push_back( *j );
+		const BoundingBox& b = (*j)->getBoundingBox();
+		if( first_boundedobject ) {
+			bounds = b;
+			first_boundedobject = false;
+		} else {
+			bounds.max = maximum( bounds.max, b.max );
+			bounds.min = minimum( bounds.min, b.min );
+		}
+	}
+
+	bvh.build( boundedobjects );
+}
+
+bool Prototype::intersect( const ray& r, isect& i ) const
+{
+	isect cur;
+	bool have_one = false;
+
+	for( list<Geometry*>::const_iterator j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j ) {
+		if( (*j)->intersect( r, cur ) ) {
+			if( !have_one || (cur.t < i.t) ) {
+				i = cur;
+				have_one = true;
+			}
+		}
+	}
+
+	if( bvh.intersect( r, cur, have_one ? i.t : 1.0e308 ) ) {
+		i = cur;
+		have_one = true;
+	}
+
+	return have_one;
+}
+
+BoundingBox Instance::getPartBounds( const Geometry *part ) const
+{
+	// as Geometry::ComputeBoundingBox, over both ends of the shutter
+	const BoundingBox& b = part->getBoundingBox();
+	BoundingBox world;
+	for( int k = 0; k < 8; ++k ) {
+		vec4f corner( (k & 1) ? b.max[0] : b.min[0], (k & 2) ? b.max[1] : b.min[1],
+			(k & 4) ? b.max[2] : b.min[2], 1 );
+		vec3f start( transform->localToGlobalCoords( corner ) );
+		vec3f end( transform->localToGlobalCoordsEnd( corner ) );
+		world.min = (k == 0) ? minimum( start, end ) : minimum( world.min, minimum( start, end ) );
+		world.max = (k == 0) ? maximum( start, end ) : maximum( world.max, maximum( start, end ) );
+	}
+	return world;
+}
+
+bool Instance::intersect( const ray& r, isect& i ) const
+{
+	ray localRay( r );
+	double length;
+	mat3f movedNormi;
+	const mat3f *normi = toLocal( r, localRay, length, movedNormi );
+
+	// as Geometry::intersect, but the prototype's object has already set
+	// i.localP in its own coordinates, and i.geometry is this rather than
+	// that object
+	if( prototype->intersect( localRay, i ) ) {
+		i.N = (*normi * i.N).normalize();
+		i.t /= length;
+		i.geometry = this;
+		return true;
+	}
+	return false;
+}
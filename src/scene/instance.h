@@ -0,0 +1,68 @@
+//
+// instance.h
+//
+// Instancing: a Prototype is a set of objects, read once, and an Instance
+// places the whole set in the scene under a transformation of its own.
+// However many instances there are, there is one copy of the prototype's
+// objects and one BVH over them; the scene's BVH only holds the instances'
+// boxes.
+//
+
+#ifndef __INSTANCE_H__
+#define __INSTANCE_H__
+
+#include "scene.h"
+#include "bvh.h"
+
+class Prototype
+{
+public:
+	// Its objects and their transformations are placed in the scene's
+	// arena, as the prototype itself should be.
+	Prototype( Arena& arena )
+		: transformRoot( arena ) {}
+
+	// The objects' transformations are relative to this.
+	TransformRoot transformRoot;
+
+	// Take over the objects, whose bounding boxes must already be
+	// computed, and build the BVH over them.
+	void init( const list<Geometry*>& objs );
+
+	// Nearest hit, in the prototype's coordinates.
+	bool intersect( const ray& r, isect& i ) const;
+
+	// Can the instances be bounded?  Not if one of the objects can't be.
+	bool hasBoundingBoxCapability() const { return nonboundedobjects.empty(); }
+	const BoundingBox& getBoundingBox() const { return bounds; }
+
+private:
+	list<Geometry*> objects;
+	list<Geometry*> nonboundedobjects;
+	list<Geometry*> boundedobjects;
+	BoundingBox bounds;
+	BVH bvh;
+};
+
+class Instance
+	: public Geometry
+{
+public:
+	Instance( Scene *scene, const Prototype *proto )
+		: Geometry( scene ), prototype( proto ) {}
+
+	// The hit object in i is the prototype's, so its material and texture
+	// coordinates are used.
+	virtual bool intersect( const ray& r, isect& i ) const;
+
+	// part's box in the prototype, placed by this instance's transform
+	virtual BoundingBox getPartBounds( const Geometry *part ) const;
+
+	virtual bool hasBoundingBoxCapability() const { return prototype->hasBoundingBoxCapability(); }
+	virtual BoundingBox ComputeLocalBoundingBox() { return prototype->getBoundingBox(); }
+
+private:
+	const Prototype *prototype;
+};
+
+#endif // __INSTANCE_H__
@@ -1,10 +1,55 @@
 #include <cmath>
+#include <atomic>
+#include <vector>
 
 #include "light.h"
 #include "../ui/TraceUI.h"
 #include "math.h"
 extern TraceUI* traceUI;
 
+// the next Light's slot
+static std::atomic<int> nextSlot( 0 );
+
+// This thread's last occluder for each light, by slot, so that threads
+// shading at once don't overwrite each other's.
+static thread_local std::vector<const Geometry*> lastOccluders;
+
+Light::Light( Scene *scene, const vec3f& col )
+	: SceneElement( scene ), color( col ), slot( nextSlot++ )
+{
+}
+
+const Geometry *&Light::lastOccluder() const
+{
+	if (slot >= (int)lastOccluders.size()) lastOccluders.resize(slot + 1, NULL);
+	return lastOccluders[slot];
+}
+
+double Light::estimateIntensity( const vec3f& P ) const
+{
+	return maxComponent(getColor(P)) * distanceAttenuation(P);
+}
+
+bool Light::hitsLastOccluder( const ray& r, double distance ) const
+{
+	const Geometry *occluder = lastOccluder();
+	if (!occluder) return false;
+
+	// an instance's nearest hit may be one of its transparent parts
+	isect i;
+	return occluder->intersect(r, i) && i.t < distance && i.getMaterial().kt.iszero();
+}
+
+vec3f Light::transmittance( const ray& r, double distance ) const
+{
+	if (hitsLastOccluder(r, distance)) return vec3f(0, 0, 0);
+
+	const Geometry *blocker;
+	vec3f kt = scene->transmittance(r, distance, blocker);
+	if (blocker) lastOccluder() = blocker;
+	return kt;
+}
+
 double DirectionalLight::distanceAttenuation( const vec3f& P ) const
 {
 	// distance to light is infinite, so f(di) goes to 0.  Return 1.
@@ -12,28 +57,10 @@ double DirectionalLight::distanceAttenuation( const vec3f& P ) const
 }
 
 
-vec3f DirectionalLight::shadowAttenuation( const vec3f& P ) const
+vec3f DirectionalLight::shadowAttenuation( const vec3f& P, double time ) const
 {
-    // YOUR CODE HERE:
-    // You should implement shadow-handling code here.
-    vec3f d = getDirection(P);
-
-	// loop to get the attenuation
-	vec3f curP = P;
-	isect isecP;
-	vec3f ret = getColor(P);
-	ray r = ray(curP, d);
-	while (scene->intersect(r, isecP))
-	{
-		//if not transparent return black
-		if (isecP.getMaterial().kt.iszero()) return vec3f(0, 0, 0);
-		if (ret[0] < 0.004 && ret[1] < 0.004 && ret[2] < 0.004) return vec3f(0, 0, 0);
-		//use current intersection point as new light source
-		curP = r.at(isecP.t);
-		r = ray(curP, d);
-		ret = prod(ret, isecP.getMaterial().kt);
-	}
-	return ret;
+	ray r(P, getDirection(P), time);
+	return prod(getColor(P), transmittance(r, 1.0e308));
 }
 
 vec3f DirectionalLight::getColor( const vec3f& P ) const
@@ -75,27 +102,12 @@ vec3f PointLight::getDirection( const vec3f& P ) const
 }
 
 
-vec3f PointLight::shadowAttenuation(const vec3f& P) const
+vec3f PointLight::shadowAttenuation(const vec3f& P, double time) const
 {
-    double distance = (position - P).length();
-    ray r =ray(P, getDirection(P));
-	vec3f d = r.getDirection();
-	vec3f result = getColor(P);
-	vec3f curP = r.getPosition();
-	isect isecP;
-	ray newr(curP, d);
-	while (scene->intersect(newr, isecP))
-	{
-		//prevent going beyond this light
-		if ((distance -= isecP.t) < RAY_EPSILON) return result;
-		//if not transparent return black
-		if (isecP.getMaterial().kt.iszero()) return vec3f(0, 0, 0);
-		//use current intersection point as new light source
-		curP = r.at(isecP.t);
-		newr = ray(curP, d);
-		result = prod(result, isecP.getMaterial().kt);
-	}
-	return result;
+	// anything within RAY_EPSILON of the light doesn't count
+	double distance = (position - P).length() - RAY_EPSILON;
+	ray r(P, getDirection(P), time);
+	return prod(getColor(P), transmittance(r, distance));
 }
 
 double SpotLight::distanceAttenuation( const vec3f& P ) const
@@ -126,34 +138,125 @@ vec3f SpotLight::getDirection( const vec3f& P ) const
 }
 
 
-vec3f SpotLight::shadowAttenuation(const vec3f& P) const
+bool SpotLight::inCone( const vec3f& P ) const
 {
 	vec3f lp = (P - position).normalize();
 	double intensity = lp.dot(orientation.normalize());
 	double bound = cos(angle * 3.1415926535 / 180);
-	int index = 0;
-	if (bound < intensity)
+	return bound < intensity;
+}
+
+double SpotLight::estimateIntensity( const vec3f& P ) const
+{
+	return inCone(P) ? Light::estimateIntensity(P) : 0.0;
+}
+
+vec3f SpotLight::shadowAttenuation(const vec3f& P, double time) const
+{
+	if (!inCone(P)) return vec3f(0, 0, 0);
+
+	double distance = (position - P).length() - RAY_EPSILON;
+	ray r(P, getDirection(P), time);
+	return prod(getColor(P), transmittance(r, distance));
+}
+
+// Transmittances further apart than this, in any channel, disagree: the
+// shading point is in a penumbra.
+static const double PENUMBRA_DIFFERENCE = 1.0 / 256.0;
+
+AreaLight::AreaLight( Scene *scene, const vec3f& pos, const vec3f& color, int samples )
+	: Light( scene, color ), position( pos )
+{
+	gridSize = int(sqrt(double(samples)) + 0.5);
+}
+
+double AreaLight::distanceAttenuation( const vec3f& P ) const
+{
+	// as a point light at the center
+	double a = traceUI->getAttenuationConstant();
+	double b = traceUI->getAttenuationLinear();
+	double c = traceUI->getAttenuationQuadratic();
+	double dist = (P - position).length();
+	double drop = 1.0/(a + b * dist +c * dist * dist);
+	drop = (drop > 1.0)? 1.0 : drop;
+	return drop;
+}
+
+vec3f AreaLight::getColor( const vec3f& P ) const
+{
+	// Color doesn't depend on P 
+	return color;
+}
+
+vec3f AreaLight::getDirection( const vec3f& P ) const
+{
+	return (position - P).normalize();
+}
+
+vec3f AreaLight::visibility( const vec3f& P, const vec3f& Q, double time ) const
+{
+	vec3f d = Q - P;
+	double distance = d.length();
+	if (distance <= RAY_EPSILON) return vec3f(1.0, 1.0, 1.0);
+
+	// anything within RAY_EPSILON of the light doesn't count
+	ray r(P, d / distance, time);
+	return transmittance(r, distance - RAY_EPSILON);
+}
+
+vec3f AreaLight::shadowAttenuation( const vec3f& P, double time ) const
+{
+	// one ray to a random point in each quarter of the light
+	vec3f quarter[4];
+	vec3f sum;
+	bool agree = true;
+	for (int k = 0; k < 4; ++k)
 	{
-		index = 1;
+		double s = ((k & 1) + rand() / (RAND_MAX + 1.0)) / 2;
+		double t = ((k >> 1) + rand() / (RAND_MAX + 1.0)) / 2;
+		quarter[k] = visibility(P, samplePoint(P, s, t), time);
+		sum += quarter[k];
+
+		vec3f diff = quarter[k] - quarter[0];
+		if (maximum(maxComponent(diff), maxComponent(-diff)) > PENUMBRA_DIFFERENCE) agree = false;
 	}
-    double distance = (position - P).length();
-    ray r =ray(P, getDirection(P));
-	vec3f d = r.getDirection();
-	vec3f result = getColor(P);
-	vec3f curP = r.getPosition();
-	isect isecP;
-	ray newr(curP, d);
-	while (scene->intersect(newr, isecP))
+	if (agree || gridSize <= 2) return prod(color, sum / 4);
+
+	// in a penumbra: one more ray to each cell of the grid, and the
+	// average of them all
+	for (int j = 0; j < gridSize; ++j)
 	{
-		//prevent going beyond this light
-		if ((distance -= isecP.t) < RAY_EPSILON) return result;
-		//if not transparent return black
-		if (isecP.getMaterial().kt.iszero()) return vec3f(0, 0, 0);
-		//use current intersection point as new light source
-		curP = r.at(isecP.t);
-		newr = ray(curP, d);
-		result = prod(result, isecP.getMaterial().kt);
+		for (int k = 0; k < gridSize; ++k)
+		{
+			double s = (k + rand() / (RAND_MAX + 1.0)) / gridSize;
+			double t = (j + rand() / (RAND_MAX + 1.0)) / gridSize;
+			sum += visibility(P, samplePoint(P, s, t), time);
+		}
 	}
-	result *= index;
-	return result;
+	return prod(color, sum / (4 + gridSize * gridSize));
+}
+
+vec3f RectangleLight::samplePoint( const vec3f& P, double s, double t ) const
+{
+	return position + (s - 0.5) * edgeU + (t - 0.5) * edgeV;
+}
+
+vec3f SphereLight::shadowAttenuation( const vec3f& P, double time ) const
+{
+	// nothing can be in the way inside the light
+	if ((position - P).length() <= radius) return color;
+	return AreaLight::shadowAttenuation(P, time);
+}
+
+vec3f SphereLight::samplePoint( const vec3f& P, double s, double t ) const
+{
+	// two axes across the direction to P
+	vec3f w = (P - position).normalize();
+	vec3f a = (fabs(w[0]) < 0.9 ? vec3f(1.0, 0.0, 0.0) : vec3f(0.0, 1.0, 0.0)).cross(w).normalize();
+	vec3f b = w.cross(a);
+
+	// even in area over the disc
+	double r = radius * sqrt(s);
+	double phi = 2.0 * 3.1415926535 * t;
+	return position + r * cos(phi) * a + r * sin(phi) * b;
 }
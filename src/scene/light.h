@@ -7,16 +7,49 @@ class Light
 	: public SceneElement
 {
 public:
-	virtual vec3f shadowAttenuation(const vec3f& P) const = 0;
+	// Light reaching P past whatever is in the way at the given time (see
+	// ray::getTime).
+	virtual vec3f shadowAttenuation(const vec3f& P, double time) const = 0;
 	virtual double distanceAttenuation( const vec3f& P ) const = 0;
 	virtual vec3f getColor( const vec3f& P ) const = 0;
 	virtual vec3f getDirection( const vec3f& P ) const = 0;
 
+	// Cheap, unshadowed bound on how much light reaches P from here: no
+	// less than any channel of getColor(P) * distanceAttenuation(P), and 0
+	// only where the light can't contribute.  Used to decide which lights
+	// are worth a shadow ray.
+	virtual double estimateIntensity( const vec3f& P ) const;
+
+	// For animating the light between frames.  Lights without a position
+	// or a direction ignore setting one.
+	void setColor( const vec3f& col ) { color = col; }
+	virtual void setPosition( const vec3f& pos ) {}
+	virtual void setDirection( const vec3f& dir ) {}
+
 protected:
-	Light( Scene *scene, const vec3f& col )
-		: SceneElement( scene ), color( col ) {}
+	Light( Scene *scene, const vec3f& col );
+
+	// The fraction of this light that gets to r's origin past everything
+	// closer than distance along r (see Scene::transmittance).
+	vec3f transmittance( const ray& r, double distance ) const;
+
+	// Is r blocked before 'distance' along it by the opaque object that
+	// last blocked one of this light's shadow rays on this thread?
+	// Shading points next to each other are usually in the shadow of the
+	// same object, so this is worth trying before searching the whole
+	// scene.
+	bool hitsLastOccluder( const ray& r, double distance ) const;
 
 	vec3f 		color;
+
+private:
+	// this thread's last occluder for the light, NULL at first
+	const Geometry *&lastOccluder() const;
+
+	// The light's place in each thread's table of last occluders.  No two
+	// lights ever get the same one, so a light never sees an occluder
+	// left by one that is gone.
+	int slot;
 };
 
 class DirectionalLight
@@ -25,10 +58,11 @@ class DirectionalLight
 public:
 	DirectionalLight( Scene *scene, const vec3f& orien, const vec3f& color )
 		: Light( scene, color ), orientation( orien ) {}
-	virtual vec3f shadowAttenuation(const vec3f& P) const;
+	virtual vec3f shadowAttenuation(const vec3f& P, double time) const;
 	virtual double distanceAttenuation( const vec3f& P ) const;
 	virtual vec3f getColor( const vec3f& P ) const;
 	virtual vec3f getDirection( const vec3f& P ) const;
+	virtual void setDirection( const vec3f& dir ) { orientation = dir; }
 
 protected:
 	vec3f 		orientation;
@@ -40,10 +74,11 @@ class PointLight
 public:
 	PointLight( Scene *scene, const vec3f& pos, const vec3f& color )
 		: Light( scene, color ), position( pos ) {}
-	virtual vec3f shadowAttenuation(const vec3f& P) const;
+	virtual vec3f shadowAttenuation(const vec3f& P, double time) const;
 	virtual double distanceAttenuation( const vec3f& P ) const;
 	virtual vec3f getColor( const vec3f& P ) const;
 	virtual vec3f getDirection( const vec3f& P ) const;
+	virtual void setPosition( const vec3f& pos ) { position = pos; }
 
 protected:
 	vec3f position;
@@ -55,10 +90,16 @@ class SpotLight
 public:
 	SpotLight( Scene *scene, const vec3f& pos, const vec3f& color, const int ang, const vec3f& orien )
 		: Light( scene, color ), position( pos ), angle(ang), orientation(orien) {}
-	virtual vec3f shadowAttenuation(const vec3f& P) const;
+	virtual vec3f shadowAttenuation(const vec3f& P, double time) const;
 	virtual double distanceAttenuation( const vec3f& P ) const;
 	virtual vec3f getColor( const vec3f& P ) const;
 	virtual vec3f getDirection( const vec3f& P ) const;
+	virtual double estimateIntensity( const vec3f& P ) const;
+	virtual void setPosition( const vec3f& pos ) { position = pos; }
+	virtual void setDirection( const vec3f& dir ) { orientation = dir; }
+
+	// is P inside the cone of the light?
+	bool inCone( const vec3f& P ) const;
 
 protected:
 	vec3f position;
@@ -66,4 +107,70 @@ protected:
 	int angle;
 };
 
+// A light with an extent, which casts soft shadows.  It is shaded as a
+// point light at its center, but its shadow is the fraction of it that can
+// be seen from the shading point, from shadow rays to points spread over
+// it.  Four rays, one to each quarter of the light, are traced first.  If
+// they all agree the point is fully lit or fully in shadow.  If they
+// don't, it is in a penumbra, and one more ray is traced to each cell of a
+// grid of about 'samples' cells over the light.
+class AreaLight
+	: public Light
+{
+public:
+	virtual vec3f shadowAttenuation(const vec3f& P, double time) const;
+	virtual double distanceAttenuation( const vec3f& P ) const;
+	virtual vec3f getColor( const vec3f& P ) const;
+	virtual vec3f getDirection( const vec3f& P ) const;
+	virtual void setPosition( const vec3f& pos ) { position = pos; }
+
+protected:
+	AreaLight( Scene *scene, const vec3f& pos, const vec3f& color, int samples );
+
+	// The point of the light at (s, t) in [0,1)^2, as seen from P.  Even
+	// areas of the square must map to even areas of the light.
+	virtual vec3f samplePoint( const vec3f& P, double s, double t ) const = 0;
+
+	// how much of the light from Q gets to P
+	vec3f visibility( const vec3f& P, const vec3f& Q, double time ) const;
+
+	vec3f position;             // the center
+	int gridSize;               // the penumbra grid is gridSize x gridSize
+};
+
+// A parallelogram centered at pos with edges u and v, shining from both
+// sides.
+class RectangleLight
+	: public AreaLight
+{
+public:
+	RectangleLight( Scene *scene, const vec3f& pos, const vec3f& u, const vec3f& v,
+		const vec3f& color, int samples )
+		: AreaLight( scene, pos, color, samples ), edgeU( u ), edgeV( v ) {}
+
+protected:
+	virtual vec3f samplePoint( const vec3f& P, double s, double t ) const;
+
+	vec3f edgeU;
+	vec3f edgeV;
+};
+
+// A ball of light.  From a shading point it is sampled over the disc
+// through its center facing the point, which is close to the part of it
+// the point can see.
+class SphereLight
+	: public AreaLight
+{
+public:
+	SphereLight( Scene *scene, const vec3f& pos, double r, const vec3f& color, int samples )
+		: AreaLight( scene, pos, color, samples ), radius( r ) {}
+
+	virtual vec3f shadowAttenuation(const vec3f& P, double time) const;
+
+protected:
+	virtual vec3f samplePoint( const vec3f& P, double s, double t ) const;
+
+	double radius;
+};
+
 #endif // __LIGHT_H__
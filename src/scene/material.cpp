@@ -5,6 +5,9 @@
 #include "../ui/TraceUI.h"
 #include "scene.h"
 #include <cmath>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
 extern TraceUI* traceUI;
 
 typedef list<Light*>::iterator 			liter;
@@ -12,7 +15,7 @@ typedef list<Light*>::const_iterator 	cliter;
 
 // Apply the phong model to this point on the surface of the object, returning
 // the color of that point.
-vec3f Material::shade( Scene *scene, const ray& r, const isect& i ) const
+vec3f Material::shade( Scene *scene, const ray& r, const isect& i, const vec3f& weight ) const
 {
 	// YOUR CODE HERE
 
@@ -27,21 +30,125 @@ vec3f Material::shade( Scene *scene, const ray& r, const isect& i ) const
     // somewhere in your code in order to compute shadows and light falloff.
 
 	vec3f I = ke + ka * traceUI->getAmbientLight();
-	for (cliter li = scene->beginLights(); li != scene->endLights(); ++li)
+	vec3f P = r.at(i.t);
+	vec3f diffuse = diffuseColor(i);
+	int budget = traceUI->getLightSamples();
+	if (budget > 0 && scene->getNumLights() > budget)
+	{
+		I += sampleLights(scene, r, i, P, diffuse, budget, weight);
+	}
+	else
 	{
-		vec3f atten = (*li)->distanceAttenuation(r.at(i.t)) * (*li)->shadowAttenuation(r.at(i.t));
-		double diffuse_coef = (i.N).dot((*li)->getDirection(r.at(i.t)));
-		diffuse_coef = (diffuse_coef > 0)? diffuse_coef : 0;
-		vec3f diffuse_term = kd * diffuse_coef;
-		vec3f reflection = (2 * ((*li)->getDirection(r.at(i.t)).normalize().dot(i.N) * i.N) - (*li)->getDirection(r.at(i.t)).normalize()).normalize();
-		vec3f view = - r.getDirection().normalize();
-		double specular_coef = reflection.dot(view);
-		specular_coef = (specular_coef > 0)? specular_coef : 0;
-		specular_coef = pow(specular_coef, shininess * 128);
-		vec3f specular_term = ks * specular_coef;
-		I += prod(atten ,diffuse_term + specular_term);
+		for (cliter li = scene->beginLights(); li != scene->endLights(); ++li)
+		{
+			I += shadeLight(*li, r, i, P, diffuse, weight);
+		}
 	}
 	I = I.clamp();
 
 	return I;
 }
+
+// The phong diffuse and specular terms for a single light at the hit point
+// P, attenuated by distance and shadows.  diffuse is the surface's kd there.
+// The shadow ray is only traced if, unshadowed, the light would add more
+// than the UI threshold to the pixel through a ray of the given weight.
+vec3f Material::shadeLight( const Light *light, const ray& r, const isect& i,
+	const vec3f& P, const vec3f& diffuse, const vec3f& weight ) const
+{
+	vec3f L = light->getDirection(P);
+	double diffuse_coef = (i.N).dot(L);
+	diffuse_coef = (diffuse_coef > 0)? diffuse_coef : 0;
+	vec3f diffuse_term = diffuse * diffuse_coef;
+	vec3f reflection = (2 * (L.normalize().dot(i.N) * i.N) - L.normalize()).normalize();
+	vec3f view = - r.getDirection().normalize();
+	double specular_coef = reflection.dot(view);
+	specular_coef = (specular_coef > 0)? specular_coef : 0;
+	specular_coef = pow(specular_coef, shininess * 128);
+	vec3f specular_term = ks * specular_coef;
+
+	// estimateIntensity covers the color, the distance falloff and a spot
+	// light's cone; a light behind the surface, or one on a black
+	// surface, is culled by the terms
+	double bound = light->estimateIntensity(P) * maxComponent(prod(weight, diffuse_term + specular_term));
+	if (bound <= traceUI->getThreshold())
+	{
+		return vec3f(0.0, 0.0, 0.0);
+	}
+
+	// shadow rays leave from just off the surface, on the light's side
+	vec3f shadowP = offsetRayOrigin(P, i.N, L);
+	vec3f atten = light->distanceAttenuation(P) * light->shadowAttenuation(shadowP, r.getTime());
+	return prod(atten ,diffuse_term + specular_term);
+}
+
+// Estimate the light arriving at P from a scene with many lights by shading
+// only 'budget' of them.  Each light is picked with probability proportional
+// to Light::estimateIntensity (its color, distance falloff and, for spot
+// lights, the cone), stratified over the cumulative distribution so that the
+// picks are spread out, and weighted by 1 / (budget * probability).  Lights
+// that are skipped this way would have had zero contribution, so the result
+// is unbiased: on average it equals shading every light.
+vec3f Material::sampleLights( Scene *scene, const ray& r, const isect& i,
+	const vec3f& P, const vec3f& diffuse, int budget, const vec3f& weight ) const
+{
+	vector<const Light*> candidates;
+	vector<double> cdf;
+	double total = 0.0;
+	for (cliter li = scene->beginLights(); li != scene->endLights(); ++li)
+	{
+		double w = (*li)->estimateIntensity(P);
+		if (w > 0.0)
+		{
+			total += w;
+			candidates.push_back(*li);
+			cdf.push_back(total);
+		}
+	}
+	if (candidates.empty())
+	{
+		return vec3f(0.0, 0.0, 0.0);
+	}
+
+	vec3f sum;
+	for (int k = 0; k < budget; ++k)
+	{
+		double u = (k + rand() / (RAND_MAX + 1.0)) / budget * total;
+		int j = int(upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+		if (j >= (int)candidates.size())
+		{
+			j = candidates.size() - 1;
+		}
+		double w = cdf[j] - (j > 0 ? cdf[j - 1] : 0.0);
+		double scale = total / w;
+		sum += shadeLight(candidates[j], r, i, P, diffuse, weight * (scale / budget)) * scale;
+	}
+	return sum / budget;
+}
+
+// kd, or the material's texture at the hit point.  Texture coordinates
+// outside [0,1) wrap around, so textures tile.  The lookup is filtered over
+// the area the pixel covers, taking the image to span the object's bounding
+// box.
+vec3f Material::diffuseColor( const isect& i ) const
+{
+	const Texture *tex = texture.get();
+	if (!tex || !i.obj)
+	{
+		return kd;
+	}
+
+	double u, v;
+	i.obj->getUV(i.localP, u, v);
+	u -= floor(u);
+	v -= floor(v);
+
+	double footprint = 0.0;
+	BoundingBox bounds = i.geometry->getPartBounds(i.obj);
+	double size = maxComponent(bounds.max - bounds.min);
+	if (size > 0.0)
+	{
+		footprint = i.footprint / size;
+	}
+	return tex->sample(u, v, footprint);
+}
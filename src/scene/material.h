@@ -7,9 +7,11 @@
 #define __MATERIAL_H__
 
 #include "../vecmath/vecmath.h"
+#include "texture.h"
 class Scene;
 class ray;
 class isect;
+class Light;
 
 class Material
 {
@@ -28,7 +30,15 @@ public:
               const vec3f& d, const vec3f& r, const vec3f& t, double sh, double in)
         : ke( e ), ka( a ), ks( s ), kd( d ), kr( r ), kt( t ), shininess( sh ), index( in ) {}
 
-	virtual vec3f shade( Scene *scene, const ray& r, const isect& i ) const;
+	// weight is how much the ray r counts for in the pixel (see
+	// RayTracer::traceRay); lights that couldn't add more than the UI
+	// threshold through it aren't traced.
+	virtual vec3f shade( Scene *scene, const ray& r, const isect& i, const vec3f& weight ) const;
+	vec3f shadeLight( const Light *light, const ray& r, const isect& i,
+		const vec3f& P, const vec3f& diffuse, const vec3f& weight ) const;
+	vec3f sampleLights( Scene *scene, const ray& r, const isect& i,
+		const vec3f& P, const vec3f& diffuse, int budget, const vec3f& weight ) const;
+	vec3f diffuseColor( const isect& i ) const;
 
     vec3f ke;                    // emissive
     vec3f ka;                    // ambient
@@ -39,6 +49,7 @@ public:
     
     double shininess;
     double index;               // index of refraction
+    TextureRef texture;         // if set, replaces kd
 
     
                                 // material with zero coeffs for everything
@@ -57,6 +68,8 @@ public:
         kt += m.kt;
         index += m.index;
         shininess += m.shininess;
+        if( texture.isNull() )
+            texture = m.texture;
         return *this;
     }
 
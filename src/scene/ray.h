@@ -11,30 +11,35 @@
 #include "material.h"
 
 class SceneObject;
+class Geometry;
 
 // A ray has a position where the ray starts, and a direction (which should
 // always be normalized!)
 
+// time is when, during the shutter interval [0,1], the ray is cast.  It
+// decides where moving objects are; rays spawned from a hit inherit it.
 class ray {
 public:
-	ray( const vec3f& pp, const vec3f& dd )
-		: p( pp ), d( dd ) {}
+	ray( const vec3f& pp, const vec3f& dd, double tm = 0.0 )
+		: p( pp ), d( dd ), time( tm ) {}
 	ray( const ray& other ) 
-		: p( other.p ), d( other.d ) {}
+		: p( other.p ), d( other.d ), time( other.time ) {}
 	~ray() {}
 
 	ray& operator =( const ray& other ) 
-	{ p = other.p; d = other.d; return *this; }
+	{ p = other.p; d = other.d; time = other.time; return *this; }
 
 	vec3f at( double t ) const
 	{ return p + (t*d); }
 
 	vec3f getPosition() const { return p; }
 	vec3f getDirection() const { return d; }
+	double getTime() const { return time; }
 
 protected:
 	vec3f p;
 	vec3f d;
+	double time;
 };
 
 // The description of an intersection point.
@@ -43,7 +48,7 @@ class isect
 {
 public:
     isect()
-        : obj( NULL ), t( 0.0 ), N(), material(0) {}
+        : obj( NULL ), geometry( NULL ), t( 0.0 ), N(), localP(), footprint( 0.0 ), material(0) {}
 
     ~isect()
     {
@@ -60,8 +65,11 @@ public:
         if( this != &other )
         {
             obj = other.obj;
+            geometry = other.geometry;
             t = other.t;
             N = other.N;
+            localP = other.localP;
+            footprint = other.footprint;
 //            material = other.material ? new Material( *(other.material) ) : 0;
 			if( other.material )
             {
@@ -80,8 +88,13 @@ public:
 
 public:
     const SceneObject 	*obj;
+    const Geometry *geometry;   // the scene's object that was hit: obj, or
+                                // the Instance obj is in
     double t;
     vec3f N;
+    vec3f localP;               // hit point in the object's own coordinates
+    double footprint;           // width the pixel covers at the hit point,
+                                // in world units (set by the ray tracer)
     Material *material;         // if this intersection has its own material
                                 // (as opposed to one in its associated object)
                                 // as in the case where the material was interpolated
@@ -92,5 +105,19 @@ public:
 
 const double RAY_EPSILON = 0.00001;
 const double NORMAL_EPSILON = 0.00001;
+const double ORIGIN_EPSILON = 1.0e-8;
+
+// Starting point for a ray spawned at a hit point P with normal N
+// (reflection, refraction or shadow ray going in direction d).  P carries
+// rounding error from the intersection and the object transform, so rather
+// than relying only on the RAY_EPSILON cutoff in t, it is pushed off the
+// surface to the side d leaves through.  The push grows with the size of
+// the coordinates, like the error does.
+inline vec3f offsetRayOrigin( const vec3f& P, const vec3f& N, const vec3f& d )
+{
+	double mag = maximum( fabs( P[0] ), maximum( fabs( P[1] ), fabs( P[2] ) ) );
+	double offset = ORIGIN_EPSILON * ( 1.0 + mag );
+	return ( N * d > 0.0 ) ? P + offset * N : P - offset * N;
+}
 
 #endif // __RAY_H__
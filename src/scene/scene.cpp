@@ -1,7 +1,10 @@
 #include <cmath>
 
 #include "scene.h"
+#include "../vecmath/double4.h"
 #include "light.h"
+#include "bvh.h"
+#include "instance.h"
 #include "../ui/TraceUI.h"
 extern TraceUI* traceUI;
 
@@ -74,26 +77,88 @@ bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
 }
 
 
-bool Geometry::intersect(const ray&r, isect&i) const
+const mat3f *Geometry::toLocal(const ray& r, ray& localRay, double& length, mat3f& movedNormi) const
 {
+    // A moving object is intersected where it is at the ray's time
+    const mat4f *inverse = &transform->getInverse();
+    const mat3f *normi = &transform->getNormalMatrix();
+    mat4f movedInverse;
+    if (transform->isMoving()) {
+        transform->getInverseAt(r.getTime(), movedInverse, movedNormi);
+        inverse = &movedInverse;
+        normi = &movedNormi;
+    }
+
     // Transform the ray into the object's local coordinate space
-    vec3f pos = transform->globalToLocalCoords(r.getPosition());
-    vec3f dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
-    double length = dir.length();
+    vec3f pos = *inverse * r.getPosition();
+    vec3f dir = *inverse * (r.getPosition() + r.getDirection()) - pos;
+    length = dir.length();
     dir /= length;
 
-    ray localRay( pos, dir );
+    localRay = ray( pos, dir, r.getTime() );
+    return normi;
+}
 
-    if (intersectLocal(localRay, i)) {
-        // Transform the intersection point & normal returned back into global space.
-		i.N = transform->localToGlobalCoordsNormal(i.N);
-		i.t /= length;
+void Geometry::toLocal4( Geometry *const *objs, int n, const ray& r,
+    double4 p[3], double4 d[3], double4& length )
+{
+    // each lane's inverse, by row and column
+    double m[3][4][4];
+    for (int k = 0; k < 4; ++k) {
+        const TransformNode *transform = objs[ k < n ? k : 0 ]->transform;
+        const mat4f *inverse = &transform->getInverse();
+        mat4f movedInverse;
+        mat3f movedNormi;
+        if (transform->isMoving()) {
+            transform->getInverseAt(r.getTime(), movedInverse, movedNormi);
+            inverse = &movedInverse;
+        }
+        for (int row = 0; row < 3; ++row)
+            for (int col = 0; col < 4; ++col)
+                m[row][col][k] = (*inverse)[row][col];
+    }
 
-		return true;
-    } else {
+    // the same sums as mat4f * vec3f, in the same order
+    vec3f P = r.getPosition();
+    vec3f Q = r.getPosition() + r.getDirection();
+    double4 dir[3];
+    for (int row = 0; row < 3; ++row) {
+        const double (*c)[4] = m[row];
+        double4 m0( c[0][0], c[0][1], c[0][2], c[0][3] );
+        double4 m1( c[1][0], c[1][1], c[1][2], c[1][3] );
+        double4 m2( c[2][0], c[2][1], c[2][2], c[2][3] );
+        double4 m3( c[3][0], c[3][1], c[3][2], c[3][3] );
+        p[row] = double4(P[0]) * m0 + double4(P[1]) * m1 + double4(P[2]) * m2 + m3;
+        dir[row] = double4(Q[0]) * m0 + double4(Q[1]) * m1 + double4(Q[2]) * m2 + m3 - p[row];
+    }
+
+    length = sqrt( dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2] );
+    for (int a = 0; a < 3; ++a)
+        d[a] = dir[a] / length;
+}
+
+bool Geometry::getAxisAlignedTransform(vec3f& scale, vec3f& offset) const
+{
+    if (transform->isMoving())
         return false;
+
+    const mat4f& m = transform->getTransform();
+    for (int a = 0; a < 3; ++a) {
+        for (int b = 0; b < 3; ++b) {
+            if (a != b && m[a][b] != 0.0)
+                return false;
+        }
+        if (m[a][a] == 0.0)
+            return false;
+        scale[a] = m[a][a];
+        offset[a] = m[a][3];
     }
-    
+    return true;
+}
+
+bool Geometry::intersect(const ray&r, isect&i) const
+{
+    return intersectAs<Geometry>(r, i);
 }
 
 bool Geometry::intersectLocal( const ray& r, isect& i ) const
@@ -101,6 +166,12 @@ bool Geometry::intersectLocal( const ray& r, isect& i ) const
 	return false;
 }
 
+void Geometry::getUV( const vec3f& P, double& u, double& v ) const
+{
+	u = 0.0;
+	v = 0.0;
+}
+
 bool Geometry::hasBoundingBoxCapability() const
 {
 	// by default, primitives do not have to specify a bounding box.
@@ -117,24 +188,67 @@ bool Geometry::hasBoundingBoxCapability() const
 
 Scene::~Scene()
 {
-    giter g;
-    liter l;
-    
-	for( g = objects.begin(); g != objects.end(); ++g ) {
-		delete (*g);
+	for( liter l = lights.begin(); l != lights.end(); ++l ) {
+		delete (*l);
 	}
 
-	for( g = boundedobjects.begin(); g != boundedobjects.end(); ++g ) {
-		delete (*g);
+	delete bvh;
+
+	// The objects, their transformations and materials, and the
+	// prototypes all go with the arena.
+}
+
+bool Scene::MaterialLess::operator()( const Material *a, const Material *b ) const
+{
+	const vec3f *ca[6] = { &a->ke, &a->ka, &a->ks, &a->kd, &a->kr, &a->kt };
+	const vec3f *cb[6] = { &b->ke, &b->ka, &b->ks, &b->kd, &b->kr, &b->kt };
+	for( int k = 0; k < 6; ++k ) {
+		for( int c = 0; c < 3; ++c ) {
+			if( (*ca[k])[c] != (*cb[k])[c] ) {
+				return (*ca[k])[c] < (*cb[k])[c];
+			}
+		}
 	}
 
-	for( g = nonboundedobjects.begin(); g != boundedobjects.end(); ++g ) {
-		delete (*g);
+	if( a->shininess != b->shininess ) {
+		return a->shininess < b->shininess;
+	}
+	if( a->index != b->index ) {
+		return a->index < b->index;
 	}
+	return a->texture < b->texture;
+}
 
-	for( l = lights.begin(); l != lights.end(); ++l ) {
-		delete (*l);
+int Scene::addMaterial( const Material& m )
+{
+	map<const Material*, int, MaterialLess>::iterator i = materialIds.find( &m );
+	if( i != materialIds.end() ) {
+		return i->second;
 	}
+
+	Material *copy = arena.own( new( arena ) Material( m ) );
+	int id = materials.size();
+	materials.push_back( copy );
+	materialIds[ copy ] = id;
+	return id;
+}
+
+void Scene::addPrototype( const string& name, Prototype *proto )
+{
+	prototypes[ name ] = proto;
+}
+
+Prototype *Scene::getPrototype( const string& name ) const
+{
+	map<string, Prototype*>::const_iterator p = prototypes.find( name );
+	return p == prototypes.end() ? NULL : p->second;
+}
+
+void Scene::removeObjects( int first, list<Geometry*>& removed )
+{
+	giter g = objects.begin();
+	advance( g, first );
+	removed.splice( removed.end(), objects, g, objects.end() );
 }
 
 // Get any intersection with an object.  Return information about the 
@@ -157,18 +271,77 @@ bool Scene::intersect( const ray& r, isect& i ) const
 		}
 	}
 
-	// try the bounded objects
-	for( j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
-		if( (*j)->intersect( r, cur ) ) {
-			if( !have_one || (cur.t < i.t) ) {
-				i = cur;
-				have_one = true;
+	// try the bounded objects, only as far as the nearest hit so far
+	if( bvh && bvh->intersect( r, cur, have_one ? i.t : 1.0e308 ) ) {
+		i = cur;
+		have_one = true;
+	}
+
+
+	return have_one;
+}
+
+// Light getting through less than this in every channel is treated as
+// blocked: it couldn't change a pixel.
+static const double TRANSMITTANCE_CUTOFF = 0.004;
+
+// Multiplies together the kt of every surface a ray crosses, for
+// Scene::transmittance.
+class TransmittanceVisitor
+	: public BVHVisitor
+{
+public:
+	TransmittanceVisitor( const ray& r, double distance )
+		: shadowRay( r ), tMax( distance ), kt( 1.0, 1.0, 1.0 ), blocker( NULL ) {}
+
+	// Take in each surface of obj the ray crosses, following it from one
+	// to the next, as the ray tracer follows refracted rays.
+	virtual bool visit( Geometry *obj )
+	{
+		vec3f d = shadowRay.getDirection();
+		ray r( shadowRay );
+		double start = 0.0;     // how far along shadowRay r starts
+		isect i;
+		while( obj->intersect( r, i ) && start + i.t < tMax ) {
+			const vec3f& k = i.getMaterial().kt;
+			if( k.iszero() ) {
+				blocker = i.geometry;
+				kt = vec3f( 0.0, 0.0, 0.0 );
+				return false;
+			}
+
+			kt = prod( kt, k );
+			if( maxComponent( kt ) < TRANSMITTANCE_CUTOFF ) {
+				kt = vec3f( 0.0, 0.0, 0.0 );
+				return false;
 			}
+
+			start += i.t;
+			r = ray( offsetRayOrigin( r.at( i.t ), i.N, d ), d, r.getTime() );
 		}
+		return true;
 	}
 
+	const ray& shadowRay;
+	double tMax;
+	vec3f kt;
+	const Geometry *blocker;
+};
 
-	return have_one;
+vec3f Scene::transmittance( const ray& r, double distance, const Geometry *&blocker ) const
+{
+	TransmittanceVisitor visitor( r, distance );
+
+	bool going = true;
+	for( cgiter j = nonboundedobjects.begin(); going && j != nonboundedobjects.end(); ++j ) {
+		going = visitor.visit( *j );
+	}
+	if( going && bvh ) {
+		bvh->visit( r, distance, visitor );
+	}
+
+	blocker = visitor.blocker;
+	return visitor.kt;
 }
 
 void Scene::initScene()
@@ -177,8 +350,14 @@ void Scene::initScene()
 	BoundingBox b;
 	
 	typedef list<Geometry*>::const_iterator iter;
+	motion = false;
 	// split the objects into two categories: bounded and non-bounded
 	for( iter j = objects.begin(); j != objects.end(); ++j ) {
+		if( (*j)->isMoving() )
+			motion = true;
+
+		(*j)->bakeTransform();
+
 		if( (*j)->hasBoundingBoxCapability() )
 		{
 			boundedobjects.push_back(*j);
@@ -198,4 +377,40 @@ void Scene::initScene()
 		else
 			nonboundedobjects.push_back(*j);
 	}
+
+	delete bvh;
+	bvh = new BVH;
+	bvh->build( boundedobjects );
+}
+
+void Scene::updateTransforms()
+{
+	bool first_boundedobject = true;
+	BoundingBox b;
+
+	typedef list<Geometry*>::const_iterator iter;
+	motion = false;
+	for( iter j = objects.begin(); j != objects.end(); ++j ) {
+		if( (*j)->hasMoved() ) {
+			(*j)->ComputeBoundingBox();
+			(*j)->bakeTransform();
+		}
+		if( (*j)->isMoving() )
+			motion = true;
+	}
+
+	for( iter j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
+		b = (*j)->getBoundingBox();
+		if (first_boundedobject) {
+			sceneBounds = b;
+			first_boundedobject = false;
+		} else {
+			sceneBounds.max = maximum(sceneBounds.max, b.max);
+			sceneBounds.min = minimum(sceneBounds.min, b.min);
+		}
+	}
+
+	transformRoot.clearChanged();
+	if( bvh )
+		bvh->refit();
 }
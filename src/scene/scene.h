@@ -8,6 +8,9 @@
 #define __SCENE_H__
 
 #include <list>
+#include <map>
+#include <vector>
+#include <string>
 #include <algorithm>
 
 using namespace std;
@@ -15,10 +18,14 @@ using namespace std;
 #include "ray.h"
 #include "material.h"
 #include "camera.h"
+#include "arena.h"
 #include "../vecmath/vecmath.h"
 
 class Light;
 class Scene;
+class BVH;
+class Prototype;
+class double4;
 
 class SceneElement
 {
@@ -63,26 +70,96 @@ protected:
 	mat4f    inverse;
 	mat3f    normi;
 
+	// A moving node goes from xform at time 0 to xform1 at time 1 (see
+	// ray::getTime), interpolating the matrices linearly in between.  That
+	// is exact for translation and scaling.  For a static node xform1 is
+	// the same as xform.
+	bool     moving;
+	mat4f    xform1;
+
+	// this node's own transformation, before its parent's is applied
+	mat4f    local;
+	mat4f    local1;
+
+	// local and local1 as the node was made, before any setTransform
+	mat4f    initial;
+	mat4f    initial1;
+
+	// set when the node or one of its ancestors is given a new
+	// transformation, until Scene::updateTransforms has caught up
+	bool     changed;
+
     // information about parent & children
     TransformNode *parent;
     list<TransformNode*> children;
+
+    // where the children are made, and which destroys them: the root's
+    Arena *arena;
     
 public:
    	typedef list<TransformNode*>::iterator          child_iter;
 	typedef list<TransformNode*>::const_iterator    child_citer;
 
-    ~TransformNode()
+    TransformNode *createChild(const mat4f& xform)
     {
-        for(child_iter c = children.begin(); c != children.end(); ++c )
-            delete (*c);
+        return createMovingChild(xform, xform);
     }
 
-    TransformNode *createChild(const mat4f& xform)
+    // a child that moves from xform0 at time 0 to xform1 at time 1
+    TransformNode *createMovingChild(const mat4f& xform0, const mat4f& xform1)
     {
-        TransformNode *child = new TransformNode(this, xform);
+        TransformNode *child = arena->own(new(*arena) TransformNode(this, xform0, xform1));
         children.push_back(child);
         return child;
     }
+
+    bool isMoving() const { return moving; }
+
+    // Replace this node's own transformation, moving everything under it.
+    // Nothing is recomputed for the objects until Scene::updateTransforms
+    // is called.
+    void setTransform(const mat4f& xform)
+    {
+        setTransform(xform, xform);
+    }
+
+    void setTransform(const mat4f& xform0, const mat4f& xform1)
+    {
+        local = xform0;
+        local1 = xform1;
+        update();
+    }
+
+    // the transformation the node was made with, which setTransform
+    // doesn't change: at time 0, and at time 1
+    const mat4f& getInitialTransform() const { return initial; }
+    const mat4f& getInitialEndTransform() const { return initial1; }
+
+    child_iter beginChildren() { return children.begin(); }
+    child_iter endChildren() { return children.end(); }
+
+    bool hasChanged() const { return changed; }
+
+    // forget the changes, here and below
+    void clearChanged()
+    {
+        changed = false;
+        for(child_iter c = children.begin(); c != children.end(); ++c )
+            (*c)->clearChanged();
+    }
+
+    const mat4f& getTransform() const { return xform; }
+    const mat4f& getInverse() const { return inverse; }
+    const mat3f& getNormalMatrix() const { return normi; }
+
+    // The global-to-local matrix and the normal matrix at time t, for
+    // moving nodes.
+    void getInverseAt(double t, mat4f& inv, mat3f& nrm) const
+    {
+        mat4f m = (1.0 - t) * xform + t * xform1;
+        inv = m.inverse();
+        nrm = m.upper33().inverse().transpose();
+    }
     
     // Coordinate-Space transformation
     vec3f globalToLocalCoords(const vec3f &v)
@@ -100,6 +177,12 @@ public:
         return xform * v;
     }
 
+    // where v is at the end of the shutter interval
+    vec4f localToGlobalCoordsEnd(const vec4f &v)
+    {
+        return xform1 * v;
+    }
+
     vec3f localToGlobalCoordsNormal(const vec3f &v)
     {
         return (normi * v).normalize();
@@ -109,27 +192,55 @@ protected:
     // protected so that users can't directly construct one of these...
     // force them to use the createChild() method.  Note that they CAN
     // directly create a TransformRoot object.
-    TransformNode(TransformNode *parent, const mat4f& xform )
+    TransformNode(TransformNode *parent, const mat4f& xform, const mat4f& xform1 )
         : children()
     {
         this->parent = parent;
+        arena = parent ? parent->arena : NULL;
+        local = initial = xform;
+        local1 = initial1 = xform1;
+        update();
+        changed = false;
+    }
+
+    // recompute the composed matrices, here and below
+    void update()
+    {
         if (parent == NULL)
-            this->xform = xform;
+        {
+            xform = local;
+            xform1 = local1;
+            moving = local != local1;
+        }
         else
-            this->xform = parent->xform * xform;
+        {
+            xform = parent->xform * local;
+            xform1 = parent->xform1 * local1;
+            moving = parent->moving || local != local1;
+        }
         
-        inverse = this->xform.inverse();
-        normi = this->xform.upper33().inverse().transpose();
+        inverse = xform.inverse();
+        normi = xform.upper33().inverse().transpose();
+        changed = true;
+
+        for(child_iter c = children.begin(); c != children.end(); ++c )
+            (*c)->update();
     }
 };
 
 class TransformRoot : public TransformNode
 {
 public:
-    TransformRoot()
-        : TransformNode(NULL, mat4f()) {}
+    // The nodes under it are placed in arena.
+    TransformRoot(Arena& arena)
+        : TransformNode(NULL, mat4f(), mat4f())
+    {
+        this->arena = &arena;
+    }
 };
 
+template <class T> struct IntersectCalls;
+
 // A Geometry object is anything that has extent in three dimensions.
 // It may not be an actual visible scene object.  For example, hierarchical
 // spatial subdivision could be expressed in terms of Geometry instances.
@@ -137,55 +248,102 @@ class Geometry
 	: public SceneElement
 {
 public:
-    // intersections performed in the global coordinate space.
+    // intersections performed in the global coordinate space.  A hit sets
+    // i.geometry to this.
     virtual bool intersect(const ray&r, isect&i) const;
     
     // intersections performed in the object's local coordinate space
     // do not call directly - this should only be called by intersect()
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
 
+	// intersect() for an object the caller knows is exactly a T, so that
+	// T's intersectLocal or intersectBaked is called directly rather than
+	// through the vtable.  Geometry::intersect is intersectAs<Geometry>;
+	// a subclass that overrides intersect itself must be called through it.
+	template <class T>
+	bool intersectAs( const ray& r, isect& i ) const
+	{
+		if( baked ) {
+			if( !IntersectCalls<T>::baked( this, r, i ) ) {
+				return false;
+			}
+			i.geometry = this;
+			return true;
+		}
+
+		ray localRay( r );
+		double length;
+		mat3f movedNormi;
+		const mat3f *normi = toLocal( r, localRay, length, movedNormi );
+
+		if( IntersectCalls<T>::local( this, localRay, i ) ) {
+			i.localP = localRay.at( i.t );
+
+			// take the normal back into global space
+			i.N = (*normi * i.N).normalize();
+			i.t /= length;
+			i.geometry = this;
+			return true;
+		}
+		return false;
+	}
+
+	// Some objects under a simple enough transform can be intersected in
+	// world space, without taking the ray to local coordinates and the
+	// normal back.  bakeTransform decides, after the object's transform is
+	// set or changed, and keeps what intersectBaked needs; intersect then
+	// calls intersectBaked instead, which must also set i.localP.
+	virtual void bakeTransform() {}
+	virtual bool intersectBaked( const ray& r, isect& i ) const { return false; }
+
+	// texture coordinates of a point on the surface, in local coordinates.
+	// Objects without a natural parameterization map everything to (0,0).
+	virtual void getUV( const vec3f& P, double& u, double& v ) const;
 
 	virtual bool hasBoundingBoxCapability() const;
 	const BoundingBox& getBoundingBox() const { return bounds; }
+	const BoundingBox& getStartBoundingBox() const { return startBounds; }
+	const BoundingBox& getEndBoundingBox() const { return endBounds; }
+	// The world bounding box of part, the object a hit on this one found:
+	// this itself, or for an instance one of its prototype's objects.
+	virtual BoundingBox getPartBounds( const Geometry *part ) const { return part->getBoundingBox(); }
+	bool isMoving() const { return transform->isMoving(); }
+	bool hasMoved() const { return transform->hasChanged(); }
 	virtual void ComputeBoundingBox()
     {
         // take the object's local bounding box, transform all 8 points on it,
-        // and use those to find a new bounding box.
+        // and use those to find a new bounding box.  A moving object gets
+        // one box where it starts and one where it ends; in between it is
+        // inside their interpolation, since the points move linearly.
+        // bounds covers both.
 
         BoundingBox localBounds = ComputeLocalBoundingBox();
         
         vec3f min = localBounds.min;
 		vec3f max = localBounds.max;
 
-		vec4f v, newMax, newMin;
-
-		v = transform->localToGlobalCoords( vec4f(min[0], min[1], min[2], 1) );
-		newMax = v;
-		newMin = v;
-		v = transform->localToGlobalCoords( vec4f(max[0], min[1], min[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(min[0], max[1], min[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(max[0], max[1], min[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(min[0], min[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(max[0], min[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(min[0], max[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(max[0], max[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
+		vec4f v, newMax, newMin, endMax, endMin;
+
+		for (int k = 0; k < 8; ++k)
+		{
+			vec4f corner( (k & 1) ? max[0] : min[0], (k & 2) ? max[1] : min[1],
+				(k & 4) ? max[2] : min[2], 1 );
+
+			v = transform->localToGlobalCoords( corner );
+			newMax = (k == 0) ? v : maximum(newMax, v);
+			newMin = (k == 0) ? v : minimum(newMin, v);
+
+			v = transform->localToGlobalCoordsEnd( corner );
+			endMax = (k == 0) ? v : maximum(endMax, v);
+			endMin = (k == 0) ? v : minimum(endMin, v);
+		}
 		
-		bounds.max = vec3f(newMax);
-		bounds.min = vec3f(newMin);
+		startBounds.max = vec3f(newMax);
+		startBounds.min = vec3f(newMin);
+		endBounds.max = vec3f(endMax);
+		endBounds.min = vec3f(endMin);
+		bounds.max = maximum(startBounds.max, endBounds.max);
+		bounds.min = minimum(startBounds.min, endBounds.min);
     }
 
     // default method for ComputeLocalBoundingBox returns a bogus bounding box;
@@ -195,13 +353,52 @@ public:
     void setTransform(TransformNode *transform) { this->transform = transform; };
     
 	Geometry( Scene *scene ) 
-		: SceneElement( scene ) {}
+		: SceneElement( scene ), baked( false ) {}
 
 protected:
+	// r in local coordinates, with a unit direction; t along it is length
+	// times t along r.  Returns the matrix that takes local normals back to
+	// global ones, which is kept in movedNormi if the object is moving.
+	const mat3f *toLocal(const ray& r, ray& localRay, double& length, mat3f& movedNormi) const;
+
+	// toLocal for the n <= 4 objects in objs at once, a lane each (see
+	// double4.h): the local origins p and directions d, by coordinate, and
+	// the lengths.  Lanes past n repeat the first object.
+	static void toLocal4( Geometry *const *objs, int n, const ray& r,
+		double4 p[3], double4 d[3], double4& length );
+
+	// If the object doesn't move and its transform only scales along the
+	// axes and translates, the scale and the translation.
+	bool getAxisAlignedTransform(vec3f& scale, vec3f& offset) const;
+
+	bool baked;                 // intersect with intersectBaked
+
 	BoundingBox bounds;
+	BoundingBox startBounds;
+	BoundingBox endBounds;
     TransformNode *transform;
 };
 
+// How Geometry::intersectAs<T> calls T's tests: by their qualified names,
+// so the calls are direct, or for T = Geometry through the vtable.
+template <class T>
+struct IntersectCalls
+{
+	static bool local( const Geometry *g, const ray& r, isect& i )
+	{ return static_cast<const T*>( g )->T::intersectLocal( r, i ); }
+	static bool baked( const Geometry *g, const ray& r, isect& i )
+	{ return static_cast<const T*>( g )->T::intersectBaked( r, i ); }
+};
+
+template <>
+struct IntersectCalls<Geometry>
+{
+	static bool local( const Geometry *g, const ray& r, isect& i )
+	{ return g->intersectLocal( r, i ); }
+	static bool baked( const Geometry *g, const ray& r, isect& i )
+	{ return g->intersectBaked( r, i ); }
+};
+
 // A SceneObject is a real actual thing that we want to model in the 
 // world.  It has extent (its Geometry heritage) and surface properties
 // (its material binding).  The decision of how to store that material
@@ -211,7 +408,9 @@ class SceneObject
 {
 public:
 	virtual const Material& getMaterial() const = 0;
-	virtual void setMaterial( Material *m ) = 0;
+	// the material's index in the scene's table (see Scene::addMaterial)
+	virtual int getMaterialId() const = 0;
+	virtual void setMaterial( int id ) = 0;
 	virtual bool hasInterior() const = 0;
 	virtual int getOrder() const = 0;
 	virtual void setOrder(int ord) = 0;
@@ -221,27 +420,28 @@ protected:
 		: Geometry( scene ) {}
 };
 
-// A simple extension of SceneObject that adds an instance of Material
-// for simple material bindings.
+// A simple extension of SceneObject that adds a material from the
+// scene's table for simple material bindings.
 class MaterialSceneObject
 	: public SceneObject
 {
 public:
-	virtual ~MaterialSceneObject() { if( material ) delete material; }
-
-	virtual const Material& getMaterial() const { return *material; }
-	virtual void setMaterial( Material *m )	{ material = m; }
+	virtual const Material& getMaterial() const;
+	virtual int getMaterialId() const { return material; }
+	virtual void setMaterial( int id )	{ material = id; }
 	virtual bool hasInterior() const{ return true; }
 	virtual void setOrder(int ord){ order = ord; }
 	virtual int getOrder() const { return order; }
 
 protected:
-	MaterialSceneObject( Scene *scene, Material *mat ) 
+	MaterialSceneObject( Scene *scene, int mat ) 
 		: SceneObject( scene ), material( mat ) {}
     //	MaterialSceneObject( Scene *scene ) 
 	//	: SceneObject( scene ), material( new Material ) {}
 
-	Material *material;
+	// index in the scene's material table, shared with every other object
+	// that has an equal material
+	int material;
 	int order;
 };
 
@@ -254,11 +454,18 @@ public:
 	typedef list<Geometry*>::iterator 		giter;
 	typedef list<Geometry*>::const_iterator cgiter;
 
+private:
+	// Everything the scene is made of: objects, transformations,
+	// materials and prototypes.  It comes first so that it is there for
+	// transformRoot.
+	Arena arena;
+
+public:
     TransformRoot transformRoot;
 
 public:
 	Scene() 
-		: transformRoot(), objects(), lights(), currentOrder(0) {}
+		: arena(), transformRoot( arena ), objects(), lights(), currentOrder(0), motion(false), watertight(false), bvh(NULL) {}
 	virtual ~Scene();
 
 	void add( Geometry* obj )
@@ -270,10 +477,33 @@ public:
 	{ lights.push_back( light ); }
 
 	bool intersect( const ray& r, isect& i ) const;
+
+	// How much light, per channel, gets along r to its origin past every
+	// surface closer than distance: the product of their kt.  All of them
+	// are found in one traversal, and it stops at anything opaque, which
+	// is returned in blocker (NULL if there is none), or once too little
+	// is left to matter.
+	vec3f transmittance( const ray& r, double distance, const Geometry *&blocker ) const;
+
 	void initScene();
 
+	// After TransformNode::setTransform: recompute the bounds of the
+	// objects that moved and refit the BVH to them, rebuilding it only if
+	// the refitted tree has got too much worse.
+	void updateTransforms();
+
 	list<Light*>::const_iterator beginLights() const { return lights.begin(); }
 	list<Light*>::const_iterator endLights() const { return lights.end(); }
+	int getNumLights() const { return lights.size(); }
+
+	// does anything move during the shutter interval?  (set by initScene)
+	bool hasMotion() const { return motion; }
+
+	// Are triangles intersected with the watertight test?  Set from the UI
+	// once per render (see RayTracer::traceSetup), so that the triangle
+	// test reads a flag rather than asking the UI.
+	void setWatertight( bool on ) { watertight = on; }
+	bool isWatertight() const { return watertight; }
         
 	Camera *getCamera() { return &camera; }
 
@@ -281,19 +511,67 @@ public:
 		obj->setOrder(++currentOrder);
 	}
 
+	// The material table.  Equal materials are stored once, and objects
+	// refer to them by their index in it.  Returns the index of m's copy,
+	// adding one if there isn't one yet.
+	int addMaterial( const Material& m );
+	const Material& getMaterial( int id ) const { return *materials[ id ]; }
+	int getNumMaterials() const { return materials.size(); }
+
+	// Where the things the scene is made of are allocated (see arena.h),
+	// so that they are all freed together with the scene.
+	Arena& getArena() { return arena; }
+
+	// Named prototypes for Instances to share (see instance.h).  They
+	// belong to the arena.
+	void addPrototype( const string& name, Prototype *proto );
+	Prototype *getPrototype( const string& name ) const;
+
+	// Take the objects added since there were 'first' of them back out
+	// of the scene, to be given to a Prototype.
+	int getNumObjects() const { return objects.size(); }
+	void removeObjects( int first, list<Geometry*>& removed );
+
+	// The files the scene file names, textures and spheres, that it was
+	// read from as well.
+	void addInputFile( const string& name ) { inputFiles.push_back( name ); }
+	const vector<string>& getInputFiles() const { return inputFiles; }
+
 	
 
 private:
+	// orders materials by their contents, so that equal ones are found
+	struct MaterialLess
+	{
+		bool operator()( const Material *a, const Material *b ) const;
+	};
+
+	vector<Material*> materials;    // in the arena
+	map<const Material*, int, MaterialLess> materialIds;
+
     list<Geometry*> objects;
 	list<Geometry*> nonboundedobjects;
 	list<Geometry*> boundedobjects;
     list<Light*> lights;
+    map<string, Prototype*> prototypes;
+	vector<string> inputFiles;
     Camera camera;
 	int currentOrder;
 	// Each object in the scene, provided that it has hasBoundingBoxCapability(),
 	// must fall within this bounding box.  Objects that don't have hasBoundingBoxCapability()
 	// are exempt from this requirement.
 	BoundingBox sceneBounds;
+
+	bool motion;
+	bool watertight;
+
+	// the bounded objects, built by initScene
+	BVH *bvh;
 };
 
+inline const Material& MaterialSceneObject::getMaterial() const
+{
+	return scene->getMaterial( material );
+}
+
 #endif // __SCENE_H__
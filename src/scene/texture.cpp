@@ -0,0 +1,300 @@
+#include <cmath>
+
+#include "texture.h"
+#include "../fileio/bitmap.h"
+
+// Default memory budget for the texture cache: 256 MB.
+static const size_t DEFAULT_TEXTURE_BUDGET = 256 * 1024 * 1024;
+
+void Texture::Level::resize( int w, int h )
+{
+	width = w;
+	height = h;
+	tilesX = (w + TILE_MASK) >> TILE_SHIFT;
+	int tilesY = (h + TILE_MASK) >> TILE_SHIFT;
+	data.assign( tilesX * tilesY * TILE_SIZE * TILE_SIZE * 3, 0.0f );
+}
+
+Texture::Texture( const unsigned char *data, int width, int height )
+{
+	// level 0 is the image itself, converted to float once here rather
+	// than divided by 255 on every lookup
+	levels.push_back( Level() );
+	levels[0].resize( width, height );
+	for( int y = 0; y < height; ++y ) {
+		for( int x = 0; x < width; ++x ) {
+			const unsigned char *in = data + (y * width + x) * 3;
+			float *out = &levels[0].data[ levels[0].index( x, y ) ];
+			out[0] = in[0] / 255.0f;
+			out[1] = in[1] / 255.0f;
+			out[2] = in[2] / 255.0f;
+		}
+	}
+
+	buildMipmaps();
+}
+
+Texture::Texture( const float *data, int width, int height )
+{
+	levels.push_back( Level() );
+	levels[0].resize( width, height );
+	for( int y = 0; y < height; ++y ) {
+		for( int x = 0; x < width; ++x ) {
+			const float *in = data + (y * width + x) * 3;
+			float *out = &levels[0].data[ levels[0].index( x, y ) ];
+			out[0] = in[0];
+			out[1] = in[1];
+			out[2] = in[2];
+		}
+	}
+
+	buildMipmaps();
+}
+
+void Texture::buildMipmaps()
+{
+	// each further level is a 2x2 box filter of the one before, down to 1x1.
+	// Odd sizes round down and fold the last row/column into their neighbour.
+	while( levels.back().width > 1 || levels.back().height > 1 ) {
+		levels.push_back( Level() );
+		const Level& src = levels[ levels.size() - 2 ];
+		Level& dst = levels.back();
+		dst.resize( max( src.width / 2, 1 ), max( src.height / 2, 1 ) );
+
+		for( int y = 0; y < dst.height; ++y ) {
+			int y0 = 2 * y;
+			int y1 = (y == dst.height - 1) ? src.height - 1 : min( 2 * y + 1, src.height - 1 );
+			for( int x = 0; x < dst.width; ++x ) {
+				int x0 = 2 * x;
+				int x1 = (x == dst.width - 1) ? src.width - 1 : min( 2 * x + 1, src.width - 1 );
+
+				float *out = &dst.data[ dst.index( x, y ) ];
+				int n = 0;
+				for( int sy = y0; sy <= y1; ++sy ) {
+					for( int sx = x0; sx <= x1; ++sx ) {
+						const float *in = &src.data[ src.index( sx, sy ) ];
+						out[0] += in[0];
+						out[1] += in[1];
+						out[2] += in[2];
+						++n;
+					}
+				}
+				out[0] /= n;
+				out[1] /= n;
+				out[2] /= n;
+			}
+		}
+	}
+}
+
+size_t Texture::getMemoryUsage() const
+{
+	size_t bytes = 0;
+	for( size_t k = 0; k < levels.size(); ++k ) {
+		bytes += levels[k].data.size() * sizeof( float );
+	}
+	return bytes;
+}
+
+vec3f Texture::sample( double u, double v, double footprint ) const
+{
+	if( u < 0 || u >= 1 || v < 0 || v >= 1 ) {
+		return vec3f( 0.0, 0.0, 0.0 );
+	}
+
+	// footprint in level 0 texels, then in levels
+	double texels = footprint * max( getWidth(), getHeight() );
+	if( texels <= 1.0 ) {
+		return bilinear( levels[0], u, v );
+	}
+
+	double lod = log( texels ) / log( 2.0 );
+	int last = levels.size() - 1;
+	if( lod >= last ) {
+		return bilinear( levels[last], u, v );
+	}
+
+	int l0 = int( lod );
+	double f = lod - l0;
+	return (1.0 - f) * bilinear( levels[l0], u, v ) + f * bilinear( levels[l0 + 1], u, v );
+}
+
+vec3f Texture::bilinear( const Level& level, double u, double v ) const
+{
+	// texel centers are at half-integer coordinates
+	double px = u * level.width - 0.5;
+	double py = v * level.height - 0.5;
+	int x0 = int( floor( px ) );
+	int y0 = int( floor( py ) );
+	double fx = px - x0;
+	double fy = py - y0;
+
+	// clamp the taps to the edge of the image
+	int x1 = min( x0 + 1, level.width - 1 );
+	int y1 = min( y0 + 1, level.height - 1 );
+	x0 = max( x0, 0 );
+	y0 = max( y0, 0 );
+
+	const float *c00 = &level.data[ level.index( x0, y0 ) ];
+	const float *c10 = &level.data[ level.index( x1, y0 ) ];
+	const float *c01 = &level.data[ level.index( x0, y1 ) ];
+	const float *c11 = &level.data[ level.index( x1, y1 ) ];
+
+	vec3f ret;
+	for( int k = 0; k < 3; ++k ) {
+		double top = c00[k] + fx * (c10[k] - c00[k]);
+		double bottom = c01[k] + fx * (c11[k] - c01[k]);
+		ret[k] = top + fy * (bottom - top);
+	}
+	return ret;
+}
+
+TextureCache& TextureCache::instance()
+{
+	static TextureCache cache;
+	return cache;
+}
+
+TextureCache::TextureCache()
+	: resident( 0 ), budget( DEFAULT_TEXTURE_BUDGET ), frame( 0 )
+{
+}
+
+TextureCache::~TextureCache()
+{
+	for( map<string, Entry*>::iterator i = entries.begin(); i != entries.end(); ++i ) {
+		delete i->second->texture;
+		delete i->second;
+	}
+}
+
+TextureCache::Entry *TextureCache::acquire( const string& filename )
+{
+	Entry *entry;
+	map<string, Entry*>::iterator i = entries.find( filename );
+	if( i != entries.end() ) {
+		entry = i->second;
+	} else {
+		entry = new Entry;
+		entry->filename = filename;
+		entry->texture = NULL;
+		entry->bytes = 0;
+		entry->refs = 0;
+		entry->failed = false;
+		entry->lastFrame = -1;
+		entries[ filename ] = entry;
+	}
+	++entry->refs;
+	return entry;
+}
+
+void TextureCache::release( Entry *entry )
+{
+	// Unreferenced textures stay resident, so that a scene loaded again
+	// soon after finds them here; evict() forgets them when it needs room.
+	// An entry with nothing resident, one evicted or whose file couldn't
+	// be read, is forgotten now: nothing else would free it, and the next
+	// scene to use the file should try reading it again.
+	if( --entry->refs == 0 && !entry->texture ) {
+		entries.erase( entry->filename );
+		delete entry;
+	}
+}
+
+void TextureCache::beginFrame()
+{
+	++frame;
+	evict();
+}
+
+const Texture *TextureCache::get( Entry *entry )
+{
+	entry->lastFrame = frame;
+	if( entry->texture ) {
+		// move to the front of the LRU list
+		lru.splice( lru.begin(), lru, entry->lruPos );
+		return entry->texture;
+	}
+	if( entry->failed ) {
+		return NULL;
+	}
+
+	int width, height;
+	unsigned char *data = readBMP( const_cast<char*>( entry->filename.c_str() ), width, height );
+	if( !data ) {
+		entry->failed = true;
+		return NULL;
+	}
+	entry->texture = new Texture( data, width, height );
+	delete [] data;
+
+	entry->bytes = entry->texture->getMemoryUsage();
+	resident += entry->bytes;
+	lru.push_front( entry );
+	entry->lruPos = lru.begin();
+
+	evict();
+	return entry->texture;
+}
+
+// Drop a resident texture's data.
+void TextureCache::unload( Entry *entry )
+{
+	lru.erase( entry->lruPos );
+	resident -= entry->bytes;
+	delete entry->texture;
+	entry->texture = NULL;
+	entry->bytes = 0;
+}
+
+// Unload least recently used textures until we're within budget, or only
+// ones used in this frame are left.  Those are all at the front of the
+// list, since each lookup moves its texture there.
+void TextureCache::evict()
+{
+	while( resident > budget && lru.back()->lastFrame != frame ) {
+		Entry *victim = lru.back();
+		unload( victim );
+		if( victim->refs == 0 ) {
+			entries.erase( victim->filename );
+			delete victim;
+		}
+	}
+}
+
+TextureRef::TextureRef( const string& filename )
+	: entry( TextureCache::instance().acquire( filename ) )
+{
+}
+
+TextureRef::TextureRef( const TextureRef& other )
+	: entry( other.entry )
+{
+	if( entry ) {
+		++entry->refs;
+	}
+}
+
+TextureRef::~TextureRef()
+{
+	if( entry ) {
+		TextureCache::instance().release( entry );
+	}
+}
+
+TextureRef& TextureRef::operator =( const TextureRef& other )
+{
+	if( other.entry ) {
+		++other.entry->refs;
+	}
+	if( entry ) {
+		TextureCache::instance().release( entry );
+	}
+	entry = other.entry;
+	return *this;
+}
+
+const Texture *TextureRef::get() const
+{
+	return entry ? TextureCache::instance().get( entry ) : NULL;
+}
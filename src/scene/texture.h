@@ -0,0 +1,157 @@
+//
+// texture.h
+//
+// Filtered image textures.  An image is converted once, when it is loaded,
+// into a pyramid of float RGB mip-map levels.  Each level is stored in
+// 8x8 texel tiles so that the texels a lookup touches share cache lines.
+//
+// Textures loaded from files are shared through the TextureCache and held
+// by TextureRef handles.
+//
+
+#ifndef __TEXTURE_H__
+#define __TEXTURE_H__
+
+#include <vector>
+#include <string>
+#include <list>
+#include <map>
+
+#include "../vecmath/vecmath.h"
+
+using namespace std;
+
+class Texture
+{
+public:
+	// data is 24-bit RGB in row-major order, as returned by readBMP.
+	Texture( const unsigned char *data, int width, int height );
+	// the same, with components already in [0,1]
+	Texture( const float *data, int width, int height );
+
+	int getWidth() const { return levels[0].width; }
+	int getHeight() const { return levels[0].height; }
+	int getNumLevels() const { return levels.size(); }
+
+	// bytes of texel data held by all the levels
+	size_t getMemoryUsage() const;
+
+	// Color at (u,v), both in [0,1), averaged over an area about
+	// 'footprint' wide in the same units.  The mip level is picked from the
+	// footprint and the two nearest levels are blended (trilinear
+	// filtering).  A footprint of 0 gives a bilinear lookup in the full
+	// resolution image.  Lookups outside [0,1) are black.
+	vec3f sample( double u, double v, double footprint ) const;
+
+private:
+	static const int TILE_SHIFT = 3;
+	static const int TILE_SIZE = 1 << TILE_SHIFT;
+	static const int TILE_MASK = TILE_SIZE - 1;
+
+	struct Level
+	{
+		int width;
+		int height;
+		int tilesX;
+		vector<float> data;
+
+		// index of the red component of texel (x,y)
+		int index( int x, int y ) const
+		{
+			int tile = (y >> TILE_SHIFT) * tilesX + (x >> TILE_SHIFT);
+			int texel = ((y & TILE_MASK) << TILE_SHIFT) | (x & TILE_MASK);
+			return ((tile << (2 * TILE_SHIFT)) | texel) * 3;
+		}
+
+		void resize( int w, int h );
+	};
+
+	void buildMipmaps();
+
+	vec3f bilinear( const Level& level, double u, double v ) const;
+
+	vector<Level> levels;
+};
+
+// All the image textures in use, one copy per file no matter how many
+// materials refer to it.  Entries are reference counted by TextureRef.
+// Resident textures are kept in least-recently-used order; when loading one
+// pushes the total over the memory budget, the least recently used ones are
+// dropped from memory.  A dropped texture that is still referenced is simply
+// read again the next time it is looked up, and one that isn't is forgotten.
+//
+// Textures looked up since the current frame began are never dropped: a
+// frame whose textures don't all fit goes over the budget instead of
+// reading the same files again for every other sample.  The excess is
+// dropped when the next frame begins.
+class TextureCache
+{
+public:
+	static TextureCache& instance();
+
+	~TextureCache();
+
+	void setBudget( size_t bytes ) { budget = bytes; }
+	size_t getBudget() const { return budget; }
+	size_t getResidentBytes() const { return resident; }
+
+	// A new frame (or image) is about to be rendered.
+	void beginFrame();
+
+private:
+	friend class TextureRef;
+
+	struct Entry
+	{
+		string filename;
+		Texture *texture;       // NULL when not resident
+		size_t bytes;
+		int refs;
+		bool failed;            // the file couldn't be read; not retried
+		                        // while any handle holds the entry
+		int lastFrame;          // the frame it was last looked up in
+		list<Entry*>::iterator lruPos;
+	};
+
+	TextureCache();
+
+	Entry *acquire( const string& filename );
+	void release( Entry *entry );
+	const Texture *get( Entry *entry );
+	void unload( Entry *entry );
+	void evict();
+
+	map<string, Entry*> entries;
+	list<Entry*> lru;           // resident textures, most recently used first
+	size_t resident;
+	size_t budget;
+	int frame;
+};
+
+// Counted handle to a texture in the TextureCache, by file name.  Copying a
+// handle shares the texture.
+class TextureRef
+{
+public:
+	TextureRef() : entry( NULL ) {}
+	explicit TextureRef( const string& filename );
+	TextureRef( const TextureRef& other );
+	~TextureRef();
+
+	TextureRef& operator =( const TextureRef& other );
+
+	bool isNull() const { return entry == NULL; }
+
+	// Orders handles by the texture they share, without loading it.
+	bool operator <( const TextureRef& other ) const { return entry < other.entry; }
+
+	// The texture, loaded if it isn't resident, or NULL if the file can't be
+	// read.  The pointer is only good until the next get() on any handle,
+	// since that may evict it.
+	const Texture *get() const;
+
+private:
+	TextureCache::Entry *entry;
+};
+
+#endif // __TEXTURE_H__
@@ -152,6 +152,21 @@ void TraceUI::cb_thresholdSlides(Fl_Widget* o, void* v)
 	pUI->m_dThreshold=double( ((Fl_Slider *)o)->value() ) ;
 }
 
+void TraceUI::cb_glossySamplesSlides(Fl_Widget* o, void* v)
+{
+	((TraceUI*)(o->user_data()))->m_nGlossySamples=int( ((Fl_Slider *)o)->value() ) ;
+}
+
+void TraceUI::cb_lightSamplesSlides(Fl_Widget* o, void* v)
+{
+	((TraceUI*)(o->user_data()))->m_nLightSamples=int( ((Fl_Slider *)o)->value() ) ;
+}
+
+void TraceUI::cb_blurSamplesSlides(Fl_Widget* o, void* v)
+{
+	((TraceUI*)(o->user_data()))->m_nBlurSamples=int( ((Fl_Slider *)o)->value() ) ;
+}
+
 void TraceUI::cb_depthSlides(Fl_Widget* o, void* v)
 {
 	((TraceUI*)(o->user_data()))->m_nDepth=int( ((Fl_Slider *)o)->value() ) ;
@@ -177,6 +192,16 @@ void TraceUI::cb_glossySwitch(Fl_Widget* o, void* v)
 	((TraceUI*)(o->user_data()))->m_bIsEnableGlossy ^= true;
 }
 
+void TraceUI::cb_watertightSwitch(Fl_Widget* o, void* v)
+{
+	((TraceUI*)(o->user_data()))->m_bIsEnableWatertight ^= true;
+}
+
+void TraceUI::cb_rouletteSwitch(Fl_Widget* o, void* v)
+{
+	((TraceUI*)(o->user_data()))->m_bIsEnableRoulette ^= true;
+}
+
 void TraceUI::cb_render(Fl_Widget* o, void* v)
 {
 	char buffer[256];
@@ -320,6 +345,21 @@ double TraceUI::getThreshold()
 	return m_dThreshold;
 }
 
+int TraceUI::getGlossySamples()
+{
+	return m_nGlossySamples;
+}
+
+int TraceUI::getLightSamples()
+{
+	return m_nLightSamples;
+}
+
+int TraceUI::getBlurSamples()
+{
+	return m_nBlurSamples;
+}
+
 bool TraceUI::isEnableFresnel()
 {
 	return m_bIsEnableFresnel;
@@ -339,6 +379,16 @@ bool TraceUI::isEnableGlossy()
 {
 	return m_bIsEnableGlossy;
 }
+
+bool TraceUI::isEnableWatertight()
+{
+	return m_bIsEnableWatertight;
+}
+
+bool TraceUI::isEnableRoulette()
+{
+	return m_bIsEnableRoulette;
+}
 // menu definition
 Fl_Menu_Item TraceUI::menuitems[] = {
 	{ "&File",		0, 0, 0, FL_SUBMENU },
@@ -368,11 +418,16 @@ TraceUI::TraceUI() {
 	m_nDistance = 1.87;
 	m_nAntialiasingSize = 0;
 	m_dThreshold = 0.0;
+	m_nGlossySamples = 8;
+	m_nLightSamples = 0;
+	m_nBlurSamples = 16;
 	m_bIsEnableFresnel = false;
 	m_bIsEnableJittering = false;
 	m_bIsEnableTextureMapping = false;
 	m_bIsEnableGlossy = false;
-	m_mainWindow = new Fl_Window(100, 40, 400, 350, "Ray <Not Loaded>");
+	m_bIsEnableWatertight = false;
+	m_bIsEnableRoulette = false;
+	m_mainWindow = new Fl_Window(100, 40, 400, 425, "Ray <Not Loaded>");
 		m_mainWindow->user_data((void*)(this));	// record self to be used by static callback functions
 		// install menu bar
 		m_menubar = new Fl_Menu_Bar(0, 0, 320, 25);
@@ -508,6 +563,45 @@ TraceUI::TraceUI() {
 		m_ThresholdSlider->align(FL_ALIGN_RIGHT);
 		m_ThresholdSlider->callback(cb_thresholdSlides);
 
+		// install slider glossy samples
+		m_GlossySamplesSlider = new Fl_Value_Slider(10, 280, 180, 20, "Glossy Samples");
+		m_GlossySamplesSlider->user_data((void*)(this));	// record self to be used by static callback functions
+		m_GlossySamplesSlider->type(FL_HOR_NICE_SLIDER);
+        m_GlossySamplesSlider->labelfont(FL_COURIER);
+        m_GlossySamplesSlider->labelsize(12);
+		m_GlossySamplesSlider->minimum(1);
+		m_GlossySamplesSlider->maximum(64);
+		m_GlossySamplesSlider->step(1);
+		m_GlossySamplesSlider->value(m_nGlossySamples);
+		m_GlossySamplesSlider->align(FL_ALIGN_RIGHT);
+		m_GlossySamplesSlider->callback(cb_glossySamplesSlides);
+
+		// install slider light samples (0 means shade every light)
+		m_LightSamplesSlider = new Fl_Value_Slider(10, 305, 180, 20, "Light Samples");
+		m_LightSamplesSlider->user_data((void*)(this));	// record self to be used by static callback functions
+		m_LightSamplesSlider->type(FL_HOR_NICE_SLIDER);
+        m_LightSamplesSlider->labelfont(FL_COURIER);
+        m_LightSamplesSlider->labelsize(12);
+		m_LightSamplesSlider->minimum(0);
+		m_LightSamplesSlider->maximum(64);
+		m_LightSamplesSlider->step(1);
+		m_LightSamplesSlider->value(m_nLightSamples);
+		m_LightSamplesSlider->align(FL_ALIGN_RIGHT);
+		m_LightSamplesSlider->callback(cb_lightSamplesSlides);
+
+		// install slider blur samples (per pixel, for depth of field and motion blur)
+		m_BlurSamplesSlider = new Fl_Value_Slider(10, 330, 180, 20, "Blur Samples");
+		m_BlurSamplesSlider->user_data((void*)(this));	// record self to be used by static callback functions
+		m_BlurSamplesSlider->type(FL_HOR_NICE_SLIDER);
+        m_BlurSamplesSlider->labelfont(FL_COURIER);
+        m_BlurSamplesSlider->labelsize(12);
+		m_BlurSamplesSlider->minimum(1);
+		m_BlurSamplesSlider->maximum(64);
+		m_BlurSamplesSlider->step(1);
+		m_BlurSamplesSlider->value(m_nBlurSamples);
+		m_BlurSamplesSlider->align(FL_ALIGN_RIGHT);
+		m_BlurSamplesSlider->callback(cb_blurSamplesSlides);
+
 
 		m_renderButton = new Fl_Button(240, 27, 70, 25, "&Render");
 		m_renderButton->user_data((void*)(this));
@@ -517,26 +611,36 @@ TraceUI::TraceUI() {
 		m_stopButton->user_data((void*)(this));
 		m_stopButton->callback(cb_stop);
 
-		m_fresnelSwitch = new Fl_Light_Button(10, 280, 70, 25, "Fresnel");
+		m_fresnelSwitch = new Fl_Light_Button(10, 355, 70, 25, "Fresnel");
 		m_fresnelSwitch->user_data((void*)(this));
 		m_fresnelSwitch->value();
 		m_fresnelSwitch->callback(cb_fresnelSwitch);
 
-		m_jitteringSwitch = new Fl_Light_Button(10, 305, 70, 25, "Jittering");
+		m_jitteringSwitch = new Fl_Light_Button(10, 380, 70, 25, "Jittering");
 		m_jitteringSwitch->user_data((void*)(this));
 		m_jitteringSwitch->value(0);
 		m_jitteringSwitch->callback(cb_jitteringSwitch);
 
-		m_textureMappingSwitch = new Fl_Light_Button(80, 280, 70, 25, "Texture");
+		m_textureMappingSwitch = new Fl_Light_Button(80, 355, 70, 25, "Texture");
 		m_textureMappingSwitch->user_data((void*)(this));
 		m_textureMappingSwitch->value(0);
 		m_textureMappingSwitch->callback(cb_textureMappingSwitch);
 
-		m_glossySwitch = new Fl_Light_Button(80, 305, 70, 25, "Glossy");
+		m_glossySwitch = new Fl_Light_Button(80, 380, 70, 25, "Glossy");
 		m_glossySwitch->user_data((void*)(this));
 		m_glossySwitch->value(0);
 		m_glossySwitch->callback(cb_glossySwitch);
 
+		m_watertightSwitch = new Fl_Light_Button(150, 355, 90, 25, "Watertight");
+		m_watertightSwitch->user_data((void*)(this));
+		m_watertightSwitch->value(0);
+		m_watertightSwitch->callback(cb_watertightSwitch);
+
+		m_rouletteSwitch = new Fl_Light_Button(150, 380, 90, 25, "Roulette");
+		m_rouletteSwitch->user_data((void*)(this));
+		m_rouletteSwitch->value(0);
+		m_rouletteSwitch->callback(cb_rouletteSwitch);
+
 		m_mainWindow->callback(cb_exit2);
 		m_mainWindow->when(FL_HIDE);
     m_mainWindow->end();
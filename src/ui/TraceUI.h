@@ -36,6 +36,9 @@ public:
 	Fl_Slider* 			m_DistanceSlider;
 	Fl_Slider* 			m_AntialiasingSlider;
 	Fl_Slider* 			m_ThresholdSlider;
+	Fl_Slider* 			m_GlossySamplesSlider;
+	Fl_Slider* 			m_LightSamplesSlider;
+	Fl_Slider* 			m_BlurSamplesSlider;
 
 	Fl_Button*			m_renderButton;
 	Fl_Button*			m_stopButton;
@@ -44,6 +47,8 @@ public:
 	Fl_Light_Button* 	m_jitteringSwitch;
 	Fl_Light_Button* 	m_textureMappingSwitch;
 	Fl_Light_Button* 	m_glossySwitch;
+	Fl_Light_Button* 	m_watertightSwitch;
+	Fl_Light_Button* 	m_rouletteSwitch;
 
 	TraceGLWindow*		m_traceGlWindow;
 
@@ -62,10 +67,15 @@ public:
 	double		getDistance();
 	int 		getAntialiasingSize();
 	double 		getThreshold();
+	int 		getGlossySamples();
+	int 		getLightSamples();
+	int 		getBlurSamples();
 	bool 		isEnableFresnel();
 	bool 		isEnableJittering();
 	bool		isEnableTextureMapping();
 	bool 		isEnableGlossy();
+	bool 		isEnableWatertight();
+	bool 		isEnableRoulette();
 
 private:
 	RayTracer*	raytracer;
@@ -80,10 +90,15 @@ private:
 	double 		m_nDistance;
 	int 		m_nAntialiasingSize;
 	double 		m_dThreshold;
+	int 		m_nGlossySamples;
+	int 		m_nLightSamples;
+	int 		m_nBlurSamples;
 	bool 		m_bIsEnableFresnel;
 	bool 		m_bIsEnableJittering;
 	bool 		m_bIsEnableTextureMapping;
 	bool 		m_bIsEnableGlossy;
+	bool 		m_bIsEnableWatertight;
+	bool 		m_bIsEnableRoulette;
 
 // static class members
 	static Fl_Menu_Item menuitems[];
@@ -109,10 +124,15 @@ private:
 	static void cb_distanceSlides(Fl_Widget* o, void* v);
 	static void cb_antialiasingSlides(Fl_Widget* o, void* v);
 	static void cb_thresholdSlides(Fl_Widget* o, void* v);
+	static void cb_glossySamplesSlides(Fl_Widget* o, void* v);
+	static void cb_lightSamplesSlides(Fl_Widget* o, void* v);
+	static void cb_blurSamplesSlides(Fl_Widget* o, void* v);
 	static void cb_fresnelSwitch(Fl_Widget* o, void* v);
 	static void cb_jitteringSwitch(Fl_Widget* o, void* v);
 	static void cb_textureMappingSwitch(Fl_Widget* o, void* v);
 	static void cb_glossySwitch(Fl_Widget* o, void* v);
+	static void cb_watertightSwitch(Fl_Widget* o, void* v);
+	static void cb_rouletteSwitch(Fl_Widget* o, void* v);
 
 
 	static void cb_render(Fl_Widget* o, void* v);
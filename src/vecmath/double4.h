@@ -0,0 +1,110 @@
+#ifndef __DOUBLE4_H__
+#define __DOUBLE4_H__
+
+// Four doubles worked on together, in two SSE2 registers: the lanes of
+// the tests that intersect a ray with four primitives at once (see
+// Box::nearest4).  Each lane gets exactly the arithmetic the scalar code
+// would do, so the results match it to the bit.
+//
+// Comparisons give masks, with every bit set in the lanes where they hold,
+// for select, any and the bitwise operators.
+
+#include <string.h>
+#include <emmintrin.h>
+
+class double4
+{
+public:
+	double4() {}
+	double4( double d ) : lo( _mm_set1_pd( d ) ), hi( lo ) {}
+	double4( double a, double b, double c, double d )
+		: lo( _mm_set_pd( b, a ) ), hi( _mm_set_pd( d, c ) ) {}
+	double4( __m128d l, __m128d h ) : lo( l ), hi( h ) {}
+
+	// a lane of a mask, set if b is
+	static double maskValue( bool b )
+	{
+		double v;
+		long long bits = b ? -1 : 0;
+		memcpy( &v, &bits, sizeof( v ) );
+		return v;
+	}
+
+	// lanes 0 to 3 into v[0 .. 4)
+	void store( double *v ) const
+	{
+		_mm_storeu_pd( v, lo );
+		_mm_storeu_pd( v + 2, hi );
+	}
+
+	friend double4 operator +( const double4& a, const double4& b )
+		{ return double4( _mm_add_pd( a.lo, b.lo ), _mm_add_pd( a.hi, b.hi ) ); }
+	friend double4 operator -( const double4& a, const double4& b )
+		{ return double4( _mm_sub_pd( a.lo, b.lo ), _mm_sub_pd( a.hi, b.hi ) ); }
+	friend double4 operator *( const double4& a, const double4& b )
+		{ return double4( _mm_mul_pd( a.lo, b.lo ), _mm_mul_pd( a.hi, b.hi ) ); }
+	friend double4 operator /( const double4& a, const double4& b )
+		{ return double4( _mm_div_pd( a.lo, b.lo ), _mm_div_pd( a.hi, b.hi ) ); }
+	friend double4 operator -( const double4& a )
+	{
+		__m128d sign = _mm_set1_pd( -0.0 );
+		return double4( _mm_xor_pd( a.lo, sign ), _mm_xor_pd( a.hi, sign ) );
+	}
+	friend double4 sqrt( const double4& a )
+		{ return double4( _mm_sqrt_pd( a.lo ), _mm_sqrt_pd( a.hi ) ); }
+
+	friend double4 operator <( const double4& a, const double4& b )
+		{ return double4( _mm_cmplt_pd( a.lo, b.lo ), _mm_cmplt_pd( a.hi, b.hi ) ); }
+	friend double4 operator <=( const double4& a, const double4& b )
+		{ return double4( _mm_cmple_pd( a.lo, b.lo ), _mm_cmple_pd( a.hi, b.hi ) ); }
+	friend double4 operator >( const double4& a, const double4& b )
+		{ return double4( _mm_cmpgt_pd( a.lo, b.lo ), _mm_cmpgt_pd( a.hi, b.hi ) ); }
+	friend double4 operator >=( const double4& a, const double4& b )
+		{ return double4( _mm_cmpge_pd( a.lo, b.lo ), _mm_cmpge_pd( a.hi, b.hi ) ); }
+	friend double4 operator ==( const double4& a, const double4& b )
+		{ return double4( _mm_cmpeq_pd( a.lo, b.lo ), _mm_cmpeq_pd( a.hi, b.hi ) ); }
+	friend double4 operator !=( const double4& a, const double4& b )
+		{ return double4( _mm_cmpneq_pd( a.lo, b.lo ), _mm_cmpneq_pd( a.hi, b.hi ) ); }
+
+	// on masks
+	friend double4 operator &( const double4& a, const double4& b )
+		{ return double4( _mm_and_pd( a.lo, b.lo ), _mm_and_pd( a.hi, b.hi ) ); }
+	friend double4 operator |( const double4& a, const double4& b )
+		{ return double4( _mm_or_pd( a.lo, b.lo ), _mm_or_pd( a.hi, b.hi ) ); }
+	// a & ~b
+	friend double4 andNot( const double4& a, const double4& b )
+		{ return double4( _mm_andnot_pd( b.lo, a.lo ), _mm_andnot_pd( b.hi, a.hi ) ); }
+
+	// a in the lanes where mask is set, b in the others
+	friend double4 select( const double4& mask, const double4& a, const double4& b )
+	{
+		return double4( _mm_or_pd( _mm_and_pd( mask.lo, a.lo ), _mm_andnot_pd( mask.lo, b.lo ) ),
+			_mm_or_pd( _mm_and_pd( mask.hi, a.hi ), _mm_andnot_pd( mask.hi, b.hi ) ) );
+	}
+
+	// is the mask set in any lane?
+	friend bool any( const double4& mask )
+		{ return _mm_movemask_pd( _mm_or_pd( mask.lo, mask.hi ) ) != 0; }
+
+	// The lane, of the first n, where t is least among those where mask
+	// is set, or -1 if there is none; the lowest one on a tie.
+	friend int minLane( const double4& t, const double4& mask, int n )
+	{
+		int bits = _mm_movemask_pd( mask.lo ) | (_mm_movemask_pd( mask.hi ) << 2);
+		double v[4];
+		t.store( v );
+		int best = -1;
+		for( int k = 0; k < n; ++k ) {
+			if( (bits & (1 << k)) && (best < 0 || v[k] < v[best]) ) {
+				best = k;
+			}
+		}
+		return best;
+	}
+
+private:
+	__m128d lo;                 // lanes 0 and 1
+	__m128d hi;                 // lanes 2 and 3
+};
+
+#endif // __DOUBLE4_H__
@@ -436,6 +436,11 @@ inline vec3f prod(const vec3f& a, const vec3f& b )
 	return vec3f( a.n[0]*b.n[0], a.n[1]*b.n[1], a.n[2]*b.n[2] );
 }
 
+inline double maxComponent( const vec3f& a )
+{
+	return maximum( a.n[0], maximum( a.n[1], a.n[2] ) );
+}
+
 inline vec4f operator -( const vec4f& v )
 {
 	return vec4f( -v.n[0], -v.n[1], -v.n[2], -v.n[3] );